@@ -0,0 +1,99 @@
+/*
+ * bench.c: a minimal harness for microbenchmarks of the tools' hot paths.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define	BENCH_TARGET	(NANOSEC / 5)	/* time for each run */
+#define	BENCH_REPS	5		/* runs of each benchmark */
+
+volatile long long bench_sink;		/* defeats dead code elimination */
+static int bench_stdout = -1;		/* real stdout while quiet */
+static FILE *bench_out;			/* results, even while quiet */
+
+void
+bench_init(void)
+{
+	int fd;
+
+	if ((fd = dup(STDOUT_FILENO)) < 0 ||
+	    (bench_out = fdopen(fd, "w")) == NULL)
+		err(1, "couldn't duplicate stdout");
+
+	tsh_clock_init(NULL);
+	(void) fprintf(bench_out, "%-32s %10s %12s\n", "BENCHMARK", "NS/OP",
+	    "OPS/S");
+}
+
+void
+bench_report(const char *name, double nsop)
+{
+	(void) fprintf(bench_out, "%-32s %10.1f %12.0f\n", name, nsop,
+	    nsop > 0 ? NANOSEC / nsop : 0);
+	(void) fflush(bench_out);
+}
+
+/*
+ * Discard (or stop discarding) anything the code under test prints.  The
+ * cost of formatting output is still incurred; only the write is avoided.
+ */
+void
+bench_quiet(boolean_t quiet)
+{
+	int fd;
+
+	(void) fflush(stdout);
+
+	if (quiet) {
+		if ((fd = open("/dev/null", O_WRONLY)) < 0 ||
+		    (bench_stdout = dup(STDOUT_FILENO)) < 0 ||
+		    dup2(fd, STDOUT_FILENO) < 0)
+			err(1, "couldn't redirect stdout");
+
+		(void) close(fd);
+	} else {
+		(void) dup2(bench_stdout, STDOUT_FILENO);
+		(void) close(bench_stdout);
+	}
+}
+
+static double
+bench_time(bench_func_t *func, void *arg, uint64_t n)
+{
+	hrtime_t start = tsh_gethrtime();
+
+	func(n, arg);
+
+	return ((double)(tsh_gethrtime() - start));
+}
+
+/*
+ * Run a benchmark, in which each operation is (by the caller's reckoning)
+ * nper operations.
+ */
+void
+bench_run(const char *name, bench_func_t *func, void *arg, uint64_t nper)
+{
+	uint64_t n = 1;
+	double t, best = 0;
+	int i;
+
+	while ((t = bench_time(func, arg, n)) < BENCH_TARGET / 10)
+		n *= 2;
+
+	n = (uint64_t)(n * (BENCH_TARGET / t)) + 1;
+
+	for (i = 0; i < BENCH_REPS; i++) {
+		t = bench_time(func, arg, n) / n / nper;
+
+		if (i == 0 || t < best)
+			best = t;
+	}
+
+	bench_report(name, best);
+}
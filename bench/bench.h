@@ -0,0 +1,24 @@
+/*
+ * bench.h: a minimal harness for microbenchmarks of the tools' hot paths.
+ *
+ * Each benchmark is a function that performs a given number of operations.
+ * The harness finds a number of operations that takes long enough to time
+ * reliably, and reports the best of several runs of that many (the best
+ * being the run least disturbed by everything else on the system).
+ */
+
+#ifndef _BENCH_H
+#define	_BENCH_H
+
+#include "tsh_clock.h"
+
+typedef void bench_func_t(uint64_t, void *);
+
+extern volatile long long bench_sink;
+
+extern void bench_init(void);
+extern void bench_report(const char *, double);
+extern void bench_quiet(boolean_t);
+extern void bench_run(const char *, bench_func_t *, void *, uint64_t);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,229 @@
+/*
+ * bench_replay.c: microbenchmarks of toshreplay:  parsing the trace
+ * (read_field() and read_log()), handing operations from the dispatcher to
+ * workers, and emitting results (tsh_dump()).
+ */
+
+#define	main	toshreplay_main
+#include "toshreplay.c"
+#undef main
+
+#include "bench.h"
+
+#define	BENCH_NLINES	100000		/* lines in each pass of read_log */
+#define	BENCH_NDUMP	100000		/* operations in each tsh_dump */
+#define	BENCH_NHANDOFF	10000		/* operations handed off */
+#define	BENCH_HANDOFF_GAP (50 * (NANOSEC / MICROSEC)) /* between handoffs */
+
+static char bench_line[] = "1855121 -> type=W blkno=1761485345 size=27136 "
+    "outr=0 outw=1 ffffd0c8dbccc000\n";
+
+static char *bench_log;			/* synthetic trace */
+static size_t bench_loglen;		/* length of synthetic trace */
+
+static void
+bench_read_field(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		bench_sink += read_field(1, bench_line,
+		    (i & 1) ? TSH_TOK_SIZE : TSH_TOK_BLKNO);
+	}
+}
+
+static void
+bench_free_ops(void)
+{
+	tsh_op_t *op, *next;
+
+	for (op = tsh_first; op != NULL; op = next) {
+		next = op->tsho_next;
+		free(op);
+	}
+
+	tsh_first = tsh_last = NULL;
+	tsh_firststart = tsh_laststart = NULL;
+	tsh_firstdone = tsh_lastdone = NULL;
+	tsh_nbytes = 0;
+}
+
+static void
+bench_read_log(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		if ((tsh_log = fmemopen(bench_log, bench_loglen, "r")) == NULL)
+			err(1, "fmemopen");
+
+		read_log();
+		(void) fclose(tsh_log);
+		bench_free_ops();
+	}
+}
+
+static void
+bench_dump(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		tsh_dump();
+}
+
+/*
+ * Create a trace of the given number of operations, each starting gap
+ * nanoseconds after the last.
+ */
+static void
+bench_mklog(int nlines, hrtime_t gap, off_t size)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = open_memstream(&bench_log, &bench_loglen)) == NULL)
+		err(1, "open_memstream");
+
+	for (i = 0; i < nlines; i++) {
+		(void) fprintf(fp, "%lld -> type=%c blkno=%d size=%ld "
+		    "outr=%d outw=%d ffffd0c8dbccc000\n", (long long)i * gap,
+		    (i % 3) ? 'R' : 'W', (i * 7919) % 1000000, (long)size,
+		    i % 5, i % 7);
+	}
+
+	(void) fclose(fp);
+}
+
+/*
+ * Build completed operations for tsh_dump() to emit.
+ */
+static void
+bench_mkdone(void)
+{
+	tsh_op_t *op;
+	int i;
+
+	bench_free_ops();
+
+	for (i = 0; i < BENCH_NDUMP; i++) {
+		if ((op = calloc(1, sizeof (tsh_op_t))) == NULL)
+			err(1, "calloc");
+
+		op->tsho_read = (i % 3) != 0;
+		op->tsho_offset = (off_t)i * 8192;
+		op->tsho_size = 8192;
+		op->tsho_sched = (hrtime_t)i * 10000;
+		op->tsho_start = op->tsho_sched + 500;
+		op->tsho_done = op->tsho_start + 95000;
+		op->tsho_worker = i % TSH_NWORKERS;
+
+		if (tsh_first == NULL) {
+			tsh_first = tsh_firststart = tsh_firstdone = op;
+		} else {
+			tsh_last->tsho_next = op;
+			tsh_last->tsho_nextstart = op;
+			tsh_last->tsho_nextdone = op;
+		}
+
+		tsh_last = tsh_laststart = tsh_lastdone = op;
+	}
+
+	tsh_start = 0;
+}
+
+/*
+ * Hand operations to workers at a pace that they can keep up with, and
+ * report the mean time from the dispatcher picking up an operation to its
+ * worker starting it.
+ */
+static void
+bench_handoff(void)
+{
+	char path[] = "/tmp/bench_replay.XXXXXX";
+	pthread_attr_t attr;
+	double ttl = 0;
+	tsh_op_t *op;
+	int i;
+
+	if ((tsh_fd = mkstemp(path)) < 0)
+		err(1, "mkstemp");
+
+	(void) unlink(path);
+
+	if ((tsh_buffer = malloc(tsh_bufsz)) == NULL ||
+	    (tsh_perf = calloc(tsh_nworkers + 1, sizeof (tsh_perf_t))) == NULL)
+		err(1, "couldn't allocate workers");
+
+	if (pthread_attr_init(&attr) != 0)
+		err(1, "pthread_attr_init");
+
+	tsh_sched_stack(&attr, tsh_bufsz);
+
+	for (i = 0; i < tsh_nworkers; i++) {
+		tsh_worker_t *worker;
+
+		if ((worker = malloc(sizeof (tsh_worker_t))) == NULL)
+			err(1, "couldn't allocate worker");
+
+		pthread_cond_init(&worker->tshw_cv, NULL);
+		worker->tshw_perf = &tsh_perf[i + 1];
+		worker->tshw_index = i;
+
+		if (pthread_create(&worker->tshw_id, &attr,
+		    tsh_worker, worker) != 0)
+			err(1, "couldn't create worker");
+	}
+
+	bench_free_ops();
+	free(bench_log);
+	bench_mklog(BENCH_NHANDOFF, BENCH_HANDOFF_GAP, 0);
+
+	if ((tsh_log = fmemopen(bench_log, bench_loglen, "r")) == NULL)
+		err(1, "fmemopen");
+
+	bench_quiet(B_TRUE);
+	read_log();
+	bench_quiet(B_FALSE);
+
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	while (tsh_nready < tsh_nworkers)
+		pthread_cond_wait(&tsh_main_cv, &tsh_worker_lock);
+
+	pthread_mutex_unlock(&tsh_worker_lock);
+
+	tsh_dispatcher(tsh_first, NULL, 0);
+
+	for (op = tsh_first; op != NULL; op = op->tsho_next)
+		ttl += op->tsho_start - (tsh_start + op->tsho_sched);
+
+	bench_report("replay.handoff (latency)", ttl / tsh_nops);
+}
+
+int
+main(void)
+{
+	bench_init();
+
+	tsh_size = (off_t)1 << 60;
+	tsh_nworkers = 4;
+
+	bench_run("replay.read_field", bench_read_field, NULL, 1);
+
+	bench_mklog(BENCH_NLINES, 10000, 8192);
+	bench_quiet(B_TRUE);
+	bench_run("replay.read_log (per line)", bench_read_log, NULL,
+	    BENCH_NLINES);
+	bench_quiet(B_FALSE);
+
+	bench_mkdone();
+	bench_quiet(B_TRUE);
+	bench_run("replay.tsh_dump (per record)", bench_dump, NULL,
+	    2 * BENCH_NDUMP);
+	bench_quiet(B_FALSE);
+
+	bench_handoff();
+
+	return (0);
+}
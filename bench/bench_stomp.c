@@ -0,0 +1,62 @@
+/*
+ * bench_stomp.c: microbenchmarks of toshstomp:  generating the offsets of
+ * reads and writes, and accounting for completed operations.
+ */
+
+#define	main	toshstomp_main
+#include "toshstomp.c"
+#undef main
+
+#include "bench.h"
+
+static void
+bench_read_lba(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		bench_sink += tsh_read_lba(tsh_bufsz);
+}
+
+static void
+bench_write_lba(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		bench_sink += tsh_write_lba_next(tsh_bufsz);
+}
+
+static void
+bench_stats(uint64_t n, void *arg __attribute__((__unused__)))
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		if (i & 1) {
+			stats_read(95000, tsh_bufsz);
+		} else {
+			stats_write(120000, tsh_bufsz);
+		}
+	}
+}
+
+int
+main(void)
+{
+	tsh_stats_t stats;
+
+	bench_init();
+
+	tsh_size = (off_t)1 << 40;
+	tsh_write_lba_init = tsh_write_lba_current = tsh_size / 2;
+
+	bench_run("stomp.read_lba", bench_read_lba, NULL, 1);
+	tsh_seed = tsh_rand_state = 1;
+	bench_run("stomp.read_lba (seeded)", bench_read_lba, NULL, 1);
+	bench_run("stomp.write_lba", bench_write_lba, NULL, 1);
+	bench_run("stomp.stats", bench_stats, NULL, 1);
+	stats_take(&stats);
+
+	return (0);
+}
@@ -0,0 +1,147 @@
+/*
+ * chew.h: state shared by the stages of toshchew, which processes each
+ * toshreplay output file in a single pass.
+ */
+
+#ifndef _CHEW_H
+#define	_CHEW_H
+
+#include "tsh_compat.h"
+#include "tsh_hist.h"
+#include "tsh_rec.h"
+
+#define	CHEW_HEAT_MAXCOLS	1024	/* most columns in a heatmap */
+#define	CHEW_HEAT_PERDECADE	10	/* rows per decade of latency */
+#define	CHEW_HEAT_NROWS		(8 * CHEW_HEAT_PERDECADE)
+
+typedef struct chew_heat {
+	hrtime_t	chh_width;		/* time covered by a column */
+	int		chh_ncols;		/* columns in use */
+	uint32_t	(*chh_cells)[2][CHEW_HEAT_NROWS]; /* reads, writes */
+} chew_heat_t;
+
+typedef struct chew_pct {
+	hrtime_t	chp_start;		/* start of current window */
+	tsh_hist_t	*chp_hist[2];		/* reads, writes in window */
+	FILE		*chp_fp;		/* percentiles per window */
+} chew_pct_t;
+
+typedef struct chew_qd {
+	hrtime_t	cqd_start;		/* start of current window */
+	hrtime_t	cqd_last;		/* time of last event */
+	int		cqd_out[2];		/* reads, writes outstanding */
+	double		cqd_area[2];		/* integral of cqd_out */
+	double		cqd_busy;		/* time with I/O outstanding */
+	uint64_t	cqd_done;		/* completions in window */
+	double		cqd_refx;		/* recent throughput */
+	double		cqd_refl;		/* recent queue depth */
+	int		cqd_nstalls;		/* stalled windows */
+	FILE		*cqd_fp;		/* queue depth per window */
+} chew_qd_t;
+
+#define	CHEW_SEEK_MINSHIFT	9	/* smallest distance: 512 bytes */
+#define	CHEW_SEEK_NDIST		34	/* buckets of seek distance */
+#define	CHEW_SEEK_NPOS		16	/* buckets of position in run */
+
+typedef struct chew_seek_op {
+	boolean_t	cso_read;		/* boolean: is read */
+	off_t		cso_blkno;		/* block number of op */
+	off_t		cso_size;		/* size of op */
+	int		cso_dist[2];		/* distance buckets */
+	int		cso_pos;		/* position in run bucket */
+} chew_seek_op_t;
+
+typedef struct chew_seek {
+	off_t		chs_end;		/* end of last op issued */
+	uint64_t	chs_runlen;		/* ops in current run */
+	uint64_t	chs_nruns;		/* runs of more than one op */
+	uint64_t	chs_nrunops;		/* ops in those runs */
+	chew_seek_op_t	*chs_ops;		/* ops in flight */
+	int		chs_nops;		/* number of ops in flight */
+	int		chs_maxops;		/* size of chs_ops */
+	tsh_hist_t	*chs_dist[2];		/* from last op, in flight */
+	tsh_hist_t	*chs_pos;		/* by position in run */
+} chew_seek_t;
+
+#define	CHEW_RAW_MINSHIFT	10	/* smallest age: ~1 microsecond */
+#define	CHEW_RAW_NAGE		34	/* buckets of age */
+
+/*
+ * An extent of the device, as last written:  a node in a treap ordered by
+ * start, of extents that don't overlap.
+ */
+typedef struct chew_raw_ext {
+	off_t		cre_start;		/* first byte */
+	off_t		cre_end;		/* byte past last */
+	hrtime_t	cre_time;		/* completion of last write */
+	hrtime_t	cre_max;		/* latest cre_time in subtree */
+	uint64_t	cre_pri;		/* treap priority */
+	struct chew_raw_ext *cre_left;		/* extents before */
+	struct chew_raw_ext *cre_right;		/* extents after */
+} chew_raw_ext_t;
+
+typedef struct chew_raw_op {
+	off_t		cro_blkno;		/* block number of read */
+	off_t		cro_size;		/* size of read */
+	int		cro_age;		/* age bucket */
+	boolean_t	cro_recent;		/* written within 1 ms */
+} chew_raw_op_t;
+
+typedef struct chew_raw {
+	chew_raw_ext_t	*chr_root;		/* extents written */
+	uint64_t	chr_nexts;		/* number of extents */
+	uint64_t	chr_rand;		/* state for priorities */
+	uint64_t	chr_nrecent;		/* reads of recent writes */
+	chew_raw_op_t	*chr_ops;		/* reads in flight */
+	int		chr_nops;		/* number of reads in flight */
+	int		chr_maxops;		/* size of chr_ops */
+	tsh_hist_t	*chr_age;		/* read latency by age */
+} chew_raw_t;
+
+typedef struct chew {
+	const char	*chew_file;		/* toshreplay output */
+	char		*chew_what;		/* prefix for processed files */
+	char		*chew_title;		/* title for plots */
+	FILE		*chew_reads;		/* read completions */
+	FILE		*chew_writes;		/* write completions */
+	FILE		*chew_q;		/* outstanding I/O */
+	tsh_hist_t	chew_rhist;		/* read latency */
+	tsh_hist_t	chew_whist;		/* write latency */
+	chew_heat_t	chew_heat;		/* time-by-latency heatmap */
+	chew_pct_t	chew_pct;		/* percentiles over time */
+	chew_qd_t	chew_qd;		/* queue depth over time */
+	chew_seek_t	chew_seek;		/* latency by seek distance */
+	chew_raw_t	chew_raw;		/* read latency by write age */
+	hrtime_t	chew_range;		/* time of last record */
+	uint64_t	chew_nrecs;		/* records processed */
+} chew_t;
+
+extern const char *chew_replay;
+extern hrtime_t chew_window;
+
+extern FILE *chew_open(const chew_t *, const char *);
+extern void chew_close(FILE *, const char *);
+extern uint64_t chew_tail(const tsh_hist_t *, int);
+extern void chew_row(FILE *, const tsh_hist_t *, int);
+
+extern void chew_heat_init(chew_t *);
+extern void chew_heat_rec(chew_t *, const tsh_rec_t *);
+extern void chew_heat_fini(chew_t *);
+
+extern void chew_pct_init(chew_t *);
+extern void chew_pct_rec(chew_t *, const tsh_rec_t *);
+extern void chew_pct_fini(chew_t *);
+
+extern void chew_qd_init(chew_t *);
+extern void chew_qd_rec(chew_t *, const tsh_rec_t *);
+extern void chew_qd_fini(chew_t *);
+
+extern void chew_seek_init(chew_t *);
+extern void chew_seek_rec(chew_t *, const tsh_rec_t *);
+extern void chew_seek_fini(chew_t *);
+
+extern void chew_raw_init(chew_t *);
+extern void chew_raw_rec(chew_t *, const tsh_rec_t *);
+extern void chew_raw_fini(chew_t *);
+
+#endif /* _CHEW_H */
@@ -0,0 +1,152 @@
+/*
+ * chew_heat.c: time-by-latency heatmaps.
+ *
+ * Completions are counted in a matrix of cells, one column per interval of
+ * time and one row per tenth of a decade of latency (from 1 microsecond to
+ * 100 seconds).  The number of columns is bounded:  when an operation falls
+ * beyond the last column, adjacent columns are merged and the width of each
+ * doubles.  The result is written as a gnuplot matrix for each of reads and
+ * writes, along with a gnuplot control file that renders them as images --
+ * which remains fast no matter how many operations were replayed.
+ */
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "chew.h"
+
+#define	CHEW_HEAT_MINWIDTH	(NANOSEC / MILLISEC)	/* initial width */
+
+void
+chew_heat_init(chew_t *c)
+{
+	chew_heat_t *heat = &c->chew_heat;
+
+	heat->chh_width = CHEW_HEAT_MINWIDTH;
+	heat->chh_ncols = 0;
+
+	if ((heat->chh_cells = calloc(CHEW_HEAT_MAXCOLS,
+	    sizeof (*heat->chh_cells))) == NULL)
+		err(1, "couldn't allocate heatmap");
+}
+
+static int
+chew_heat_row(hrtime_t latency)
+{
+	int row;
+
+	if (latency < NANOSEC / MICROSEC)
+		return (0);
+
+	row = (int)floor(CHEW_HEAT_PERDECADE *
+	    log10((double)latency / (NANOSEC / MICROSEC)));
+
+	return (row < CHEW_HEAT_NROWS ? row : CHEW_HEAT_NROWS - 1);
+}
+
+/*
+ * Merge pairs of columns, doubling the width of each.
+ */
+static void
+chew_heat_coarsen(chew_heat_t *heat)
+{
+	int i, op, row;
+
+	for (i = 0; i < CHEW_HEAT_MAXCOLS / 2; i++) {
+		for (op = 0; op < 2; op++) {
+			for (row = 0; row < CHEW_HEAT_NROWS; row++) {
+				heat->chh_cells[i][op][row] =
+				    heat->chh_cells[2 * i][op][row] +
+				    heat->chh_cells[2 * i + 1][op][row];
+			}
+		}
+	}
+
+	bzero(&heat->chh_cells[CHEW_HEAT_MAXCOLS / 2],
+	    (CHEW_HEAT_MAXCOLS / 2) * sizeof (*heat->chh_cells));
+
+	heat->chh_width *= 2;
+	heat->chh_ncols = (heat->chh_ncols + 1) / 2;
+}
+
+void
+chew_heat_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	chew_heat_t *heat = &c->chew_heat;
+	hrtime_t col;
+
+	if (!rec->tshr_done || rec->tshr_time < 0)
+		return;
+
+	while ((col = rec->tshr_time / heat->chh_width) >= CHEW_HEAT_MAXCOLS)
+		chew_heat_coarsen(heat);
+
+	if (col >= heat->chh_ncols)
+		heat->chh_ncols = col + 1;
+
+	heat->chh_cells[col][rec->tshr_read ? 0 : 1]
+	    [chew_heat_row(rec->tshr_latency)]++;
+}
+
+static void
+chew_heat_matrix(chew_t *c, const char *suffix, int op)
+{
+	chew_heat_t *heat = &c->chew_heat;
+	FILE *fp = chew_open(c, suffix);
+	int col, row;
+
+	for (row = 0; row < CHEW_HEAT_NROWS; row++) {
+		for (col = 0; col < heat->chh_ncols; col++) {
+			(void) fprintf(fp, col == 0 ? "%u" : " %u",
+			    heat->chh_cells[col][op][row]);
+		}
+
+		(void) fprintf(fp, "\n");
+	}
+
+	chew_close(fp, suffix);
+}
+
+void
+chew_heat_fini(chew_t *c)
+{
+	chew_heat_t *heat = &c->chew_heat;
+	const char *op[] = { "Read", "Write" };
+	const char *w = c->chew_what;
+	double width = (double)heat->chh_width / (NANOSEC / MILLISEC);
+	FILE *fp;
+	int i;
+
+	chew_heat_matrix(c, "reads.heat", 0);
+	chew_heat_matrix(c, "writes.heat", 1);
+
+	fp = chew_open(c, "heat.gpl");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n\n"
+	    "set xlabel \"Time (milliseconds)\"\n"
+	    "set ylabel \"Latency\"\n"
+	    "set cblabel \"Operations\"\n"
+	    "set ytics (\"1us\" 0, \"10us\" 10, \"100us\" 20, \"1ms\" 30, "
+	    "\"10ms\" 40, \"100ms\" 50, \"1s\" 60, \"10s\" 70)\n"
+	    "set yrange [-0.5:%d.5]\n"
+	    "set logscale cb\n"
+	    "set palette defined (0 \"white\", 1 \"skyblue\", "
+	    "2 \"dark-blue\", 3 \"black\")\n\n", CHEW_HEAT_NROWS - 1);
+
+	for (i = 0; i < 2; i++) {
+		(void) fprintf(fp, "set title \"%s latency of I/O operations "
+		    "%sreplayed on %s (%g ms per column)\"\n"
+		    "plot \"%s.%ss.heat\" matrix using "
+		    "(($1 + 0.5) * %g):2:($3 > 0 ? $3 : 1/0) "
+		    "with image notitle\n"
+		    "pause -1\n\n", op[i], chew_replay, c->chew_title, width,
+		    w, i == 0 ? "read" : "write", width);
+	}
+
+	chew_close(fp, "heat.gpl");
+
+	free(heat->chh_cells);
+	heat->chh_cells = NULL;
+}
@@ -0,0 +1,136 @@
+/*
+ * chew_pct.c: latency percentiles over time.
+ *
+ * Completions are counted in a histogram for each window of time; as each
+ * window ends, its p50, p99, p99.9 and maximum latency are written for reads
+ * and writes, and its histograms are merged into those for the replay as a
+ * whole.  A gnuplot control file plots these percentiles against the
+ * outstanding I/O, so that spikes in tail latency can be lined up with the
+ * queue depth at the time.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+
+#include "chew.h"
+
+hrtime_t chew_window = NANOSEC / 10;
+
+void
+chew_pct_init(chew_t *c)
+{
+	chew_pct_t *pct = &c->chew_pct;
+	int i;
+
+	pct->chp_start = 0;
+
+	for (i = 0; i < 2; i++) {
+		if ((pct->chp_hist[i] = malloc(sizeof (tsh_hist_t))) == NULL)
+			err(1, "couldn't allocate histogram");
+
+		tsh_hist_init(pct->chp_hist[i]);
+	}
+
+	pct->chp_fp = chew_open(c, "pct");
+}
+
+static void
+chew_pct_flush(chew_t *c)
+{
+	chew_pct_t *pct = &c->chew_pct;
+	tsh_hist_t *hist;
+	int i;
+
+	(void) fprintf(pct->chp_fp, "%lld", pct->chp_start);
+
+	for (i = 0; i < 2; i++) {
+		hist = pct->chp_hist[i];
+
+		if (hist->tshh_count == 0) {
+			(void) fprintf(pct->chp_fp, " 0 NaN NaN NaN NaN");
+			continue;
+		}
+
+		(void) fprintf(pct->chp_fp, " %llu %llu %llu %llu %llu",
+		    (unsigned long long)hist->tshh_count,
+		    (unsigned long long)tsh_hist_pct(hist, 0.5),
+		    (unsigned long long)tsh_hist_pct(hist, 0.99),
+		    (unsigned long long)tsh_hist_pct(hist, 0.999),
+		    (unsigned long long)hist->tshh_max);
+
+		tsh_hist_merge(i == 0 ? &c->chew_rhist : &c->chew_whist, hist);
+		tsh_hist_init(hist);
+	}
+
+	(void) fprintf(pct->chp_fp, "\n");
+	pct->chp_start += chew_window;
+}
+
+void
+chew_pct_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	chew_pct_t *pct = &c->chew_pct;
+
+	if (!rec->tshr_done)
+		return;
+
+	/*
+	 * Records are in time order, so a record beyond the current window
+	 * ends it (and any empty windows between).
+	 */
+	while (rec->tshr_time >= pct->chp_start + chew_window)
+		chew_pct_flush(c);
+
+	tsh_hist_add(pct->chp_hist[rec->tshr_read ? 0 : 1], rec->tshr_latency);
+}
+
+void
+chew_pct_fini(chew_t *c)
+{
+	chew_pct_t *pct = &c->chew_pct;
+	const char *w = c->chew_what;
+	FILE *fp;
+	int i;
+
+	if (pct->chp_hist[0]->tshh_count != 0 ||
+	    pct->chp_hist[1]->tshh_count != 0)
+		chew_pct_flush(c);
+
+	chew_close(pct->chp_fp, "pct");
+
+	for (i = 0; i < 2; i++)
+		free(pct->chp_hist[i]);
+
+	fp = chew_open(c, "pct.gpl");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set y2tics\n"
+	    "set key right Right\n\n"
+	    "set ylabel \"Latency (milliseconds)\"\n"
+	    "set y2label \"I/Os outstanding\"\n\n"
+	    "set title \"Latency per %g ms of I/O operations %sreplayed "
+	    "on %s\"\n\n"
+	    "set logscale y\n\n"
+	    "set xlabel \"Time (milliseconds)\"\n"
+	    "set xrange [0:%.6g]\n\n",
+	    (double)chew_window / (NANOSEC / MILLISEC), chew_replay,
+	    c->chew_title, (double)c->chew_range / 1000000);
+
+	(void) fprintf(fp, "plot \\\n"
+	    "\"%s.q\" using ($1/1000000):($2+$3) \\\n"
+	    "axes x1y2 title \"I/Os outstanding\" with filledcurves y1=0 "
+	    "lt rgb \"gray80\", \\\n"
+	    "\"%s.pct\" using ($1/1000000):($3/1000000) \\\n"
+	    "title \"Read p50\" with steps lt rgb \"skyblue\", \\\n"
+	    "\"%s.pct\" using ($1/1000000):($4/1000000) \\\n"
+	    "title \"Read p99\" with steps lt rgb \"dark-blue\", \\\n"
+	    "\"%s.pct\" using ($1/1000000):($6/1000000) \\\n"
+	    "title \"Read max\" with steps lt rgb \"black\", \\\n"
+	    "\"%s.pct\" using ($1/1000000):($9/1000000) \\\n"
+	    "title \"Write p99\" with steps lt rgb \"orange\", \\\n"
+	    "\"%s.pct\" using ($1/1000000):($11/1000000) \\\n"
+	    "title \"Write max\" with steps lt rgb \"red\"\n\n"
+	    "pause -1\n", w, w, w, w, w, w);
+
+	chew_close(fp, "pct.gpl");
+}
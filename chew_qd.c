@@ -0,0 +1,190 @@
+/*
+ * chew_qd.c: queue depth and utilization over time.
+ *
+ * The outstanding I/O in the replay output is sampled only as operations
+ * start and complete; here, we reconstruct the step function of outstanding
+ * reads and writes from those events, and integrate it over each window of
+ * time.  For each window, we report the time-weighted average queue depth,
+ * the fraction of time that any I/O was outstanding (the busy fraction),
+ * the throughput, and the latency and service time implied by Little's law
+ * (W = L / X) and by the utilization law (S = U / X).
+ *
+ * A window is flagged as stalled when throughput falls to less than half of
+ * what it has recently been while the queue remains at least half as deep:
+ * that is, the device is being offered work but isn't completing it.
+ */
+
+#include <err.h>
+
+#include "chew.h"
+
+#define	CHEW_QD_ALPHA	0.2		/* weight of each window in history */
+#define	CHEW_QD_STALL	0.5		/* fraction of throughput that stalls */
+
+void
+chew_qd_init(chew_t *c)
+{
+	chew_qd_t *qd = &c->chew_qd;
+
+	qd->cqd_start = 0;
+	qd->cqd_last = 0;
+	qd->cqd_out[0] = qd->cqd_out[1] = 0;
+	qd->cqd_area[0] = qd->cqd_area[1] = 0;
+	qd->cqd_busy = 0;
+	qd->cqd_done = 0;
+	qd->cqd_refx = qd->cqd_refl = 0;
+	qd->cqd_nstalls = 0;
+	qd->cqd_fp = chew_open(c, "qd");
+}
+
+/*
+ * Accumulate the outstanding I/O from the last event until the given time,
+ * which must be within the current window.
+ */
+static void
+chew_qd_integrate(chew_qd_t *qd, hrtime_t until)
+{
+	hrtime_t dt = until - qd->cqd_last;
+
+	if (dt <= 0)
+		return;
+
+	qd->cqd_area[0] += (double)qd->cqd_out[0] * dt;
+	qd->cqd_area[1] += (double)qd->cqd_out[1] * dt;
+
+	if (qd->cqd_out[0] + qd->cqd_out[1] > 0)
+		qd->cqd_busy += dt;
+
+	qd->cqd_last = until;
+}
+
+/*
+ * End the current window at the given time.
+ */
+static void
+chew_qd_flush(chew_qd_t *qd, hrtime_t end)
+{
+	double dur = (double)(end - qd->cqd_start) / NANOSEC;
+	double lr, lw, l, u, x;
+	boolean_t stalled = B_FALSE;
+
+	chew_qd_integrate(qd, end);
+
+	if (dur <= 0)
+		return;
+
+	lr = qd->cqd_area[0] / NANOSEC / dur;
+	lw = qd->cqd_area[1] / NANOSEC / dur;
+	l = lr + lw;
+	u = qd->cqd_busy / NANOSEC / dur;
+	x = qd->cqd_done / dur;
+
+	if (qd->cqd_refx > 0 && l >= 1 && l >= CHEW_QD_STALL * qd->cqd_refl &&
+	    x < CHEW_QD_STALL * qd->cqd_refx) {
+		stalled = B_TRUE;
+		qd->cqd_nstalls++;
+	}
+
+	(void) fprintf(qd->cqd_fp, "%lld %.3f %.3f %.3f %.4f %.1f ",
+	    qd->cqd_start, l, lr, lw, u, x);
+
+	if (x > 0) {
+		(void) fprintf(qd->cqd_fp, "%.0f %.0f",
+		    l / x * NANOSEC, u / x * NANOSEC);
+	} else {
+		(void) fprintf(qd->cqd_fp, "NaN NaN");
+	}
+
+	(void) fprintf(qd->cqd_fp, " %d\n", stalled);
+
+	/*
+	 * Stalled windows don't contribute to what we consider normal.
+	 */
+	if (!stalled && l >= 1) {
+		if (qd->cqd_refx == 0) {
+			qd->cqd_refx = x;
+			qd->cqd_refl = l;
+		} else {
+			qd->cqd_refx += CHEW_QD_ALPHA * (x - qd->cqd_refx);
+			qd->cqd_refl += CHEW_QD_ALPHA * (l - qd->cqd_refl);
+		}
+	}
+
+	qd->cqd_start = end;
+	qd->cqd_area[0] = qd->cqd_area[1] = 0;
+	qd->cqd_busy = 0;
+	qd->cqd_done = 0;
+}
+
+void
+chew_qd_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	chew_qd_t *qd = &c->chew_qd;
+	int op = rec->tshr_read ? 0 : 1;
+
+	while (rec->tshr_time >= qd->cqd_start + chew_window)
+		chew_qd_flush(qd, qd->cqd_start + chew_window);
+
+	chew_qd_integrate(qd, rec->tshr_time);
+
+	if (!rec->tshr_done) {
+		qd->cqd_out[op]++;
+		return;
+	}
+
+	/*
+	 * Completions of operations started before the output began (if
+	 * any) would otherwise take the queue depth negative.
+	 */
+	if (qd->cqd_out[op] > 0)
+		qd->cqd_out[op]--;
+
+	qd->cqd_done++;
+}
+
+void
+chew_qd_fini(chew_t *c)
+{
+	chew_qd_t *qd = &c->chew_qd;
+	const char *w = c->chew_what;
+	FILE *fp;
+
+	if (qd->cqd_last > qd->cqd_start)
+		chew_qd_flush(qd, qd->cqd_last);
+
+	chew_close(qd->cqd_fp, "qd");
+
+	if (qd->cqd_nstalls != 0) {
+		(void) printf("toshchew: %s: %d of %g ms windows stalled "
+		    "(throughput fell with I/O outstanding)\n", w,
+		    qd->cqd_nstalls, (double)chew_window / (NANOSEC / MILLISEC));
+	}
+
+	fp = chew_open(c, "qd.gpl");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set y2tics\n"
+	    "set key right Right\n\n"
+	    "set ylabel \"Operations per second\"\n"
+	    "set y2label \"Average I/Os outstanding\"\n\n"
+	    "set title \"Throughput and queue depth per %g ms of I/O "
+	    "operations %sreplayed on %s\"\n\n"
+	    "set xlabel \"Time (milliseconds)\"\n"
+	    "set xrange [0:%.6g]\n"
+	    "set yrange [0:*]\n"
+	    "set y2range [0:*]\n\n",
+	    (double)chew_window / (NANOSEC / MILLISEC), chew_replay,
+	    c->chew_title, (double)c->chew_range / 1000000);
+
+	(void) fprintf(fp, "plot \\\n"
+	    "\"%s.qd\" using ($1/1000000):2 \\\n"
+	    "axes x1y2 title \"Reads and writes outstanding\" with steps "
+	    "lt rgb \"gray60\", \\\n"
+	    "\"%s.qd\" using ($1/1000000):6 \\\n"
+	    "title \"Throughput\" with steps lt rgb \"dark-blue\", \\\n"
+	    "\"%s.qd\" using ($1/1000000):($9 ? $6 : 1/0) \\\n"
+	    "title \"Stalled\" with points pt 7 lt rgb \"red\"\n\n"
+	    "pause -1\n", w, w, w);
+
+	chew_close(fp, "qd.gpl");
+}
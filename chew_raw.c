@@ -0,0 +1,390 @@
+/*
+ * chew_raw.c: read latency by the age of the data read.
+ *
+ * A read of data that was written moments earlier may be served from the
+ * device's write cache -- or may have to wait for that cache to be destaged.
+ * To see which, we keep a map of the extents of the device written during
+ * the replay, each with the time that the write to it last completed.  As a
+ * read starts, we look up the most recent write to complete to any part of
+ * it; as it completes, its latency is counted in a histogram for that age,
+ * with ages bucketed by powers of two (and reads of data not written during
+ * the replay counted separately).
+ *
+ * The map is a treap of extents that don't overlap, ordered by their start
+ * and with each node carrying the latest completion in its subtree; a write
+ * replaces whatever extents it overlaps, and a read finds the latest write
+ * among them, both in logarithmic (expected) time.  Its size is bounded by
+ * the number of distinct extents written rather than by the replay's length.
+ */
+
+#include <sys/param.h>
+#include <err.h>
+#include <stdlib.h>
+
+#include "chew.h"
+#include "tsh_rand.h"
+
+#define	CHEW_RAW_NONE		0	/* not written during the replay */
+#define	CHEW_RAW_RECENT		(NANOSEC / MILLISEC)
+
+void
+chew_raw_init(chew_t *c)
+{
+	chew_raw_t *raw = &c->chew_raw;
+	int i;
+
+	raw->chr_root = NULL;
+	raw->chr_nexts = 0;
+	raw->chr_rand = 1;
+	raw->chr_nrecent = 0;
+	raw->chr_ops = NULL;
+	raw->chr_nops = raw->chr_maxops = 0;
+
+	if ((raw->chr_age = malloc(CHEW_RAW_NAGE *
+	    sizeof (tsh_hist_t))) == NULL)
+		err(1, "couldn't allocate histograms");
+
+	for (i = 0; i < CHEW_RAW_NAGE; i++)
+		tsh_hist_init(&raw->chr_age[i]);
+}
+
+static int
+chew_raw_bucket(hrtime_t age)
+{
+	int b = 2;
+
+	if (age < (1LL << CHEW_RAW_MINSHIFT))
+		return (1);
+
+	for (age >>= CHEW_RAW_MINSHIFT + 1; age != 0; age >>= 1)
+		b++;
+
+	return (b < CHEW_RAW_NAGE ? b : CHEW_RAW_NAGE - 1);
+}
+
+/*
+ * The smallest age (in nanoseconds) in the given bucket, or -1 for data not
+ * written during the replay.
+ */
+static long long
+chew_raw_lo(int b)
+{
+	if (b == CHEW_RAW_NONE)
+		return (-1);
+
+	if (b == 1)
+		return (0);
+
+	return (1LL << (CHEW_RAW_MINSHIFT + b - 2));
+}
+
+static void
+chew_raw_update(chew_raw_ext_t *e)
+{
+	e->cre_max = e->cre_time;
+
+	if (e->cre_left != NULL && e->cre_left->cre_max > e->cre_max)
+		e->cre_max = e->cre_left->cre_max;
+
+	if (e->cre_right != NULL && e->cre_right->cre_max > e->cre_max)
+		e->cre_max = e->cre_right->cre_max;
+}
+
+/*
+ * Split a treap into the extents that start before the given offset and
+ * those that start at or after it.
+ */
+static void
+chew_raw_split(chew_raw_ext_t *e, off_t off, chew_raw_ext_t **lp,
+    chew_raw_ext_t **rp)
+{
+	if (e == NULL) {
+		*lp = *rp = NULL;
+		return;
+	}
+
+	if (e->cre_start < off) {
+		chew_raw_split(e->cre_right, off, &e->cre_right, rp);
+		*lp = e;
+	} else {
+		chew_raw_split(e->cre_left, off, lp, &e->cre_left);
+		*rp = e;
+	}
+
+	chew_raw_update(e);
+}
+
+/*
+ * Merge two treaps, all of whose extents in l precede those in r.
+ */
+static chew_raw_ext_t *
+chew_raw_merge(chew_raw_ext_t *l, chew_raw_ext_t *r)
+{
+	if (l == NULL)
+		return (r);
+
+	if (r == NULL)
+		return (l);
+
+	if (l->cre_pri > r->cre_pri) {
+		l->cre_right = chew_raw_merge(l->cre_right, r);
+		chew_raw_update(l);
+		return (l);
+	}
+
+	r->cre_left = chew_raw_merge(l, r->cre_left);
+	chew_raw_update(r);
+	return (r);
+}
+
+static chew_raw_ext_t *
+chew_raw_last(chew_raw_ext_t *e)
+{
+	while (e != NULL && e->cre_right != NULL)
+		e = e->cre_right;
+
+	return (e);
+}
+
+static chew_raw_ext_t *
+chew_raw_ext(chew_raw_t *raw, off_t start, off_t end, hrtime_t time)
+{
+	chew_raw_ext_t *e;
+
+	if ((e = malloc(sizeof (chew_raw_ext_t))) == NULL)
+		err(1, "couldn't allocate extent");
+
+	e->cre_start = start;
+	e->cre_end = end;
+	e->cre_time = e->cre_max = time;
+	e->cre_pri = tsh_rand(&raw->chr_rand);
+	e->cre_left = e->cre_right = NULL;
+	raw->chr_nexts++;
+
+	return (e);
+}
+
+static void
+chew_raw_free(chew_raw_t *raw, chew_raw_ext_t *e)
+{
+	if (e == NULL)
+		return;
+
+	chew_raw_free(raw, e->cre_left);
+	chew_raw_free(raw, e->cre_right);
+	free(e);
+	raw->chr_nexts--;
+}
+
+/*
+ * Note a write to [start, end) that completed at the given time, replacing
+ * whatever it overlaps.  Any part of an extent that extends beyond either
+ * end of the write is kept as an extent of its own.
+ */
+static void
+chew_raw_write(chew_raw_t *raw, off_t start, off_t end, hrtime_t time)
+{
+	chew_raw_ext_t *l, *m, *r, *e;
+
+	chew_raw_split(raw->chr_root, start, &l, &r);
+
+	if ((e = chew_raw_last(l)) != NULL && e->cre_end > start) {
+		if (e->cre_end > end) {
+			r = chew_raw_merge(chew_raw_ext(raw, end, e->cre_end,
+			    e->cre_time), r);
+		}
+
+		e->cre_end = start;
+	}
+
+	chew_raw_split(r, end, &m, &r);
+
+	if ((e = chew_raw_last(m)) != NULL && e->cre_end > end) {
+		r = chew_raw_merge(chew_raw_ext(raw, end, e->cre_end,
+		    e->cre_time), r);
+	}
+
+	chew_raw_free(raw, m);
+
+	raw->chr_root = chew_raw_merge(chew_raw_merge(l,
+	    chew_raw_ext(raw, start, end, time)), r);
+}
+
+/*
+ * Return the latest completion of a write to any part of [start, end), or -1
+ * if none of it has been written.
+ */
+static hrtime_t
+chew_raw_read(chew_raw_t *raw, off_t start, off_t end)
+{
+	chew_raw_ext_t *l, *m, *r, *e;
+	hrtime_t latest = -1;
+
+	chew_raw_split(raw->chr_root, start, &l, &r);
+
+	if ((e = chew_raw_last(l)) != NULL && e->cre_end > start)
+		latest = e->cre_time;
+
+	chew_raw_split(r, end, &m, &r);
+
+	if (m != NULL && m->cre_max > latest)
+		latest = m->cre_max;
+
+	raw->chr_root = chew_raw_merge(l, chew_raw_merge(m, r));
+
+	return (latest);
+}
+
+static void
+chew_raw_start(chew_raw_t *raw, const tsh_rec_t *rec)
+{
+	off_t start = rec->tshr_blkno * DEV_BSIZE;
+	chew_raw_op_t *op;
+	hrtime_t latest;
+
+	if (raw->chr_nops == raw->chr_maxops) {
+		raw->chr_maxops = raw->chr_maxops == 0 ?
+		    64 : raw->chr_maxops * 2;
+
+		if ((raw->chr_ops = realloc(raw->chr_ops, raw->chr_maxops *
+		    sizeof (chew_raw_op_t))) == NULL)
+			err(1, "couldn't allocate reads in flight");
+	}
+
+	latest = chew_raw_read(raw, start, start + rec->tshr_size);
+
+	op = &raw->chr_ops[raw->chr_nops++];
+	op->cro_blkno = rec->tshr_blkno;
+	op->cro_size = rec->tshr_size;
+	op->cro_age = latest == -1 ? CHEW_RAW_NONE :
+	    chew_raw_bucket(rec->tshr_time - latest);
+	op->cro_recent = latest != -1 &&
+	    rec->tshr_time - latest < CHEW_RAW_RECENT;
+}
+
+void
+chew_raw_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	chew_raw_t *raw = &c->chew_raw;
+	chew_raw_op_t *op = NULL;
+	off_t start;
+	int i;
+
+	if (!rec->tshr_read) {
+		if (rec->tshr_done) {
+			start = rec->tshr_blkno * DEV_BSIZE;
+			chew_raw_write(raw, start, start + rec->tshr_size,
+			    rec->tshr_time);
+		}
+
+		return;
+	}
+
+	if (!rec->tshr_done) {
+		chew_raw_start(raw, rec);
+		return;
+	}
+
+	for (i = 0; i < raw->chr_nops; i++) {
+		op = &raw->chr_ops[i];
+
+		if (op->cro_blkno == rec->tshr_blkno &&
+		    op->cro_size == rec->tshr_size)
+			break;
+	}
+
+	/*
+	 * Reads started before the output began (if any) can't be placed.
+	 */
+	if (i == raw->chr_nops)
+		return;
+
+	tsh_hist_add(&raw->chr_age[op->cro_age], rec->tshr_latency);
+
+	if (op->cro_recent)
+		raw->chr_nrecent++;
+
+	*op = raw->chr_ops[--raw->chr_nops];
+}
+
+void
+chew_raw_fini(chew_t *c)
+{
+	chew_raw_t *raw = &c->chew_raw;
+	const char *w = c->chew_what;
+	tsh_hist_t *all;
+	uint64_t nwritten = 0, ntail = 0, nwrittentail = 0, n;
+	int i, tail;
+	FILE *fp;
+
+	/*
+	 * As for seek distance, the tail is the reads at or above the p99
+	 * latency of all reads.
+	 */
+	if ((all = malloc(sizeof (tsh_hist_t))) == NULL)
+		err(1, "couldn't allocate histogram");
+
+	tsh_hist_init(all);
+
+	for (i = 0; i < CHEW_RAW_NAGE; i++)
+		tsh_hist_merge(all, &raw->chr_age[i]);
+
+	tail = tsh_hist_bucket(tsh_hist_pct(all, 0.99));
+
+	fp = chew_open(c, "raw");
+
+	for (i = 0; i < CHEW_RAW_NAGE; i++) {
+		if (raw->chr_age[i].tshh_count == 0)
+			continue;
+
+		(void) fprintf(fp, "%lld", chew_raw_lo(i));
+		chew_row(fp, &raw->chr_age[i], tail);
+		(void) fprintf(fp, "\n");
+
+		n = chew_tail(&raw->chr_age[i], tail);
+		ntail += n;
+
+		if (i != CHEW_RAW_NONE) {
+			nwritten += raw->chr_age[i].tshh_count;
+			nwrittentail += n;
+		}
+	}
+
+	chew_close(fp, "raw");
+
+	if (all->tshh_count != 0) {
+		(void) printf("toshchew: %s: %.1f%% of reads were of data "
+		    "written during the replay (%.1f%% within 1 ms); they are "
+		    "%.1f%% of the read p99 tail\n", w,
+		    100.0 * nwritten / all->tshh_count,
+		    100.0 * raw->chr_nrecent / all->tshh_count,
+		    ntail == 0 ? 0.0 : 100.0 * nwrittentail / ntail);
+	}
+
+	free(all);
+	free(raw->chr_age);
+	free(raw->chr_ops);
+	chew_raw_free(raw, raw->chr_root);
+
+	fp = chew_open(c, "raw.gpl");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set key left Left\n\n"
+	    "set title \"Read latency by age of data read for I/O operations "
+	    "%sreplayed on %s\"\n\n"
+	    "set logscale xy\n"
+	    "set xlabel \"Time since last write (milliseconds)\"\n"
+	    "set ylabel \"Latency (milliseconds)\"\n\n",
+	    chew_replay, c->chew_title);
+
+	(void) fprintf(fp, "plot \\\n"
+	    "\"%s.raw\" using ($1 > 0 ? $1/1000000 : 1/0):($3/1000000) \\\n"
+	    "title \"p50\" with linespoints lt rgb \"skyblue\", \\\n"
+	    "\"%s.raw\" using ($1 > 0 ? $1/1000000 : 1/0):($4/1000000) \\\n"
+	    "title \"p99\" with linespoints lt rgb \"dark-blue\", \\\n"
+	    "\"%s.raw\" using ($1 > 0 ? $1/1000000 : 1/0):($5/1000000) \\\n"
+	    "title \"p99.9\" with linespoints lt rgb \"red\"\n\n"
+	    "pause -1\n", w, w, w);
+
+	chew_close(fp, "raw.gpl");
+}
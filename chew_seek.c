@@ -0,0 +1,293 @@
+/*
+ * chew_seek.c: latency by seek distance and sequentiality.
+ *
+ * On rotating media (and on arrays of it), latency depends on how far the
+ * heads must travel.  As each operation starts, we note its distance from
+ * where the last operation issued left off and from the nearest operation
+ * still in flight, along with its position in the run of sequential
+ * operations (each starting where the last left off) that it belongs to.
+ * As it completes, its latency is counted in a histogram for each of these,
+ * with distances bucketed by powers of two.
+ *
+ * To see how much of the tail is due to seeks, we compare the share of the
+ * operations in the p99 tail that followed a seek with the share of all
+ * operations that did.
+ */
+
+#include <sys/param.h>
+#include <err.h>
+#include <stdlib.h>
+
+#include "chew.h"
+
+#define	CHEW_SEEK_NONE		0	/* no distance: nothing to seek from */
+#define	CHEW_SEEK_ZERO		1	/* no distance: sequential */
+
+void
+chew_seek_init(chew_t *c)
+{
+	chew_seek_t *seek = &c->chew_seek;
+	int i;
+
+	seek->chs_end = -1;
+	seek->chs_runlen = 0;
+	seek->chs_nruns = seek->chs_nrunops = 0;
+	seek->chs_ops = NULL;
+	seek->chs_nops = seek->chs_maxops = 0;
+
+	for (i = 0; i < 2; i++) {
+		if ((seek->chs_dist[i] = malloc(CHEW_SEEK_NDIST *
+		    sizeof (tsh_hist_t))) == NULL)
+			err(1, "couldn't allocate histograms");
+	}
+
+	if ((seek->chs_pos = malloc(CHEW_SEEK_NPOS *
+	    sizeof (tsh_hist_t))) == NULL)
+		err(1, "couldn't allocate histograms");
+
+	for (i = 0; i < CHEW_SEEK_NDIST; i++) {
+		tsh_hist_init(&seek->chs_dist[0][i]);
+		tsh_hist_init(&seek->chs_dist[1][i]);
+	}
+
+	for (i = 0; i < CHEW_SEEK_NPOS; i++)
+		tsh_hist_init(&seek->chs_pos[i]);
+}
+
+static int
+chew_seek_bucket(off_t dist)
+{
+	int b = CHEW_SEEK_ZERO + 1;
+
+	if (dist == 0)
+		return (CHEW_SEEK_ZERO);
+
+	for (dist >>= CHEW_SEEK_MINSHIFT + 1; dist != 0; dist >>= 1)
+		b++;
+
+	return (b < CHEW_SEEK_NDIST ? b : CHEW_SEEK_NDIST - 1);
+}
+
+/*
+ * The smallest distance (in bytes) in the given bucket, or -1 for none.
+ */
+static long long
+chew_seek_lo(int b)
+{
+	if (b == CHEW_SEEK_NONE)
+		return (-1);
+
+	if (b == CHEW_SEEK_ZERO)
+		return (0);
+
+	return (1LL << (CHEW_SEEK_MINSHIFT + b - CHEW_SEEK_ZERO - 1));
+}
+
+static off_t
+chew_seek_dist(off_t from, off_t to)
+{
+	return (to > from ? to - from : from - to);
+}
+
+static void
+chew_seek_start(chew_seek_t *seek, const tsh_rec_t *rec)
+{
+	off_t start = rec->tshr_blkno * DEV_BSIZE, dist, near = -1;
+	chew_seek_op_t *op;
+	int i, pos;
+
+	if (seek->chs_nops == seek->chs_maxops) {
+		seek->chs_maxops = seek->chs_maxops == 0 ?
+		    64 : seek->chs_maxops * 2;
+
+		if ((seek->chs_ops = realloc(seek->chs_ops, seek->chs_maxops *
+		    sizeof (chew_seek_op_t))) == NULL)
+			err(1, "couldn't allocate ops in flight");
+	}
+
+	for (i = 0; i < seek->chs_nops; i++) {
+		op = &seek->chs_ops[i];
+		dist = chew_seek_dist(op->cso_blkno * DEV_BSIZE +
+		    op->cso_size, start);
+
+		if (near == -1 || dist < near)
+			near = dist;
+	}
+
+	op = &seek->chs_ops[seek->chs_nops++];
+	op->cso_read = rec->tshr_read;
+	op->cso_blkno = rec->tshr_blkno;
+	op->cso_size = rec->tshr_size;
+	op->cso_dist[0] = seek->chs_end == -1 ? CHEW_SEEK_NONE :
+	    chew_seek_bucket(chew_seek_dist(seek->chs_end, start));
+	op->cso_dist[1] = near == -1 ? CHEW_SEEK_NONE :
+	    chew_seek_bucket(near);
+
+	/*
+	 * An op that doesn't start where the last left off begins a new run.
+	 */
+	if (start != seek->chs_end) {
+		if (seek->chs_runlen > 1) {
+			seek->chs_nruns++;
+			seek->chs_nrunops += seek->chs_runlen;
+		}
+
+		seek->chs_runlen = 0;
+	}
+
+	seek->chs_runlen++;
+	seek->chs_end = start + rec->tshr_size;
+
+	for (pos = 0; pos < CHEW_SEEK_NPOS - 1 &&
+	    (2ULL << pos) <= seek->chs_runlen; pos++)
+		continue;
+
+	op->cso_pos = pos;
+}
+
+void
+chew_seek_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	chew_seek_t *seek = &c->chew_seek;
+	chew_seek_op_t *op = NULL;
+	int i;
+
+	if (!rec->tshr_done) {
+		chew_seek_start(seek, rec);
+		return;
+	}
+
+	for (i = 0; i < seek->chs_nops; i++) {
+		op = &seek->chs_ops[i];
+
+		if (op->cso_blkno == rec->tshr_blkno &&
+		    op->cso_size == rec->tshr_size &&
+		    op->cso_read == rec->tshr_read)
+			break;
+	}
+
+	/*
+	 * Operations started before the output began (if any) can't be
+	 * placed.
+	 */
+	if (i == seek->chs_nops)
+		return;
+
+	tsh_hist_add(&seek->chs_dist[0][op->cso_dist[0]], rec->tshr_latency);
+	tsh_hist_add(&seek->chs_dist[1][op->cso_dist[1]], rec->tshr_latency);
+	tsh_hist_add(&seek->chs_pos[op->cso_pos], rec->tshr_latency);
+
+	*op = seek->chs_ops[--seek->chs_nops];
+}
+
+void
+chew_seek_fini(chew_t *c)
+{
+	chew_seek_t *seek = &c->chew_seek;
+	const char *w = c->chew_what;
+	tsh_hist_t *all;
+	uint64_t nseeks = 0, ntail = 0, nseektail = 0, n;
+	int i, tail;
+	FILE *fp;
+
+	if (seek->chs_runlen > 1) {
+		seek->chs_nruns++;
+		seek->chs_nrunops += seek->chs_runlen;
+	}
+
+	/*
+	 * The tail is the operations at or above the p99 latency of all
+	 * operations (to the precision of the histograms).
+	 */
+	if ((all = malloc(sizeof (tsh_hist_t))) == NULL)
+		err(1, "couldn't allocate histogram");
+
+	tsh_hist_init(all);
+
+	for (i = 0; i < CHEW_SEEK_NDIST; i++)
+		tsh_hist_merge(all, &seek->chs_dist[0][i]);
+
+	tail = tsh_hist_bucket(tsh_hist_pct(all, 0.99));
+
+	fp = chew_open(c, "seek");
+
+	for (i = 0; i < CHEW_SEEK_NDIST; i++) {
+		if (seek->chs_dist[0][i].tshh_count == 0 &&
+		    seek->chs_dist[1][i].tshh_count == 0)
+			continue;
+
+		(void) fprintf(fp, "%lld", chew_seek_lo(i));
+		chew_row(fp, &seek->chs_dist[0][i], tail);
+		chew_row(fp, &seek->chs_dist[1][i], tail);
+		(void) fprintf(fp, "\n");
+
+		n = chew_tail(&seek->chs_dist[0][i], tail);
+		ntail += n;
+
+		if (i > CHEW_SEEK_ZERO) {
+			nseeks += seek->chs_dist[0][i].tshh_count;
+			nseektail += n;
+		}
+	}
+
+	chew_close(fp, "seek");
+
+	fp = chew_open(c, "runs");
+
+	for (i = 0; i < CHEW_SEEK_NPOS; i++) {
+		if (seek->chs_pos[i].tshh_count == 0)
+			continue;
+
+		(void) fprintf(fp, "%llu", 1ULL << i);
+		chew_row(fp, &seek->chs_pos[i], tail);
+		(void) fprintf(fp, "\n");
+	}
+
+	chew_close(fp, "runs");
+
+	if (all->tshh_count != 0) {
+		(void) printf("toshchew: %s: %.1f%% of ops sequential "
+		    "(%llu runs, mean %.1f ops); seeks are %.1f%% of ops and "
+		    "%.1f%% of the p99 tail\n", w,
+		    100.0 * seek->chs_dist[0][CHEW_SEEK_ZERO].tshh_count /
+		    all->tshh_count, (unsigned long long)seek->chs_nruns,
+		    seek->chs_nruns == 0 ? 0.0 :
+		    (double)seek->chs_nrunops / seek->chs_nruns,
+		    100.0 * nseeks / all->tshh_count,
+		    ntail == 0 ? 0.0 : 100.0 * nseektail / ntail);
+	}
+
+	free(all);
+	free(seek->chs_dist[0]);
+	free(seek->chs_dist[1]);
+	free(seek->chs_pos);
+	free(seek->chs_ops);
+
+	fp = chew_open(c, "seek.gpl");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set key left Left\n\n"
+	    "set title \"Latency by seek distance of I/O operations "
+	    "%sreplayed on %s\"\n\n"
+	    "set logscale xy\n"
+	    "set xlabel \"Seek distance (bytes)\"\n"
+	    "set ylabel \"Latency (milliseconds)\"\n\n",
+	    chew_replay, c->chew_title);
+
+	(void) fprintf(fp, "plot \\\n"
+	    "\"%s.seek\" using ($1 > 0 ? $1 : 1/0):($3/1000000) \\\n"
+	    "title \"p50 from last op\" with linespoints "
+	    "lt rgb \"skyblue\", \\\n"
+	    "\"%s.seek\" using ($1 > 0 ? $1 : 1/0):($4/1000000) \\\n"
+	    "title \"p99 from last op\" with linespoints "
+	    "lt rgb \"dark-blue\", \\\n"
+	    "\"%s.seek\" using ($1 > 0 ? $1 : 1/0):($8/1000000) \\\n"
+	    "title \"p50 from nearest in flight\" with linespoints "
+	    "lt rgb \"orange\", \\\n"
+	    "\"%s.seek\" using ($1 > 0 ? $1 : 1/0):($9/1000000) \\\n"
+	    "title \"p99 from nearest in flight\" with linespoints "
+	    "lt rgb \"red\"\n\n"
+	    "pause -1\n", w, w, w, w);
+
+	chew_close(fp, "seek.gpl");
+}
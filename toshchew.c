@@ -0,0 +1,438 @@
+/*
+ * toshchew.c: processes the output of toshreplay.
+ *
+ * Processes all files that contain "replay.out." in their name (or the files
+ * named on the command line), assuming that they are output from toshreplay.
+ * The suffix in the replay.out should be unique and will be used to generate
+ * a prefix for various processed files.  (For example, the toshreplay output
+ * file "toshreplay.out.dmab.wce" would result in processed files with the
+ * prefix "dmab.wce.")  Generates a per replay gnuplot control file, as well
+ * as a gnuplot control file that combines all replays (it is assumed that
+ * each replay is of the same trace but on a different device or
+ * configuration).  For each replay, a heatmap of latency over time is also
+ * generated, which stays legible (and quick to render) for long replays, as
+ * are latency percentiles, queue depth and utilization for each window of
+ * time, latency by seek distance and by position in sequential runs, and
+ * read latency by the time since the data read was last written.
+ *
+ * Each file is read exactly once, and files are processed in parallel.
+ * Latency distributions are accumulated in fixed-size histograms, so memory
+ * use doesn't grow with the length of the replay.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "chew.h"
+#include "tsh_clock.h"
+
+#define	CHEW_BUFSZ	(1 << 20)	/* stdio buffer for each file */
+#define	CHEW_LINE_MAX	4096		/* longest line we expect */
+
+const char *chew_replay = "";		/* title of the replayed trace */
+
+static chew_t *chew_files;		/* files to process */
+static int chew_nfiles;			/* number of files */
+static int chew_next;			/* next file to process */
+static pthread_mutex_t chew_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: toshchew [-j #threads] "
+	    "[-w window] [REPLAY_OUTPUT ...]\n");
+	exit(2);
+}
+
+/*
+ * Read the contents of a small file (such as a title), without its trailing
+ * newlines.  Returns NULL if the file doesn't exist.
+ */
+static char *
+chew_slurp(const char *path)
+{
+	char buf[1024];
+	size_t len;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (NULL);
+
+	len = fread(buf, 1, sizeof (buf) - 1, fp);
+	(void) fclose(fp);
+
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+
+	buf[len] = '\0';
+
+	return (strdup(buf));
+}
+
+/*
+ * Open the processed file with the given suffix for writing.
+ */
+FILE *
+chew_open(const chew_t *c, const char *suffix)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	(void) snprintf(path, sizeof (path), "%s.%s", c->chew_what, suffix);
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "couldn't open \"%s\"", path);
+
+	(void) setvbuf(fp, NULL, _IOFBF, CHEW_BUFSZ);
+
+	return (fp);
+}
+
+void
+chew_close(FILE *fp, const char *what)
+{
+	if (ferror(fp) || fclose(fp) != 0)
+		err(1, "couldn't write \"%s\"", what);
+}
+
+/*
+ * Write the cumulative distribution of latency, weighted by latency (that
+ * is, for each latency, the fraction of all time spent in operations that
+ * took that long or less).
+ */
+static void
+chew_cdf(chew_t *c, const char *suffix, const tsh_hist_t *hist)
+{
+	double ttl = 0, v = 0;
+	FILE *fp = chew_open(c, suffix);
+	int i;
+
+	for (i = 0; i < TSH_HIST_NBUCKETS; i++)
+		ttl += (double)hist->tshh_buckets[i] * tsh_hist_mid(i);
+
+	for (i = 0; i < TSH_HIST_NBUCKETS && ttl > 0; i++) {
+		if (hist->tshh_buckets[i] == 0)
+			continue;
+
+		v += (double)hist->tshh_buckets[i] * tsh_hist_mid(i);
+		(void) fprintf(fp, "%llu %.6g\n",
+		    (unsigned long long)tsh_hist_mid(i), v / ttl);
+	}
+
+	chew_close(fp, suffix);
+}
+
+/*
+ * Count the operations in the given histogram at or above the given bucket.
+ */
+uint64_t
+chew_tail(const tsh_hist_t *hist, int from)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = from; i < TSH_HIST_NBUCKETS; i++)
+		n += hist->tshh_buckets[i];
+
+	return (n);
+}
+
+/*
+ * Write the count, p50, p99 and p99.9 latency of the given histogram, and the
+ * number of its operations in the tail that starts at the given bucket.
+ */
+void
+chew_row(FILE *fp, const tsh_hist_t *hist, int tail)
+{
+	if (hist->tshh_count == 0) {
+		(void) fprintf(fp, " 0 NaN NaN NaN 0");
+		return;
+	}
+
+	(void) fprintf(fp, " %llu %llu %llu %llu %llu",
+	    (unsigned long long)hist->tshh_count,
+	    (unsigned long long)tsh_hist_pct(hist, 0.5),
+	    (unsigned long long)tsh_hist_pct(hist, 0.99),
+	    (unsigned long long)tsh_hist_pct(hist, 0.999),
+	    (unsigned long long)chew_tail(hist, tail));
+}
+
+static void
+chew_gpl(chew_t *c)
+{
+	FILE *fp = chew_open(c, "gpl");
+	const char *w = c->chew_what;
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set y2tics\n"
+	    "set key right Right\n\n"
+	    "set ylabel \"Latency (milliseconds)\"\n"
+	    "set y2label \"I/Os outstanding\"\n\n"
+	    "set title \"I/O operations %sreplayed on %s\"\n\n"
+	    "set logscale y\n\n"
+	    "set xlabel \"Time (milliseconds)\"\n"
+	    "set xrange [0:%.6g]\n"
+	    "set yrange [0.001:10000]\n\n", chew_replay, c->chew_title,
+	    (double)c->chew_range / 1000000);
+
+	(void) fprintf(fp, "plot \\\n"
+	    "\"%s.q\" using ($1/1000000):($2+$3) \\\n"
+	    "axes x1y2 title \"Reads outstanding\" with filledcurves y1=0 "
+	    "lt rgb \"gray80\", \\\n"
+	    "\"%s.q\" using ($1/1000000):3 \\\n"
+	    "axes x1y2 title \"Writes outstanding\" with filledcurves y1=0 "
+	    "lt rgb \"gray60\", \\\n"
+	    "\"%s.reads\" using ($1/1000000):($2/1000000) \\\n"
+	    "title \"Reads\" points 0.4 lt rgb \"dark-blue\", \\\n"
+	    "\"%s.writes\" using ($1/1000000):($2/1000000) \\\n"
+	    "title \"Writes\" points 0.4 lt rgb \"skyblue\"\n\n"
+	    "pause -1\n", w, w, w, w);
+
+	chew_close(fp, "gpl");
+}
+
+static void
+chew_rec(chew_t *c, const tsh_rec_t *rec)
+{
+	c->chew_nrecs++;
+	c->chew_range = rec->tshr_time;
+	chew_heat_rec(c, rec);
+	chew_pct_rec(c, rec);
+	chew_qd_rec(c, rec);
+	chew_seek_rec(c, rec);
+	chew_raw_rec(c, rec);
+
+	(void) fprintf(c->chew_q, "%lld %d %d\n", rec->tshr_time,
+	    rec->tshr_outr, rec->tshr_outw);
+
+	if (!rec->tshr_done)
+		return;
+
+	if (rec->tshr_read) {
+		(void) fprintf(c->chew_reads, "%lld %lld\n", rec->tshr_time,
+		    rec->tshr_latency);
+	} else {
+		(void) fprintf(c->chew_writes, "%lld %lld\n", rec->tshr_time,
+		    rec->tshr_latency);
+	}
+}
+
+/*
+ * Process a single toshreplay output file in one pass.
+ */
+static void
+chew_process(chew_t *c)
+{
+	char line[CHEW_LINE_MAX];
+	tsh_rec_t rec;
+	FILE *fp;
+
+	if ((fp = fopen(c->chew_file, "r")) == NULL)
+		err(1, "couldn't open \"%s\"", c->chew_file);
+
+	(void) setvbuf(fp, NULL, _IOFBF, CHEW_BUFSZ);
+
+	c->chew_reads = chew_open(c, "reads");
+	c->chew_writes = chew_open(c, "writes");
+	c->chew_q = chew_open(c, "q");
+	tsh_hist_init(&c->chew_rhist);
+	tsh_hist_init(&c->chew_whist);
+	chew_heat_init(c);
+	chew_pct_init(c);
+	chew_qd_init(c);
+	chew_seek_init(c);
+	chew_raw_init(c);
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (tsh_rec_parse(line, &rec) == 0)
+			chew_rec(c, &rec);
+	}
+
+	if (ferror(fp))
+		err(1, "couldn't read \"%s\"", c->chew_file);
+
+	(void) fclose(fp);
+
+	chew_close(c->chew_reads, "reads");
+	chew_close(c->chew_writes, "writes");
+	chew_close(c->chew_q, "q");
+
+	/*
+	 * The replay's latency histograms are merged from those of each
+	 * window, so the percentiles must be finished first.
+	 */
+	chew_pct_fini(c);
+	chew_qd_fini(c);
+	chew_seek_fini(c);
+	chew_raw_fini(c);
+	chew_cdf(c, "reads.cdf", &c->chew_rhist);
+	chew_cdf(c, "writes.cdf", &c->chew_whist);
+	chew_gpl(c);
+	chew_heat_fini(c);
+}
+
+static void *
+chew_thread(void *arg __attribute__((__unused__)))
+{
+	chew_t *c;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&chew_lock);
+		c = chew_next < chew_nfiles ? &chew_files[chew_next++] : NULL;
+		(void) pthread_mutex_unlock(&chew_lock);
+
+		if (c == NULL)
+			break;
+
+		chew_process(c);
+		(void) printf("toshchew: processed %s\n", c->chew_what);
+		(void) fflush(stdout);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Write a gnuplot control file that overlays the latency CDFs of all files.
+ */
+static void
+chew_all(void)
+{
+	const char *op[] = { "read", "write" };
+	FILE *fp;
+	int i, j;
+
+	if ((fp = fopen("all.gpl", "w")) == NULL)
+		err(1, "couldn't open \"all.gpl\"");
+
+	(void) fprintf(fp, "set terminal qt size 1000,772\n"
+	    "set y2tics\n"
+	    "set key bottom Right\n\n"
+	    "set title \"Cumulative distribution of read latency for "
+	    "replayed operations %s\"\n"
+	    "set ylabel \"Cumulative distribution of latency\"\n"
+	    "set xlabel \"Latency (milliseconds)\"\n\n", chew_replay);
+
+	for (j = 0; j < 2; j++) {
+		if (j != 0) {
+			(void) fprintf(fp, "set title \"Cumulative "
+			    "distribution of %s latency for replayed operations %s\"\n\n",
+			    op[j], chew_replay);
+		}
+
+		for (i = 0; i < chew_nfiles; i++) {
+			(void) fprintf(fp, "%s \"%s.%ss.cdf\" using "
+			    "($1/1000000):2 with lines title \"%s\"",
+			    i == 0 ? "plot" : ",", chew_files[i].chew_what,
+			    op[j], chew_files[i].chew_title);
+		}
+
+		(void) fprintf(fp, "\npause -1\n\n");
+	}
+
+	chew_close(fp, "all.gpl");
+}
+
+int
+main(int argc, char *argv[])
+{
+	glob_t gl;
+	char **files, *what, *end, path[PATH_MAX];
+	const char *base;
+	pthread_t *threads;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int c, i, nfiles;
+
+	while ((c = getopt(argc, argv, "j:w:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || nthreads <= 0)
+				errx(1, "invalid number of threads");
+			break;
+
+		case 'w':
+			if ((chew_window = tsh_clock_parse(optarg)) <= 0)
+				errx(1, "invalid window \"%s\"", optarg);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	bzero(&gl, sizeof (gl));
+
+	if (optind < argc) {
+		files = &argv[optind];
+		nfiles = argc - optind;
+	} else {
+		if (glob("*replay.out.*", 0, NULL, &gl) != 0)
+			errx(1, "no toshreplay output files found");
+
+		files = gl.gl_pathv;
+		nfiles = gl.gl_pathc;
+	}
+
+	if (glob("*replay.title", 0, NULL, &gl) == 0 && gl.gl_pathc == 1 &&
+	    (what = chew_slurp(gl.gl_pathv[0])) != NULL)
+		chew_replay = what;
+
+	if ((chew_files = calloc(nfiles, sizeof (chew_t))) == NULL)
+		err(1, "couldn't allocate files");
+
+	for (i = 0; i < nfiles; i++) {
+		chew_t *cf = &chew_files[i];
+
+		/*
+		 * The prefix is the file's name without its first two
+		 * dot-separated components.
+		 */
+		cf->chew_file = files[i];
+		base = (base = strrchr(files[i], '/')) != NULL ?
+		    base + 1 : files[i];
+
+		if ((base = strchr(base, '.')) == NULL ||
+		    (base = strchr(base + 1, '.')) == NULL || base[1] == '\0')
+			errx(1, "can't determine prefix for \"%s\"", files[i]);
+
+		if ((cf->chew_what = strdup(base + 1)) == NULL)
+			err(1, "couldn't allocate prefix");
+
+		(void) snprintf(path, sizeof (path), "%s.title",
+		    cf->chew_what);
+
+		if ((cf->chew_title = chew_slurp(path)) == NULL)
+			cf->chew_title = cf->chew_what;
+	}
+
+	chew_nfiles = nfiles;
+
+	if (nthreads > nfiles)
+		nthreads = nfiles;
+
+	if ((threads = calloc(nthreads, sizeof (pthread_t))) == NULL)
+		err(1, "couldn't allocate threads");
+
+	for (i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&threads[i], NULL,
+		    chew_thread, NULL)) != 0)
+			err(1, "couldn't create thread");
+	}
+
+	for (i = 0; i < nthreads; i++)
+		(void) pthread_join(threads[i], NULL);
+
+	chew_all();
+
+	return (0);
+}
@@ -0,0 +1,503 @@
+/*
+ * toshcmp.c: statistical comparison of toshreplay runs.
+ *
+ * Given the output of several replays of the same trace (for example, on
+ * different devices or configurations), compares the latency of each replay
+ * with that of the first (the baseline).  For reads and writes, reports:
+ *
+ *   - the difference in each of several percentiles (and in the mean), with
+ *     a bootstrap confidence interval on that difference;
+ *   - a two-sample Kolmogorov-Smirnov test of whether the two latency
+ *     distributions differ at all; and
+ *   - the difference in median and 99th percentile latency over each window
+ *     of time, so that differences can be attributed to phases of the trace.
+ *
+ * Bootstrapping is exact (resamples are drawn from the observed latencies, not
+ * from a histogram), and uses a fixed seed by default, so that comparisons are
+ * reproducible.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "tsh_clock.h"
+#include "tsh_compat.h"
+#include "tsh_rand.h"
+#include "tsh_rec.h"
+
+#define	CMP_BUFSZ	(1 << 20)	/* stdio buffer for each file */
+#define	CMP_LINE_MAX	4096		/* longest line we expect */
+#define	CMP_NPCTS	(sizeof (cmp_pcts) / sizeof (cmp_pcts[0]))
+#define	CMP_MEAN	CMP_NPCTS	/* index of the mean in estimates */
+
+typedef struct cmp_op {
+	hrtime_t	*cmpo_time;		/* completion times */
+	hrtime_t	*cmpo_lat;		/* latencies, in record order */
+	hrtime_t	*cmpo_sorted;		/* latencies, sorted */
+	size_t		cmpo_n;			/* number of completions */
+	size_t		cmpo_alloc;		/* allocated entries */
+	uint32_t	*cmpo_counts;		/* bootstrap resample counts */
+} cmp_op_t;
+
+typedef struct cmp_run {
+	const char	*cmpr_file;		/* toshreplay output */
+	const char	*cmpr_name;		/* short name for reports */
+	cmp_op_t	cmpr_op[2];		/* reads, writes */
+} cmp_run_t;
+
+static const double cmp_pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *cmp_pctnames[] = { "p50", "p90", "p99", "p99.9" };
+static const char *cmp_opnames[] = { "reads", "writes" };
+
+static int cmp_nboot = 1000;		/* bootstrap resamples */
+static double cmp_conf = 0.95;		/* confidence level */
+static uint64_t cmp_seed = 1;		/* bootstrap seed */
+static hrtime_t cmp_window = NANOSEC;	/* time window */
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: toshcmp [-b #resamples] "
+	    "[-c confidence] [-s seed] [-w window]\n"
+	    "    BASELINE REPLAY_OUTPUT ...\n");
+	exit(2);
+}
+
+static int
+cmp_hrcmp(const void *l, const void *r)
+{
+	hrtime_t lv = *(const hrtime_t *)l, rv = *(const hrtime_t *)r;
+
+	return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+static int
+cmp_dblcmp(const void *l, const void *r)
+{
+	double lv = *(const double *)l, rv = *(const double *)r;
+
+	return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+/*
+ * The rank (from 0) of the q'th quantile of n sorted values.
+ */
+static size_t
+cmp_rank(double q, size_t n)
+{
+	size_t r = (size_t)ceil(q * n);
+
+	return (r == 0 ? 0 : r - 1);
+}
+
+static void
+cmp_add(cmp_op_t *op, hrtime_t time, hrtime_t lat)
+{
+	if (op->cmpo_n == op->cmpo_alloc) {
+		op->cmpo_alloc = op->cmpo_alloc ? op->cmpo_alloc * 2 : 1024;
+
+		if ((op->cmpo_time = realloc(op->cmpo_time,
+		    op->cmpo_alloc * sizeof (hrtime_t))) == NULL ||
+		    (op->cmpo_lat = realloc(op->cmpo_lat,
+		    op->cmpo_alloc * sizeof (hrtime_t))) == NULL)
+			err(1, "couldn't allocate latencies");
+	}
+
+	op->cmpo_time[op->cmpo_n] = time;
+	op->cmpo_lat[op->cmpo_n++] = lat;
+}
+
+static void
+cmp_read(cmp_run_t *run)
+{
+	char line[CMP_LINE_MAX];
+	tsh_rec_t rec;
+	cmp_op_t *op;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(run->cmpr_file, "r")) == NULL)
+		err(1, "couldn't open \"%s\"", run->cmpr_file);
+
+	(void) setvbuf(fp, NULL, _IOFBF, CMP_BUFSZ);
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (tsh_rec_parse(line, &rec) != 0 || !rec.tshr_done)
+			continue;
+
+		cmp_add(&run->cmpr_op[rec.tshr_read ? 0 : 1],
+		    rec.tshr_time, rec.tshr_latency);
+	}
+
+	if (ferror(fp))
+		err(1, "couldn't read \"%s\"", run->cmpr_file);
+
+	(void) fclose(fp);
+
+	for (i = 0; i < 2; i++) {
+		op = &run->cmpr_op[i];
+
+		if (op->cmpo_n == 0)
+			continue;
+
+		if ((op->cmpo_sorted = malloc(op->cmpo_n *
+		    sizeof (hrtime_t))) == NULL ||
+		    (op->cmpo_counts = malloc(op->cmpo_n *
+		    sizeof (uint32_t))) == NULL)
+			err(1, "couldn't allocate latencies");
+
+		bcopy(op->cmpo_lat, op->cmpo_sorted,
+		    op->cmpo_n * sizeof (hrtime_t));
+		qsort(op->cmpo_sorted, op->cmpo_n, sizeof (hrtime_t),
+		    cmp_hrcmp);
+	}
+}
+
+/*
+ * Compute the percentiles and mean of a set of sorted latencies.  If state is
+ * non-NULL, the estimates are of a bootstrap resample rather than of the
+ * latencies themselves:  rather than sorting the resample, we count how many
+ * times each (already sorted) latency was drawn, and walk those counts.
+ */
+static void
+cmp_estimate(cmp_op_t *op, uint64_t *state, double *est)
+{
+	hrtime_t *v = op->cmpo_sorted;
+	size_t n = op->cmpo_n, i, cum = 0;
+	double sum = 0;
+	unsigned int p = 0;
+
+	if (state == NULL) {
+		for (p = 0; p < CMP_NPCTS; p++)
+			est[p] = v[cmp_rank(cmp_pcts[p], n)];
+
+		for (i = 0; i < n; i++)
+			sum += v[i];
+
+		est[CMP_MEAN] = sum / n;
+		return;
+	}
+
+	bzero(op->cmpo_counts, n * sizeof (uint32_t));
+
+	for (i = 0; i < n; i++) {
+		op->cmpo_counts[tsh_rand_uniform(state, n)]++;
+	}
+
+	for (i = 0; i < n; i++) {
+		cum += op->cmpo_counts[i];
+		sum += (double)op->cmpo_counts[i] * v[i];
+
+		while (p < CMP_NPCTS && cum > cmp_rank(cmp_pcts[p], n))
+			est[p++] = v[i];
+	}
+
+	est[CMP_MEAN] = sum / n;
+}
+
+/*
+ * The two-sample Kolmogorov-Smirnov statistic:  the largest difference
+ * between the empirical distribution functions.
+ */
+static double
+cmp_ks_d(const cmp_op_t *a, const cmp_op_t *b)
+{
+	size_t i = 0, j = 0;
+	double d = 0, diff;
+	hrtime_t v;
+
+	while (i < a->cmpo_n && j < b->cmpo_n) {
+		v = MIN(a->cmpo_sorted[i], b->cmpo_sorted[j]);
+
+		while (i < a->cmpo_n && a->cmpo_sorted[i] <= v)
+			i++;
+
+		while (j < b->cmpo_n && b->cmpo_sorted[j] <= v)
+			j++;
+
+		diff = fabs((double)i / a->cmpo_n - (double)j / b->cmpo_n);
+		d = MAX(d, diff);
+	}
+
+	return (d);
+}
+
+/*
+ * The asymptotic significance of a KS statistic of d between samples of size
+ * n and m (see Numerical Recipes, 14.3).
+ */
+static double
+cmp_ks_p(double d, size_t n, size_t m)
+{
+	double ne = (double)n * m / (n + m);
+	double lambda = (sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * d;
+	double sum = 0, term, sign = 2;
+	int j;
+
+	if (lambda < 0.2)
+		return (1.0);
+
+	for (j = 1; j <= 100; j++) {
+		term = sign * exp(-2.0 * j * j * lambda * lambda);
+		sum += term;
+
+		if (fabs(term) <= 1e-10 * fabs(sum))
+			break;
+
+		sign = -sign;
+	}
+
+	return (MAX(0.0, MIN(1.0, sum)));
+}
+
+static void
+cmp_pctdeltas(const char *what, cmp_op_t *a, cmp_op_t *b,
+    const char *aname, const char *bname)
+{
+	double ea[CMP_NPCTS + 1], eb[CMP_NPCTS + 1];
+	double *deltas[CMP_NPCTS + 1], lo, hi;
+	uint64_t state = cmp_seed;
+	unsigned int p;
+	int i, ilo, ihi;
+
+	for (p = 0; p <= CMP_NPCTS; p++) {
+		if ((deltas[p] = malloc(cmp_nboot * sizeof (double))) == NULL)
+			err(1, "couldn't allocate resamples");
+	}
+
+	for (i = 0; i < cmp_nboot; i++) {
+		cmp_estimate(a, &state, ea);
+		cmp_estimate(b, &state, eb);
+
+		for (p = 0; p <= CMP_NPCTS; p++)
+			deltas[p][i] = eb[p] - ea[p];
+	}
+
+	cmp_estimate(a, NULL, ea);
+	cmp_estimate(b, NULL, eb);
+
+	ilo = (int)floor((1 - cmp_conf) / 2 * cmp_nboot);
+	ihi = MIN(cmp_nboot - 1, (int)ceil((1 + cmp_conf) / 2 * cmp_nboot) - 1);
+
+	(void) printf("%s: %s: %lu ops, %s: %lu ops (latency in us)\n", what,
+	    aname, (unsigned long)a->cmpo_n, bname, (unsigned long)b->cmpo_n);
+	(void) printf("%8s %12s %12s %12s  %.0f%% CI\n", "", aname, bname,
+	    "delta", cmp_conf * 100);
+
+	for (p = 0; p <= CMP_NPCTS; p++) {
+		qsort(deltas[p], cmp_nboot, sizeof (double), cmp_dblcmp);
+		lo = deltas[p][ilo];
+		hi = deltas[p][ihi];
+
+		(void) printf("%8s %12.1f %12.1f %+12.1f  [%+.1f, %+.1f]%s\n",
+		    p == CMP_MEAN ? "mean" : cmp_pctnames[p],
+		    ea[p] / 1000, eb[p] / 1000, (eb[p] - ea[p]) / 1000,
+		    lo / 1000, hi / 1000, lo > 0 || hi < 0 ? " *" : "");
+
+		free(deltas[p]);
+	}
+}
+
+/*
+ * Sort a run's latencies into windows, returning the index of the first
+ * latency of each window (plus one past the last window) in *startp, and the
+ * latencies in *latp.  Returns the number of windows.
+ */
+static size_t
+cmp_windows(const cmp_op_t *op, size_t **startp, hrtime_t **latp)
+{
+	size_t nwin = 0, i, w, *start, *fill;
+	hrtime_t *lat;
+
+	for (i = 0; i < op->cmpo_n; i++)
+		nwin = MAX(nwin, (size_t)(MAX(op->cmpo_time[i], 0) /
+		    cmp_window) + 1);
+
+	if ((start = calloc(nwin + 1, sizeof (size_t))) == NULL ||
+	    (fill = calloc(nwin + 1, sizeof (size_t))) == NULL ||
+	    (lat = malloc(MAX(op->cmpo_n, 1) * sizeof (hrtime_t))) == NULL)
+		err(1, "couldn't allocate windows");
+
+	for (i = 0; i < op->cmpo_n; i++)
+		start[MAX(op->cmpo_time[i], 0) / cmp_window + 1]++;
+
+	for (w = 0; w < nwin; w++)
+		start[w + 1] += start[w];
+
+	for (i = 0; i < op->cmpo_n; i++) {
+		w = MAX(op->cmpo_time[i], 0) / cmp_window;
+		lat[start[w] + fill[w]++] = op->cmpo_lat[i];
+	}
+
+	for (w = 0; w < nwin; w++) {
+		qsort(&lat[start[w]], start[w + 1] - start[w],
+		    sizeof (hrtime_t), cmp_hrcmp);
+	}
+
+	free(fill);
+	*startp = start;
+	*latp = lat;
+
+	return (nwin);
+}
+
+static void
+cmp_windiffs(const char *what, const cmp_op_t *a, const cmp_op_t *b,
+    const char *aname, const char *bname)
+{
+	size_t *sa, *sb, na, nb, w, n;
+	hrtime_t *la, *lb;
+	double pa[2], pb[2], q;
+	int p;
+
+	na = cmp_windows(a, &sa, &la);
+	nb = cmp_windows(b, &sb, &lb);
+
+	(void) printf("%s: per %.3fs window (latency in us)\n", what,
+	    (double)cmp_window / NANOSEC);
+	(void) printf("%10s %10s %10s %10s %10s %10s %10s\n", "TIME",
+	    "p50", "p50", "delta", "p99", "p99", "delta");
+	(void) printf("%10s %10.10s %10.10s %10s %10.10s %10.10s\n", "",
+	    aname, bname, "", aname, bname);
+
+	for (w = 0; w < MAX(na, nb); w++) {
+		if (w >= na || w >= nb || sa[w + 1] == sa[w] ||
+		    sb[w + 1] == sb[w])
+			continue;
+
+		for (p = 0; p < 2; p++) {
+			q = p ? 0.99 : 0.5;
+			n = sa[w + 1] - sa[w];
+			pa[p] = la[sa[w] + cmp_rank(q, n)] / 1000.0;
+			n = sb[w + 1] - sb[w];
+			pb[p] = lb[sb[w] + cmp_rank(q, n)] / 1000.0;
+		}
+
+		(void) printf("%10.3f %10.1f %10.1f %+10.1f %10.1f %10.1f "
+		    "%+10.1f\n", (double)w * cmp_window / NANOSEC,
+		    pa[0], pb[0], pb[0] - pa[0], pa[1], pb[1], pb[1] - pa[1]);
+	}
+
+	free(sa);
+	free(sb);
+	free(la);
+	free(lb);
+}
+
+static void
+cmp_compare(cmp_run_t *base, cmp_run_t *run)
+{
+	cmp_op_t *a, *b;
+	double d, p;
+	int i;
+
+	(void) printf("toshcmp: %s vs. %s\n\n", run->cmpr_name,
+	    base->cmpr_name);
+
+	for (i = 0; i < 2; i++) {
+		a = &base->cmpr_op[i];
+		b = &run->cmpr_op[i];
+
+		if (a->cmpo_n == 0 || b->cmpo_n == 0) {
+			(void) printf("%s: not present in both runs\n\n",
+			    cmp_opnames[i]);
+			continue;
+		}
+
+		cmp_pctdeltas(cmp_opnames[i], a, b, base->cmpr_name,
+		    run->cmpr_name);
+
+		d = cmp_ks_d(a, b);
+		p = cmp_ks_p(d, a->cmpo_n, b->cmpo_n);
+
+		(void) printf("%s: Kolmogorov-Smirnov D = %.4f, p = %.3g "
+		    "(distributions %s)\n\n", cmp_opnames[i], d, p,
+		    p < 1 - cmp_conf ? "differ" : "not shown to differ");
+
+		cmp_windiffs(cmp_opnames[i], a, b, base->cmpr_name,
+		    run->cmpr_name);
+		(void) printf("\n");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	cmp_run_t *runs;
+	const char *base;
+	char *end;
+	int c, i, nruns;
+
+	while ((c = getopt(argc, argv, "b:c:s:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			cmp_nboot = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || cmp_nboot <= 0)
+				errx(1, "invalid number of resamples");
+			break;
+
+		case 'c':
+			cmp_conf = strtod(optarg, &end);
+
+			if (*end == '%') {
+				cmp_conf /= 100;
+				end++;
+			}
+
+			if (*end != '\0' || cmp_conf <= 0 || cmp_conf >= 1)
+				errx(1, "invalid confidence level");
+			break;
+
+		case 's':
+			cmp_seed = strtoull(optarg, &end, 0);
+
+			if (*end != '\0')
+				errx(1, "invalid seed");
+			break;
+
+		case 'w':
+			if ((cmp_window = tsh_clock_parse(optarg)) <= 0)
+				errx(1, "invalid window \"%s\"", optarg);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if ((nruns = argc - optind) < 2)
+		usage();
+
+	if ((runs = calloc(nruns, sizeof (cmp_run_t))) == NULL)
+		err(1, "couldn't allocate runs");
+
+	for (i = 0; i < nruns; i++) {
+		/*
+		 * As with toshchew, a run's name is its file name without the
+		 * first two dot-separated components.
+		 */
+		runs[i].cmpr_file = argv[optind + i];
+		runs[i].cmpr_name = runs[i].cmpr_file;
+		base = strrchr(runs[i].cmpr_file, '/');
+		base = base != NULL ? base + 1 : runs[i].cmpr_file;
+
+		if ((base = strchr(base, '.')) != NULL &&
+		    (base = strchr(base + 1, '.')) != NULL && base[1] != '\0')
+			runs[i].cmpr_name = base + 1;
+
+		cmp_read(&runs[i]);
+	}
+
+	for (i = 1; i < nruns; i++)
+		cmp_compare(&runs[0], &runs[i]);
+
+	return (0);
+}
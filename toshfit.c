@@ -0,0 +1,871 @@
+/*
+ * toshfit.c: fits a queueing model to a toshreplay run, and extrapolates its
+ * latency to heavier load.
+ *
+ * The device is modelled as k servers fed by a single queue (an M/G/k
+ * system, with the Allen-Cunneen approximation extending it to the measured
+ * burstiness of arrivals), whose service time is a mixture of the device's
+ * ordinary service time and of stalls -- for example, waits for a write cache
+ * to destage -- that become more likely as more is written:
+ *
+ *   - The service time distribution is taken from the operations that
+ *     started with the device (nearly) idle, whose latency is all service.
+ *     Of those, the operations that took more than a multiple of the median
+ *     (-t, default 10) are stalls.
+ *   - The probability of a stall is fitted (by least squares) as a linear
+ *     function of the rate at which data was being written.
+ *   - The number of servers k is fitted by minimizing the error in predicted
+ *     mean latency over each window of time (-w, default 1s), given the rate
+ *     of arrivals and writes in that window.
+ *
+ * The fit error is reported for the mean, p50 and p99 latency and the mean
+ * queue depth over each window.  Latency is then extrapolated to arrival
+ * rates that are multiples (-x, default 1.5 and 2) of those of the replay,
+ * with each window's arrival and write rates scaled accordingly.
+ * Percentiles are estimated by simulating draws from the model (with a fixed
+ * seed; -s to change it), so that extrapolations are reproducible.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "tsh_clock.h"
+#include "tsh_compat.h"
+#include "tsh_hist.h"
+#include "tsh_rand.h"
+#include "tsh_rec.h"
+
+#define	FIT_BUFSZ	(1 << 20)	/* stdio buffer for the file */
+#define	FIT_LINE_MAX	4096		/* longest line we expect */
+#define	FIT_MINIDLE	100		/* fewest ops for service time */
+#define	FIT_MAXOUT	1024		/* most outstanding we count */
+#define	FIT_MAXK	256		/* most servers we consider */
+#define	FIT_MINOPS	20		/* fewest ops in a window that we fit */
+#define	FIT_NDRAW	1000		/* simulated ops per window */
+#define	FIT_MAXSCALES	16		/* most loads to extrapolate to */
+
+typedef struct fit_flight {
+	off_t		fitf_blkno;		/* block number of op */
+	off_t		fitf_size;		/* size of op */
+	boolean_t	fitf_read;		/* boolean: is read */
+	hrtime_t	fitf_start;		/* start time */
+	int		fitf_out;		/* outstanding when started */
+} fit_flight_t;
+
+typedef struct fit_done {
+	hrtime_t	fitd_start;		/* start time */
+	hrtime_t	fitd_lat;		/* latency */
+	int		fitd_out;		/* outstanding when started */
+} fit_done_t;
+
+typedef struct fit_win {
+	uint64_t	fitw_n;			/* ops started */
+	double		fitw_wbytes;		/* bytes of writes started */
+	double		fitw_area;		/* integral of outstanding */
+	double		fitw_gaps[2];		/* sum and sum of squares */
+	size_t		fitw_first;		/* first of its done ops */
+	size_t		fitw_ndone;		/* done ops started in it */
+} fit_win_t;
+
+typedef struct fit_model {
+	double		fitm_lambda;		/* arrivals per ns */
+	double		fitm_pi;		/* probability of a stall */
+	double		fitm_es;		/* mean service time (ns) */
+	double		fitm_rho;		/* utilization of each server */
+	double		fitm_c;			/* probability of waiting */
+	double		fitm_wq;		/* mean wait (ns) */
+	boolean_t	fitm_sat;		/* saturated */
+} fit_model_t;
+
+static const char *fit_file;		/* toshreplay output */
+static hrtime_t fit_window = NANOSEC;	/* time window */
+static double fit_stall = 10;		/* stall, as multiple of median */
+static uint64_t fit_seed = 1;		/* simulation seed */
+static double fit_scales[FIT_MAXSCALES] = { 1.5, 2 };
+static int fit_nscales = 2;
+
+static fit_flight_t *fit_flight;	/* ops in flight */
+static int fit_nflight;			/* number of ops in flight */
+static int fit_maxflight;		/* size of fit_flight */
+static fit_done_t *fit_done;		/* completed ops */
+static size_t fit_ndone;		/* number of completed ops */
+static size_t fit_maxdone;		/* size of fit_done */
+static fit_win_t *fit_wins;		/* windows of time */
+static size_t fit_nwins;		/* number of windows */
+static size_t fit_maxwins;		/* size of fit_wins */
+static double fit_ca2;			/* squared cv of interarrival time */
+
+static hrtime_t *fit_body;		/* ordinary service times */
+static size_t fit_nbody;
+static hrtime_t *fit_stalls;		/* stalls */
+static size_t fit_nstalls;
+static double fit_moments[2][2];	/* body, stall: E[S], E[S^2] */
+static double fit_pia, fit_pib;		/* stall probability vs. write rate */
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: toshfit [-s seed] [-t stall] "
+	    "[-w window] [-x load[,load...]]\n"
+	    "    REPLAY_OUTPUT\n");
+	exit(2);
+}
+
+static int
+fit_hrcmp(const void *l, const void *r)
+{
+	hrtime_t lv = *(const hrtime_t *)l, rv = *(const hrtime_t *)r;
+
+	return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+static int
+fit_dblcmp(const void *l, const void *r)
+{
+	double lv = *(const double *)l, rv = *(const double *)r;
+
+	return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+/*
+ * Order completed ops by the window in which they started, and then by
+ * latency.
+ */
+static int
+fit_donecmp(const void *l, const void *r)
+{
+	const fit_done_t *ld = l, *rd = r;
+	hrtime_t lw = ld->fitd_start / fit_window;
+	hrtime_t rw = rd->fitd_start / fit_window;
+
+	if (lw != rw)
+		return (lw < rw ? -1 : 1);
+
+	return (fit_hrcmp(&ld->fitd_lat, &rd->fitd_lat));
+}
+
+/*
+ * The rank (from 0) of the q'th quantile of n sorted values.
+ */
+static size_t
+fit_rank(double q, size_t n)
+{
+	size_t r = (size_t)ceil(q * n);
+
+	return (r == 0 ? 0 : r - 1);
+}
+
+/*
+ * Return the window containing the given time, growing the windows to
+ * include it.
+ */
+static fit_win_t *
+fit_win(hrtime_t time)
+{
+	size_t w = MAX(time, 0) / fit_window, n;
+
+	if (w >= fit_maxwins) {
+		n = MAX(w + 1, fit_maxwins * 2);
+
+		if ((fit_wins = realloc(fit_wins, n * sizeof (fit_win_t))) ==
+		    NULL)
+			err(1, "couldn't allocate windows");
+
+		bzero(&fit_wins[fit_maxwins], (n - fit_maxwins) *
+		    sizeof (fit_win_t));
+		fit_maxwins = n;
+	}
+
+	fit_nwins = MAX(fit_nwins, w + 1);
+
+	return (&fit_wins[w]);
+}
+
+/*
+ * Accumulate the outstanding I/O from the time of the last record until
+ * the given time, splitting it among the windows that it spans.
+ */
+static void
+fit_integrate(hrtime_t from, hrtime_t until, int out)
+{
+	hrtime_t end;
+
+	while (from < until) {
+		end = MIN(until, (from / fit_window + 1) * fit_window);
+		fit_win(from)->fitw_area += (double)out * (end - from);
+		from = end;
+	}
+}
+
+static void
+fit_start(const tsh_rec_t *rec)
+{
+	static hrtime_t last = -1;
+	fit_flight_t *op;
+	fit_win_t *win;
+	double d;
+
+	if (fit_nflight == fit_maxflight) {
+		fit_maxflight = fit_maxflight == 0 ? 64 : fit_maxflight * 2;
+
+		if ((fit_flight = realloc(fit_flight, fit_maxflight *
+		    sizeof (fit_flight_t))) == NULL)
+			err(1, "couldn't allocate ops in flight");
+	}
+
+	op = &fit_flight[fit_nflight++];
+	op->fitf_blkno = rec->tshr_blkno;
+	op->fitf_size = rec->tshr_size;
+	op->fitf_read = rec->tshr_read;
+	op->fitf_start = rec->tshr_time;
+	op->fitf_out = rec->tshr_outr + rec->tshr_outw;
+
+	win = fit_win(rec->tshr_time);
+	win->fitw_n++;
+
+	if (!rec->tshr_read)
+		win->fitw_wbytes += rec->tshr_size;
+
+	if (last != -1) {
+		d = rec->tshr_time - last;
+		win->fitw_gaps[0] += d;
+		win->fitw_gaps[1] += d * d;
+	}
+
+	last = rec->tshr_time;
+}
+
+static void
+fit_complete(const tsh_rec_t *rec)
+{
+	fit_flight_t *op = NULL;
+	fit_done_t *done;
+	int i;
+
+	for (i = 0; i < fit_nflight; i++) {
+		op = &fit_flight[i];
+
+		if (op->fitf_blkno == rec->tshr_blkno &&
+		    op->fitf_size == rec->tshr_size &&
+		    op->fitf_read == rec->tshr_read)
+			break;
+	}
+
+	/*
+	 * Operations started before the output began (if any) can't be
+	 * placed.
+	 */
+	if (i == fit_nflight)
+		return;
+
+	if (fit_ndone == fit_maxdone) {
+		fit_maxdone = fit_maxdone == 0 ? 1024 : fit_maxdone * 2;
+
+		if ((fit_done = realloc(fit_done, fit_maxdone *
+		    sizeof (fit_done_t))) == NULL)
+			err(1, "couldn't allocate completions");
+	}
+
+	done = &fit_done[fit_ndone++];
+	done->fitd_start = op->fitf_start;
+	done->fitd_lat = rec->tshr_latency;
+	done->fitd_out = op->fitf_out;
+
+	*op = fit_flight[--fit_nflight];
+}
+
+static void
+fit_read(void)
+{
+	char line[FIT_LINE_MAX];
+	hrtime_t last = 0;
+	tsh_rec_t rec;
+	fit_win_t *win;
+	double mean, ca2 = 0;
+	uint64_t n = 0;
+	size_t w;
+	int out = 0;
+	FILE *fp;
+
+	if ((fp = fopen(fit_file, "r")) == NULL)
+		err(1, "couldn't open \"%s\"", fit_file);
+
+	(void) setvbuf(fp, NULL, _IOFBF, FIT_BUFSZ);
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (tsh_rec_parse(line, &rec) != 0)
+			continue;
+
+		/*
+		 * Each record carries what was outstanding before the event;
+		 * we take the outstanding I/O to have stayed at its level
+		 * after the last event until this one.
+		 */
+		fit_integrate(last, rec.tshr_time, out);
+		last = rec.tshr_time;
+		out = rec.tshr_outr + rec.tshr_outw + (rec.tshr_done ? -1 : 1);
+
+		if (rec.tshr_done) {
+			fit_complete(&rec);
+		} else {
+			fit_start(&rec);
+		}
+	}
+
+	if (ferror(fp))
+		err(1, "couldn't read \"%s\"", fit_file);
+
+	(void) fclose(fp);
+
+	if (fit_ndone == 0)
+		errx(1, "no operations in \"%s\"", fit_file);
+
+	/*
+	 * The variability of arrivals is taken within each window (so that
+	 * changes in rate from window to window don't count as burstiness),
+	 * and averaged over the windows, weighted by their arrivals.
+	 */
+	for (w = 0; w < fit_nwins; w++) {
+		win = &fit_wins[w];
+
+		if (win->fitw_n < FIT_MINOPS || win->fitw_gaps[0] == 0)
+			continue;
+
+		mean = win->fitw_gaps[0] / win->fitw_n;
+		ca2 += (win->fitw_gaps[1] / win->fitw_n / (mean * mean) - 1) *
+		    win->fitw_n;
+		n += win->fitw_n;
+	}
+
+	fit_ca2 = n == 0 ? 1 : ca2 / n;
+}
+
+/*
+ * Take the service time distribution from the operations that started with
+ * the fewest others outstanding (at least FIT_MINIDLE of them), dividing it
+ * into ordinary service and stalls, and fit the probability of a stall to
+ * the rate at which data was being written.
+ */
+static void
+fit_service(int *outp, hrtime_t *medianp)
+{
+	uint64_t counts[FIT_MAXOUT + 1], n = 0;
+	double x, y, sx = 0, sy = 0, sxx = 0, sxy = 0;
+	hrtime_t *lat, median, thresh;
+	size_t i, j, nidle = 0;
+	int m;
+
+	bzero(counts, sizeof (counts));
+
+	for (i = 0; i < fit_ndone; i++)
+		counts[MIN(fit_done[i].fitd_out, FIT_MAXOUT)]++;
+
+	for (m = 0; m < FIT_MAXOUT; m++) {
+		if ((n += counts[m]) >= FIT_MINIDLE)
+			break;
+	}
+
+	if ((lat = malloc(fit_ndone * sizeof (hrtime_t))) == NULL)
+		err(1, "couldn't allocate service times");
+
+	for (i = 0; i < fit_ndone; i++) {
+		if (fit_done[i].fitd_out <= m)
+			lat[nidle++] = fit_done[i].fitd_lat;
+	}
+
+	qsort(lat, nidle, sizeof (hrtime_t), fit_hrcmp);
+	median = lat[fit_rank(0.5, nidle)];
+	thresh = (hrtime_t)(fit_stall * median);
+
+	for (fit_nbody = 0; fit_nbody < nidle && lat[fit_nbody] < thresh;
+	    fit_nbody++)
+		continue;
+
+	fit_body = lat;
+	fit_stalls = &lat[fit_nbody];
+	fit_nstalls = nidle - fit_nbody;
+
+	for (i = 0; i < nidle; i++) {
+		j = i < fit_nbody ? 0 : 1;
+		fit_moments[j][0] += (double)lat[i];
+		fit_moments[j][1] += (double)lat[i] * lat[i];
+	}
+
+	for (j = 0; j < 2; j++) {
+		n = j == 0 ? fit_nbody : fit_nstalls;
+
+		if (n != 0) {
+			fit_moments[j][0] /= n;
+			fit_moments[j][1] /= n;
+		}
+	}
+
+	/*
+	 * A linear probability model:  each idle op's stall (1) or not (0),
+	 * against the write rate (in bytes/ns) of the window it started in.
+	 */
+	for (i = 0; i < fit_ndone; i++) {
+		if (fit_done[i].fitd_out > m)
+			continue;
+
+		x = fit_win(fit_done[i].fitd_start)->fitw_wbytes / fit_window;
+		y = fit_done[i].fitd_lat >= thresh;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	fit_pib = nidle * sxx - sx * sx > 0 ?
+	    (nidle * sxy - sx * sy) / (nidle * sxx - sx * sx) : 0;
+	fit_pia = (sy - fit_pib * sx) / nidle;
+
+	*outp = m;
+	*medianp = median;
+}
+
+/*
+ * The probability that an arrival must wait in an M/M/k queue offered a
+ * load of a (in servers), by way of the Erlang B recurrence.
+ */
+static double
+fit_erlangc(int k, double a)
+{
+	double b = 1, rho = a / k;
+	int i;
+
+	for (i = 1; i <= k; i++)
+		b = a * b / (i + a * b);
+
+	return (b / (1 - rho * (1 - b)));
+}
+
+/*
+ * Evaluate the model for a window, with its arrival and write rates scaled
+ * by the given factor, on k servers.
+ */
+static void
+fit_model(const fit_win_t *win, double scale, int k, fit_model_t *m)
+{
+	double es2, cs2;
+
+	m->fitm_lambda = scale * win->fitw_n / fit_window;
+	m->fitm_pi = fit_nstalls == 0 ? 0 :
+	    MAX(0, MIN(1, fit_pia + fit_pib * scale * win->fitw_wbytes /
+	    fit_window));
+	m->fitm_es = (1 - m->fitm_pi) * fit_moments[0][0] +
+	    m->fitm_pi * fit_moments[1][0];
+	es2 = (1 - m->fitm_pi) * fit_moments[0][1] +
+	    m->fitm_pi * fit_moments[1][1];
+	cs2 = es2 / (m->fitm_es * m->fitm_es) - 1;
+	m->fitm_rho = m->fitm_lambda * m->fitm_es / k;
+	m->fitm_sat = m->fitm_rho >= 1;
+
+	if (m->fitm_sat) {
+		m->fitm_c = 1;
+		m->fitm_wq = HUGE_VAL;
+		return;
+	}
+
+	/*
+	 * Allen-Cunneen:  the M/M/k wait, scaled by the variability of
+	 * arrivals and of service.
+	 */
+	m->fitm_c = fit_erlangc(k, m->fitm_lambda * m->fitm_es);
+	m->fitm_wq = m->fitm_c / (k / m->fitm_es - m->fitm_lambda) *
+	    (fit_ca2 + cs2) / 2;
+}
+
+static double
+fit_uniform(uint64_t *state)
+{
+	return ((tsh_rand(state) >> 11) * (1.0 / (1ULL << 53)));
+}
+
+/*
+ * Simulate FIT_NDRAW ops under the given model:  each draws its service
+ * time from ordinary service or (with the probability of a stall) from
+ * stalls, and waits with the probability of waiting, for a time drawn from
+ * an exponential distribution with the mean conditional wait.
+ */
+static void
+fit_draw(const fit_model_t *m, uint64_t *state, double *lat)
+{
+	double u;
+	int i;
+
+	for (i = 0; i < FIT_NDRAW; i++) {
+		if (m->fitm_sat) {
+			lat[i] = HUGE_VAL;
+			continue;
+		}
+
+		if (fit_nstalls != 0 && fit_uniform(state) < m->fitm_pi) {
+			lat[i] = fit_stalls[tsh_rand_uniform(state,
+			    fit_nstalls)];
+		} else {
+			lat[i] = fit_body[tsh_rand_uniform(state, fit_nbody)];
+		}
+
+		if ((u = fit_uniform(state)) < m->fitm_c) {
+			lat[i] -= m->fitm_wq / m->fitm_c *
+			    log(1 - fit_uniform(state));
+		}
+	}
+
+	qsort(lat, FIT_NDRAW, sizeof (double), fit_dblcmp);
+}
+
+/*
+ * Fit the number of servers:  the k (of those that don't saturate any
+ * window) with the least error in predicted mean latency, weighted by the
+ * number of ops in each window.
+ */
+static int
+fit_servers(void)
+{
+	double err, errbest = HUGE_VAL, sum, sumobs, obs;
+	fit_model_t m;
+	fit_win_t *win;
+	int k, kbest = -1;
+	size_t w, i;
+
+	for (k = 1; k <= FIT_MAXK; k++) {
+		sum = sumobs = 0;
+
+		for (w = 0; w < fit_nwins; w++) {
+			win = &fit_wins[w];
+
+			if (win->fitw_ndone < FIT_MINOPS)
+				continue;
+
+			fit_model(win, 1, k, &m);
+
+			if (m.fitm_sat)
+				break;
+
+			for (obs = 0, i = 0; i < win->fitw_ndone; i++)
+				obs += fit_done[win->fitw_first + i].fitd_lat;
+
+			sum += fabs(m.fitm_es + m.fitm_wq -
+			    obs / win->fitw_ndone) * win->fitw_ndone;
+			sumobs += obs;
+		}
+
+		if (w < fit_nwins || sumobs == 0)
+			continue;
+
+		if ((err = sum / sumobs) < errbest) {
+			errbest = err;
+			kbest = k;
+		}
+	}
+
+	if (kbest == -1) {
+		errx(1, "no model of up to %d servers keeps up with the "
+		    "replay", FIT_MAXK);
+	}
+
+	return (kbest);
+}
+
+/*
+ * Report the error of the fitted model over the windows of the replay:  for
+ * each of the mean, p50, p99 and queue depth, the sum of the absolute
+ * differences from what was observed, relative to the sum of what was
+ * observed, each window weighted by its number of ops.
+ */
+static void
+fit_error(int k, uint64_t *state, double *lat)
+{
+	double sum[4], obs[4], pred[4], mean;
+	fit_model_t m;
+	fit_win_t *win;
+	fit_done_t *d;
+	size_t w, i, n;
+	int j;
+
+	bzero(sum, sizeof (sum));
+	bzero(obs, sizeof (obs));
+
+	for (w = 0; w < fit_nwins; w++) {
+		win = &fit_wins[w];
+		d = &fit_done[win->fitw_first];
+
+		if ((n = win->fitw_ndone) < FIT_MINOPS)
+			continue;
+
+		fit_model(win, 1, k, &m);
+		fit_draw(&m, state, lat);
+
+		for (mean = 0, i = 0; i < n; i++)
+			mean += d[i].fitd_lat;
+
+		mean /= n;
+		pred[0] = m.fitm_es + m.fitm_wq;
+		pred[1] = lat[fit_rank(0.5, FIT_NDRAW)];
+		pred[2] = lat[fit_rank(0.99, FIT_NDRAW)];
+		pred[3] = m.fitm_lambda * pred[0];
+
+		for (j = 0; j < 4; j++) {
+			double o = j == 0 ? mean :
+			    j == 1 ? d[fit_rank(0.5, n)].fitd_lat :
+			    j == 2 ? d[fit_rank(0.99, n)].fitd_lat :
+			    win->fitw_area / fit_window;
+
+			sum[j] += fabs(pred[j] - o) * n;
+			obs[j] += o * n;
+		}
+	}
+
+	(void) printf("toshfit: fit: %d server%s; error in mean %.1f%%, "
+	    "p50 %.1f%%, p99 %.1f%%, queue depth %.1f%%\n", k,
+	    k == 1 ? "" : "s",
+	    obs[0] == 0 ? 0 : 100 * sum[0] / obs[0],
+	    obs[1] == 0 ? 0 : 100 * sum[1] / obs[1],
+	    obs[2] == 0 ? 0 : 100 * sum[2] / obs[2],
+	    obs[3] == 0 ? 0 : 100 * sum[3] / obs[3]);
+}
+
+static void
+fit_print(const char *what, double util, double peak, double sat,
+    const double *v)
+{
+	int i;
+
+	/*
+	 * Utilization is that of the model, and isn't shown for what was
+	 * observed.
+	 */
+	if (util < 0) {
+		(void) printf("%8s %6s %6s %5.1f%%", what, "-", "-", sat);
+	} else {
+		(void) printf("%8s %6.2f %6.2f %5.1f%%", what, util, peak, sat);
+	}
+
+	for (i = 0; i < 5; i++) {
+		if (isinf(v[i])) {
+			(void) printf(" %10s", "sat");
+		} else {
+			(void) printf(" %10.1f", v[i] / 1000);
+		}
+	}
+
+	(void) printf("\n");
+}
+
+/*
+ * Extrapolate the replay's latency to the given multiple of its load,
+ * pooling the simulated ops of each window in a histogram, each weighted by
+ * the ops of its window (so that the histogram's size doesn't grow with the
+ * number of windows).  Ops in saturated windows are counted only in nsat:
+ * they are slower than any other, so a percentile that falls among them is
+ * unbounded, and any other is that percentile of the rest.
+ */
+static void
+fit_extrapolate(int k, double scale, uint64_t *state, double *lat,
+    tsh_hist_t *hist)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+	double v[5], ttl = 0, util = 0, peak = 0, nsat = 0, sum = 0;
+	fit_model_t m;
+	fit_win_t *win;
+	size_t w, i;
+	int p;
+	char what[16];
+
+	tsh_hist_init(hist);
+
+	for (w = 0; w < fit_nwins; w++) {
+		win = &fit_wins[w];
+
+		if (win->fitw_n == 0)
+			continue;
+
+		fit_model(win, scale, k, &m);
+		fit_draw(&m, state, lat);
+
+		util += m.fitm_rho * win->fitw_n;
+		peak = MAX(peak, m.fitm_rho);
+		ttl += win->fitw_n;
+
+		if (m.fitm_sat) {
+			nsat += win->fitw_n;
+			continue;
+		}
+
+		sum += (m.fitm_es + m.fitm_wq) * win->fitw_n;
+
+		for (i = 0; i < FIT_NDRAW; i++)
+			tsh_hist_addn(hist, (uint64_t)lat[i], win->fitw_n);
+	}
+
+	v[0] = nsat != 0 ? HUGE_VAL : sum / ttl;
+
+	for (p = 0; p < 4; p++) {
+		if (pcts[p] * ttl > (ttl - nsat) * (1 + 1e-9)) {
+			v[p + 1] = HUGE_VAL;
+		} else {
+			v[p + 1] = tsh_hist_pct(hist,
+			    pcts[p] * ttl / (ttl - nsat));
+		}
+	}
+
+	(void) snprintf(what, sizeof (what), "%.3gx", scale);
+	fit_print(what, util / ttl, peak, 100 * nsat / ttl, v);
+}
+
+static void
+fit_scales_parse(char *arg)
+{
+	char *end;
+
+	for (fit_nscales = 0; fit_nscales < FIT_MAXSCALES; fit_nscales++) {
+		fit_scales[fit_nscales] = strtod(arg, &end);
+
+		if (end == arg || fit_scales[fit_nscales] <= 0 ||
+		    (*end != ',' && *end != '\0'))
+			errx(1, "invalid load \"%s\"", arg);
+
+		if (*end == '\0')
+			break;
+
+		arg = end + 1;
+	}
+
+	if (fit_nscales++ == FIT_MAXSCALES)
+		errx(1, "at most %d loads may be specified", FIT_MAXSCALES);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t state;
+	tsh_hist_t *hist;
+	fit_win_t *win;
+	hrtime_t median, *all;
+	double *lat, v[5], mean = 0;
+	char *end;
+	size_t i;
+	int c, k, out;
+
+	while ((c = getopt(argc, argv, "s:t:w:x:")) != -1) {
+		switch (c) {
+		case 's':
+			fit_seed = strtoull(optarg, &end, 0);
+
+			if (*end != '\0')
+				errx(1, "invalid seed");
+			break;
+
+		case 't':
+			fit_stall = strtod(optarg, &end);
+
+			if (*end != '\0' || fit_stall <= 1)
+				errx(1, "invalid stall multiple");
+			break;
+
+		case 'w':
+			if ((fit_window = tsh_clock_parse(optarg)) <= 0)
+				errx(1, "invalid window \"%s\"", optarg);
+			break;
+
+		case 'x':
+			fit_scales_parse(optarg);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 1)
+		usage();
+
+	fit_file = argv[optind];
+	fit_read();
+
+	/*
+	 * With the completed ops sorted by their window (and latency), each
+	 * window's ops are contiguous.
+	 */
+	qsort(fit_done, fit_ndone, sizeof (fit_done_t), fit_donecmp);
+
+	for (i = 0; i < fit_ndone; i++) {
+		win = fit_win(fit_done[i].fitd_start);
+
+		if (win->fitw_ndone++ == 0)
+			win->fitw_first = i;
+
+		mean += fit_done[i].fitd_lat;
+	}
+
+	fit_service(&out, &median);
+
+	(void) printf("toshfit: %s: %lu ops in %lu windows of %.3fs; "
+	    "arrival cv %.2f\n", fit_file, (unsigned long)fit_ndone,
+	    (unsigned long)fit_nwins, (double)fit_window / NANOSEC,
+	    sqrt(MAX(fit_ca2, 0)));
+	(void) printf("toshfit: service: %lu ops started with %s%d "
+	    "outstanding; median %.1f us, mean %.1f us\n",
+	    (unsigned long)(fit_nbody + fit_nstalls), out == 0 ? "" : "<= ",
+	    out, (double)median / 1000,
+	    ((double)fit_nbody * fit_moments[0][0] +
+	    (double)fit_nstalls * fit_moments[1][0]) /
+	    (fit_nbody + fit_nstalls) / 1000);
+	(void) printf("toshfit: stalls (> %gx median): %.1f%% of them, mean "
+	    "%.1f us; probability %+.2f%% per 100 MB/s written\n", fit_stall,
+	    100.0 * fit_nstalls / (fit_nbody + fit_nstalls),
+	    fit_moments[1][0] / 1000, fit_pib * 1e8 / NANOSEC * 100);
+
+	if (fit_nbody == 0)
+		errx(1, "every operation that started idle stalled");
+
+	k = fit_servers();
+
+	if ((lat = malloc(FIT_NDRAW * sizeof (double))) == NULL ||
+	    (hist = malloc(sizeof (tsh_hist_t))) == NULL)
+		err(1, "couldn't allocate simulated ops");
+
+	state = fit_seed;
+	fit_error(k, &state, lat);
+
+	(void) printf("\n%8s %6s %6s %6s %10s %10s %10s %10s %10s\n",
+	    "LOAD", "UTIL", "PEAK", "SAT", "MEAN", "p50", "p90", "p99",
+	    "p99.9");
+
+	/*
+	 * The observed latency, for comparison with that of the model.
+	 */
+	if ((all = malloc(fit_ndone * sizeof (hrtime_t))) == NULL)
+		err(1, "couldn't allocate latencies");
+
+	for (i = 0; i < fit_ndone; i++)
+		all[i] = fit_done[i].fitd_lat;
+
+	qsort(all, fit_ndone, sizeof (hrtime_t), fit_hrcmp);
+	v[0] = mean / fit_ndone;
+	v[1] = all[fit_rank(0.5, fit_ndone)];
+	v[2] = all[fit_rank(0.9, fit_ndone)];
+	v[3] = all[fit_rank(0.99, fit_ndone)];
+	v[4] = all[fit_rank(0.999, fit_ndone)];
+	fit_print("observed", -1, -1, 0, v);
+	free(all);
+
+	state = fit_seed;
+	fit_extrapolate(k, 1, &state, lat, hist);
+
+	for (c = 0; c < fit_nscales; c++) {
+		state = fit_seed;
+		fit_extrapolate(k, fit_scales[c], &state, lat, hist);
+	}
+
+	return (0);
+}
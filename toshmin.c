@@ -0,0 +1,485 @@
+/*
+ * toshmin.c: minimizes a trace that reproduces a stall.
+ *
+ * Given a trace that reproduces a stall (an operation whose latency exceeds a
+ * threshold) when replayed on a device, repeatedly replays smaller parts of
+ * it with toshreplay to find a small trace that still does:
+ *
+ *   1. The trace is cut off at the start of the first operation to stall:
+ *      nothing after it can have caused it.
+ *   2. The start of the trace is advanced, by bisection, as far as it can be
+ *      while the trace still reproduces the stall.
+ *   3. Operations are removed from what remains by delta debugging (Zeller's
+ *      ddmin):  the trace is divided into chunks, and whenever the stall is
+ *      reproduced by a chunk alone or by the trace without a chunk, that
+ *      replaces the trace; otherwise the chunks are made smaller, until no
+ *      single operation can be removed (or we run out of replays).
+ *
+ * The operations kept are replayed at their original times (relative to the
+ * first of them).  A stall that doesn't reproduce reliably can be replayed
+ * several times for each candidate (-n); a candidate reproduces the stall if
+ * any of its replays does.  The minimal trace is written out, and replayed
+ * several more times (-R) to report how reliably it reproduces the stall.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tsh_clock.h"
+#include "tsh_compat.h"
+#include "tsh_rec.h"
+
+#define	MIN_LINE_MAX	4096		/* longest line we expect */
+#define	MIN_TOK_IOSTART	" -> "
+#define	MIN_MS(t)	((double)(t) / (NANOSEC / MILLISEC))
+
+typedef struct min_op {
+	hrtime_t	mino_sched;		/* scheduled time */
+	char		*mino_rest;		/* rest of line after time */
+} min_op_t;
+
+static const char *min_replay = "./toshreplay";	/* toshreplay to run */
+static const char *min_out = "toshmin.out";	/* minimal trace */
+static hrtime_t min_thresh = -1;	/* latency that is a stall */
+static int min_runs = 1;		/* replays of each candidate */
+static int min_confirm = 10;		/* replays of the minimal trace */
+static int min_maxtests = 200;		/* most candidates to replay */
+static boolean_t min_verbose = B_FALSE;	/* keep toshreplay's stderr */
+static char **min_argv;			/* toshreplay's arguments */
+static char min_tmp[PATH_MAX];		/* candidate trace */
+static int min_ntests;			/* candidates replayed */
+static int min_nreplays;		/* replays performed */
+static hrtime_t min_elapsed;		/* time spent replaying */
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: toshmin -l latency [-v] [-m maxtests] "
+	    "[-n runs] [-o output]\n"
+	    "    [-r toshreplay] [-R runs] DEVICE_OR_FILE "
+	    "[TOSHREPLAY_OPTION ...] < TRACE\n");
+	exit(2);
+}
+
+static min_op_t *
+min_read(int *np)
+{
+	char line[MIN_LINE_MAX], *end;
+	min_op_t *ops = NULL;
+	int n = 0, max = 0, lineno = 0;
+
+	while (fgets(line, sizeof (line), stdin) != NULL) {
+		lineno++;
+
+		if (strstr(line, MIN_TOK_IOSTART) == NULL)
+			continue;
+
+		if (n == max) {
+			max = max == 0 ? 1024 : max * 2;
+
+			if ((ops = realloc(ops, max * sizeof (min_op_t))) ==
+			    NULL)
+				err(1, "couldn't allocate operations");
+		}
+
+		errno = 0;
+		ops[n].mino_sched = strtoll(line, &end, 10);
+
+		if (errno != 0 || end == line || *end != ' ')
+			errx(1, "line %d: invalid time offset", lineno);
+
+		if ((ops[n++].mino_rest = strdup(end)) == NULL)
+			err(1, "couldn't allocate operation");
+	}
+
+	if (ferror(stdin))
+		err(1, "couldn't read trace");
+
+	if (n == 0)
+		errx(1, "trace has no operations");
+
+	*np = n;
+	return (ops);
+}
+
+/*
+ * Write the given operations as a trace, with times relative to the first.
+ */
+static void
+min_write(FILE *fp, min_op_t **ops, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		(void) fprintf(fp, "%lld%s",
+		    ops[i]->mino_sched - ops[0]->mino_sched, ops[i]->mino_rest);
+	}
+}
+
+/*
+ * Replay the trace in the candidate file once, returning whether an
+ * operation stalled and (if one did) the start of the first to stall,
+ * relative to the start of the replay.
+ */
+static boolean_t
+min_replay_once(hrtime_t *stallp)
+{
+	char line[MIN_LINE_MAX];
+	boolean_t stalled = B_FALSE;
+	hrtime_t start = tsh_gethrtime();
+	tsh_rec_t rec;
+	int fds[2], status, fd;
+	pid_t pid;
+	FILE *fp;
+
+	if (pipe(fds) != 0)
+		err(1, "couldn't create pipe");
+
+	if ((pid = fork()) == -1)
+		err(1, "couldn't fork");
+
+	if (pid == 0) {
+		if ((fd = open(min_tmp, O_RDONLY)) == -1 ||
+		    dup2(fd, STDIN_FILENO) == -1 ||
+		    dup2(fds[1], STDOUT_FILENO) == -1)
+			err(1, "couldn't redirect toshreplay");
+
+		if (!min_verbose && ((fd = open("/dev/null", O_WRONLY)) == -1 ||
+		    dup2(fd, STDERR_FILENO) == -1))
+			err(1, "couldn't redirect toshreplay");
+
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		(void) execvp(min_replay, min_argv);
+		err(1, "couldn't execute \"%s\"", min_replay);
+	}
+
+	(void) close(fds[1]);
+
+	if ((fp = fdopen(fds[0], "r")) == NULL)
+		err(1, "couldn't read from toshreplay");
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (tsh_rec_parse(line, &rec) != 0 || !rec.tshr_done ||
+		    rec.tshr_latency <= min_thresh)
+			continue;
+
+		if (!stalled || rec.tshr_time - rec.tshr_latency < *stallp)
+			*stallp = rec.tshr_time - rec.tshr_latency;
+
+		stalled = B_TRUE;
+	}
+
+	(void) fclose(fp);
+
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "couldn't wait for toshreplay");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "toshreplay failed (status 0x%x); run with -v to see "
+		    "why", status);
+	}
+
+	min_nreplays++;
+	min_elapsed += tsh_gethrtime() - start;
+
+	return (stalled);
+}
+
+/*
+ * Replay the given operations up to the given number of times, returning
+ * the number of replays that stalled.  Unless all is set, we stop at the
+ * first replay to stall.
+ */
+static int
+min_replay_ops(min_op_t **ops, int n, int runs, boolean_t all,
+    hrtime_t *stallp)
+{
+	int i, nstalled = 0;
+	FILE *fp;
+
+	if ((fp = fopen(min_tmp, "w")) == NULL)
+		err(1, "couldn't open \"%s\"", min_tmp);
+
+	min_write(fp, ops, n);
+
+	if (ferror(fp) || fclose(fp) != 0)
+		err(1, "couldn't write \"%s\"", min_tmp);
+
+	for (i = 0; i < runs; i++) {
+		if (min_replay_once(stallp)) {
+			nstalled++;
+
+			if (!all)
+				break;
+		}
+	}
+
+	return (nstalled);
+}
+
+/*
+ * Test whether a candidate trace reproduces the stall.
+ */
+static boolean_t
+min_test(const char *what, min_op_t **ops, int n)
+{
+	hrtime_t stall;
+	boolean_t repro;
+
+	min_ntests++;
+	repro = min_replay_ops(ops, n, min_runs, B_FALSE, &stall) != 0;
+
+	(void) printf("toshmin: %s: %d ops over %.1f ms: %s\n", what, n,
+	    MIN_MS(ops[n - 1]->mino_sched - ops[0]->mino_sched),
+	    repro ? "reproduced" : "not reproduced");
+	(void) fflush(stdout);
+
+	return (repro);
+}
+
+/*
+ * Advance the start of the trace by bisection, as far as it can be while the
+ * trace still reproduces the stall.  Returns the new number of operations.
+ */
+static int
+min_trim(min_op_t **ops, int n)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	/*
+	 * The trace starting at lo reproduces the stall; we don't know about
+	 * any later start up to hi.
+	 */
+	while (lo < hi && min_ntests < min_maxtests) {
+		mid = lo + (hi - lo + 1) / 2;
+
+		if (min_test("trim", &ops[mid], n - mid)) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	bcopy(&ops[lo], ops, (n - lo) * sizeof (min_op_t *));
+
+	return (n - lo);
+}
+
+/*
+ * Delta debugging:  remove operations from the trace (in chunks that grow
+ * smaller) for as long as it still reproduces the stall.  Returns the new
+ * number of operations.
+ */
+static int
+min_ddmin(min_op_t **ops, int n)
+{
+	min_op_t **cand;
+	int gran = 2, i, j, k, lo, hi, size;
+	boolean_t reduced;
+
+	if ((cand = malloc(n * sizeof (min_op_t *))) == NULL)
+		err(1, "couldn't allocate candidate");
+
+	while (n >= 2 && min_ntests < min_maxtests) {
+		reduced = B_FALSE;
+		gran = MIN(gran, n);
+
+		/*
+		 * First, each chunk alone.
+		 */
+		for (i = 0; i < gran && min_ntests < min_maxtests; i++) {
+			lo = i * n / gran;
+			hi = (i + 1) * n / gran;
+
+			if (gran > 2 && min_test("chunk", &ops[lo], hi - lo)) {
+				bcopy(&ops[lo], ops,
+				    (hi - lo) * sizeof (min_op_t *));
+				n = hi - lo;
+				gran = 2;
+				reduced = B_TRUE;
+				break;
+			}
+		}
+
+		/*
+		 * Then, the trace without each chunk.
+		 */
+		for (i = 0; !reduced && i < gran &&
+		    min_ntests < min_maxtests; i++) {
+			lo = i * n / gran;
+			hi = (i + 1) * n / gran;
+
+			for (j = k = 0; j < n; j++) {
+				if (j < lo || j >= hi)
+					cand[k++] = ops[j];
+			}
+
+			if (k != 0 && min_test("complement", cand, k)) {
+				bcopy(cand, ops, k * sizeof (min_op_t *));
+				n = k;
+				gran = MAX(gran - 1, 2);
+				reduced = B_TRUE;
+			}
+		}
+
+		if (reduced)
+			continue;
+
+		if (gran >= n)
+			break;
+
+		size = gran;
+		gran = MIN(gran * 2, n);
+
+		(void) printf("toshmin: no chunk of %d removable; trying "
+		    "%d chunks\n", size, gran);
+	}
+
+	free(cand);
+
+	return (n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	min_op_t *all, **ops;
+	hrtime_t stall, span;
+	char *end;
+	int c, i, n, total, nstalled;
+	FILE *fp;
+
+	while ((c = getopt(argc, argv, "+l:m:n:o:r:R:v")) != -1) {
+		switch (c) {
+		case 'l':
+			if ((min_thresh = tsh_clock_parse(optarg)) <= 0)
+				errx(1, "invalid latency \"%s\"", optarg);
+			break;
+
+		case 'm':
+			min_maxtests = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || min_maxtests <= 0)
+				errx(1, "invalid number of tests");
+			break;
+
+		case 'n':
+			min_runs = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || min_runs <= 0)
+				errx(1, "invalid number of runs");
+			break;
+
+		case 'o':
+			min_out = optarg;
+			break;
+
+		case 'r':
+			min_replay = optarg;
+			break;
+
+		case 'R':
+			min_confirm = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || min_confirm <= 0)
+				errx(1, "invalid number of runs");
+			break;
+
+		case 'v':
+			min_verbose = B_TRUE;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (min_thresh == -1 || optind == argc)
+		usage();
+
+	/*
+	 * toshreplay is given its options, followed by the device.
+	 */
+	if ((min_argv = calloc(argc - optind + 2, sizeof (char *))) == NULL)
+		err(1, "couldn't allocate arguments");
+
+	min_argv[0] = (char *)min_replay;
+
+	for (i = optind + 1; i < argc; i++)
+		min_argv[i - optind] = argv[i];
+
+	min_argv[argc - optind] = argv[optind];
+
+	(void) snprintf(min_tmp, sizeof (min_tmp), "%s.tmp", min_out);
+
+	all = min_read(&total);
+
+	if ((ops = malloc(total * sizeof (min_op_t *))) == NULL)
+		err(1, "couldn't allocate operations");
+
+	for (i = 0; i < total; i++)
+		ops[i] = &all[i];
+
+	n = total;
+	span = ops[n - 1]->mino_sched - ops[0]->mino_sched;
+
+	/*
+	 * The whole trace must reproduce the stall; whatever is scheduled
+	 * after the first operation to stall started can't have caused it.
+	 */
+	min_ntests++;
+
+	if (min_replay_ops(ops, n, min_runs, B_FALSE, &stall) == 0)
+		errx(1, "trace doesn't reproduce a stall of %.1f ms",
+		    MIN_MS(min_thresh));
+
+	(void) printf("toshmin: %d ops over %.1f ms: first stall started at "
+	    "%.1f ms\n", n, MIN_MS(span), MIN_MS(stall));
+
+	for (i = 0; i < n && ops[i]->mino_sched - ops[0]->mino_sched <= stall;
+	    i++)
+		continue;
+
+	if (i < n && min_test("cut", ops, i))
+		n = i;
+
+	n = min_trim(ops, n);
+	n = min_ddmin(ops, n);
+
+	if ((fp = fopen(min_out, "w")) == NULL)
+		err(1, "couldn't open \"%s\"", min_out);
+
+	min_write(fp, ops, n);
+
+	if (ferror(fp) || fclose(fp) != 0)
+		err(1, "couldn't write \"%s\"", min_out);
+
+	nstalled = min_replay_ops(ops, n, min_confirm, B_TRUE, &stall);
+	(void) unlink(min_tmp);
+
+	if (min_ntests >= min_maxtests) {
+		(void) printf("toshmin: stopped after %d candidates (-m to "
+		    "allow more); the trace may not be minimal\n", min_ntests);
+	}
+
+	(void) printf("toshmin: %s: %d ops over %.1f ms (from %d ops over "
+	    "%.1f ms); reproduced in %d of %d replays (%.0f%%)\n", min_out, n,
+	    MIN_MS(ops[n - 1]->mino_sched - ops[0]->mino_sched),
+	    total, MIN_MS(span), nstalled, min_confirm,
+	    100.0 * nstalled / min_confirm);
+	(void) printf("toshmin: %d candidates, %d replays in %.1fs\n",
+	    min_ntests, min_nreplays, (double)min_elapsed / NANOSEC);
+
+	return (0);
+}
@@ -15,11 +15,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <alloca.h>
+#include <stdio.h>
 #include <limits.h>
 #include <sys/param.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <math.h>
+
+#include "tsh_clock.h"
+#include "tsh_hist.h"
+#include "tsh_io.h"
+#include "tsh_perf.h"
+#include "tsh_sched.h"
 
 #define	TSH_NTHREADS	100
 
@@ -28,10 +36,32 @@
 #define	TSH_TOK_WRITE		" type=W "
 #define	TSH_TOK_BLKNO		" blkno="
 #define	TSH_TOK_SIZE		" size="
+#define	TSH_TOK_STREAM		" stream="
 
 #define	TSH_BUFSHIFT    17	/* max buffer size of 128K bytes */
 #define	TSH_BUFMASK	(tsh_bufsz - 1)
 #define	TSH_NWORKERS	128
+#define	TSH_STREAM_HASH	4096	/* buckets in stream hash table */
+
+#define	TSH_CALIB_NJITTER	2000	/* timer deadlines to measure */
+#define	TSH_CALIB_JITTERGAP	(20 * (NANOSEC / MICROSEC))
+#define	TSH_CALIB_NHANDOFF	200	/* handoffs to measure */
+#define	TSH_CALIB_NROUNDS	5	/* rounds of dispatch to measure */
+#define	TSH_CALIB_NSUSTAIN	2000	/* handoffs in each round */
+#define	TSH_CALIB_PERWORKER	10	/* ... and at least this many each */
+#define	TSH_CALIB_WINDOW	(10 * (NANOSEC / MILLISEC)) /* for peak rate */
+
+#define	TSH_SEARCH_PRECISION	1.1	/* ratio at which search stops */
+
+/*
+ * Why an op was held on the host queue:  each reason other than the want of
+ * an idle worker is an admission policy.
+ */
+#define	TSH_HELD_WORKER		0	/* no idle worker */
+#define	TSH_HELD_WCAP		1	/* write cap reached */
+#define	TSH_HELD_RFIRST		2	/* reads queued ahead of it */
+#define	TSH_HELD_WSPLIT		3	/* part of a split write */
+#define	TSH_HELD_NREASONS	4
 
 typedef struct tsh_op {
 	boolean_t	tsho_read;		/* boolean: is read */
@@ -44,16 +74,53 @@ typedef struct tsh_op {
 	int		tsho_outw;		/* outstanding writes */
 	int		tsho_doner;		/* outstanding reads on done */
 	int		tsho_donew;		/* outstanding writes on done */
-	pthread_t	tsho_worker;		/* processing worker */
+	int		tsho_worker;		/* processing worker */
+	boolean_t	tsho_calib;		/* calibration: no I/O */
+	long long	tsho_stream;		/* stream, or -1 if none */
+	boolean_t	tsho_parked;		/* waiting on stream */
+	boolean_t	tsho_chunk;		/* later part of split write */
+	hrtime_t	tsho_held;		/* submitted for admission */
+	hrtime_t	tsho_admit;		/* time admitted */
+	int		tsho_heldby;		/* reason held, or -1 if not */
+	uint64_t	tsho_heldseq;		/* order submitted */
+	struct tsh_op	*tsho_nextheld;		/* next op on host queue */
+	struct tsh_op	*tsho_streamprev;	/* previous op in stream */
+	struct tsh_op	*tsho_streamnext;	/* next op in stream */
 	struct tsh_op	*tsho_next;		/* next operation */
 	struct tsh_op	*tsho_nextstart;	/* next started operation */
 	struct tsh_op	*tsho_nextdone;		/* next completed operation */
 } tsh_op_t;
 
+typedef struct tsh_stream {
+	long long	tshst_id;		/* stream identifier */
+	tsh_op_t	*tshst_last;		/* last op in stream */
+	struct tsh_stream *tshst_next;		/* next in hash chain */
+} tsh_stream_t;
+
+typedef struct tsh_policy {
+	const char	*tshpl_name;		/* name of policy */
+	const char	*tshpl_desc;		/* why ops are held by it */
+	int		tshpl_arg;		/* kind of value it takes */
+	long long	tshpl_val;		/* value, or 0 if disabled */
+} tsh_policy_t;
+
+#define	TSH_POLICY_FLAG		0	/* takes no value */
+#define	TSH_POLICY_COUNT	1	/* takes a count */
+#define	TSH_POLICY_SIZE		2	/* takes a size in bytes */
+
+typedef struct tsh_calib {
+	double		tshcl_rate;		/* dispatch rate (ops/sec) */
+	hrtime_t	tshcl_handoff;		/* median handoff latency */
+	hrtime_t	tshcl_handoff99;	/* p99 handoff latency */
+	hrtime_t	tshcl_jitter;		/* p99 timer overshoot */
+} tsh_calib_t;
+
 typedef struct tsh_worker {
 	pthread_t	tshw_id;		/* thread ID of worker */
+	int		tshw_index;		/* index of worker */
 	tsh_op_t	*tshw_op;		/* operation */
 	pthread_cond_t	tshw_cv;		/* worker's cond variable */
+	tsh_perf_t	*tshw_perf;		/* worker's counters */
 	struct tsh_worker *tshw_next;		/* next worker */
 } tsh_worker_t;
 
@@ -70,19 +137,68 @@ static tsh_op_t *tsh_firstdone;			/* first op to complete */
 static tsh_op_t *tsh_lastdone;			/* last op to complete */
 static FILE *tsh_log;
 static pthread_mutex_t tsh_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tsh_main_cv = PTHREAD_COND_INITIALIZER;
 static int tsh_nworkers = TSH_NWORKERS;		/* number of workers */
+static int tsh_nready;				/* workers ready */
+static int tsh_nops;				/* operations to replay */
+static int tsh_ndone;				/* operations completed */
+static int tsh_ncalib;				/* calibration ops completed */
+static int tsh_nstreams;			/* streams in replay log */
+static int tsh_nparked;				/* ops parked on their stream */
+static off_t tsh_nbytes;			/* bytes to transfer */
+static tsh_perf_t *tsh_perf;			/* per-thread counters */
 static tsh_worker_t *tsh_workers;
 static int tsh_readers;
 static int tsh_writers;
 static hrtime_t tsh_cap = 120 * NANOSEC;
 static hrtime_t tsh_start;			/* start of replay */
+static hrtime_t tsh_end;			/* end of replay */
+static hrtime_t tsh_base;			/* schedule offset of replay */
+static hrtime_t tsh_warmup = -1;		/* warm-up duration, if any */
+static int tsh_warmupops = -1;			/* warm-up ops, if any */
+static int tsh_warmuprepeat;			/* times to repeat warm-up */
 static boolean_t tsh_clamp = B_FALSE;
+static boolean_t tsh_force = B_FALSE;		/* replay even if host can't */
+static boolean_t tsh_policy = B_FALSE;		/* admission policies set */
+static double tsh_speed = 1;			/* speedup of the schedule */
+static boolean_t tsh_search = B_FALSE;		/* search for max speedup */
+static double tsh_search_p99 = 2;		/* p99 latency vs. real time */
+static hrtime_t tsh_search_lag = NANOSEC / MILLISEC; /* p99 schedlat */
+static double tsh_search_max = 64;		/* largest speedup to try */
+static hrtime_t tsh_search_window = -1;		/* portion of trace, if any */
+static tsh_op_t *tsh_heldr;			/* first read held */
+static tsh_op_t *tsh_heldrlast;			/* last read held */
+static tsh_op_t *tsh_heldw;			/* first write held */
+static tsh_op_t *tsh_heldwlast;			/* last write held */
+static uint64_t tsh_heldseq;			/* ops submitted to admit */
+static int tsh_admitw;				/* writes admitted, not done */
+static int tsh_nsplit;				/* writes split */
+
+/*
+ * The admission policies, indexed by the reason that each holds an op.
+ */
+static tsh_policy_t tsh_policies[TSH_HELD_NREASONS] = {
+	{ "worker", "for a worker", TSH_POLICY_FLAG, 0 },
+	{ "wcap", "by the write cap", TSH_POLICY_COUNT, 0 },
+	{ "rfirst", "behind reads", TSH_POLICY_FLAG, 0 },
+	{ "wsplit", "as split writes", TSH_POLICY_SIZE, 0 },
+};
+
+static tsh_hist_t tsh_held[TSH_HELD_NREASONS];	/* host queueing added */
+
+#define	tsh_wcap	tsh_policies[TSH_HELD_WCAP].tshpl_val
+#define	tsh_rfirst	tsh_policies[TSH_HELD_RFIRST].tshpl_val
+#define	tsh_wsplit	tsh_policies[TSH_HELD_WSPLIT].tshpl_val
 
 static void
 usage(void)
 {
-	(void) fprintf(stderr, "usage: toshreplay "
-	    "DEVICE_OR_FILE < REPLAY_FILE\n");
+	(void) fprintf(stderr, "usage: toshreplay [-cfLPR] [-a role=cpus] "
+	    "[-k mono|tsc] [-t #threads]\n"
+	    "    [-m syscall|mmap[,msync=N]] [-w time|Nops[,repeat=N]]\n"
+	    "    [-p wcap=N,rfirst,wsplit=SIZE]\n"
+	    "    [-S p99=N,lag=time,max=N,window=time]\n"
+	    "    DEVICE_OR_FILE < REPLAY_FILE\n");
 	exit(2);
 }
 
@@ -117,35 +233,152 @@ read_field(int lineno, char *line, char *field)
 	if (errno != 0)
 		err(1, "line %d: illegal value for field '%s'", lineno, field);
 
-	if (*end != ' ' && (*end != '\0' || end == start))
+	if (*end != ' ' && ((*end != '\0' && *end != '\n') || end == start))
 		errx(1, "line %d: invalid value for field '%s'", lineno, field);
 
 	return (rval);
 }
 
+/*
+ * Append an op to its stream.
+ */
+static void
+read_stream(tsh_op_t *op)
+{
+	static tsh_stream_t *streams[TSH_STREAM_HASH];
+	tsh_stream_t **bucket, *stream;
+	long long id = op->tsho_stream;
+
+	bucket = &streams[(unsigned long long)id % TSH_STREAM_HASH];
+
+	for (stream = *bucket; stream != NULL; stream = stream->tshst_next) {
+		if (stream->tshst_id == id)
+			break;
+	}
+
+	if (stream == NULL) {
+		if ((stream = malloc(sizeof (tsh_stream_t))) == NULL)
+			err(1, "could not allocate new stream");
+
+		stream->tshst_id = id;
+		stream->tshst_last = NULL;
+		stream->tshst_next = *bucket;
+		*bucket = stream;
+		tsh_nstreams++;
+	}
+
+	if ((op->tsho_streamprev = stream->tshst_last) != NULL)
+		op->tsho_streamprev->tsho_streamnext = op;
+
+	stream->tshst_last = op;
+}
+
+/*
+ * Sort ops by their scheduled time, keeping ops scheduled at the same time in
+ * trace order.  Halves that are already in order aren't merged, so that an
+ * input that is nearly sorted is sorted in nearly linear time.
+ */
+static void
+read_sort(tsh_op_t **ops, tsh_op_t **tmp, int n)
+{
+	int h = n / 2, i = 0, j = h, k = 0;
+
+	if (n < 2)
+		return;
+
+	read_sort(ops, tmp, h);
+	read_sort(&ops[h], tmp, n - h);
+
+	if (ops[h - 1]->tsho_sched <= ops[h]->tsho_sched)
+		return;
+
+	while (i < h && j < n) {
+		tmp[k++] = ops[j]->tsho_sched < ops[i]->tsho_sched ?
+		    ops[j++] : ops[i++];
+	}
+
+	while (i < h)
+		tmp[k++] = ops[i++];
+
+	bcopy(tmp, ops, k * sizeof (tsh_op_t *));
+}
+
+/*
+ * Sort the ops that we have read by their scheduled time:  output gathered
+ * from several CPUs (as by DTrace) isn't strictly in time order, and the
+ * dispatcher would issue an op that is out of order as soon as it came to
+ * it.
+ */
+static void
+read_reorder(int nops)
+{
+	tsh_op_t **ops, **tmp, *op;
+	int i = 0;
+
+	if ((ops = malloc(nops * sizeof (tsh_op_t *))) == NULL ||
+	    (tmp = malloc(nops * sizeof (tsh_op_t *))) == NULL)
+		err(1, "could not allocate operations to sort");
+
+	for (op = tsh_first; op != NULL; op = op->tsho_next)
+		ops[i++] = op;
+
+	read_sort(ops, tmp, nops);
+
+	for (i = 0; i < nops - 1; i++)
+		ops[i]->tsho_next = ops[i + 1];
+
+	tsh_first = ops[0];
+	tsh_last = ops[nops - 1];
+	tsh_last->tsho_next = NULL;
+
+	free(ops);
+	free(tmp);
+}
+
 void
 read_log(void)
 {
 	char line[LINE_MAX];
-	int nops = 0, nreads = 0;
+	int nops = 0, nreads = 0, nlate = 0, nbeyond = 0;
 	int lineno = 0;
 	char *end;
+	tsh_op_t *op, *chunk;
+	hrtime_t sched, maxsched = 0, late = 0, maxlate = 0;
 
 	if (isatty(fileno(tsh_log)))
 		errx(1, "replay log cannot be a terminal");
 
 	while (fgets(line, sizeof (line), tsh_log)) {
-		tsh_op_t *op;
-
 		lineno++;
 
 		if (strstr(line, TSH_TOK_IOSTART) == NULL)
 			continue;
 
+		/*
+		 * First pull the time offset -- this should be the first
+		 * field.  Ops scheduled past the cap aren't replayed; as the
+		 * trace may be out of order, we read on for any that aren't.
+		 */
+		errno = 0;
+
+		sched = strtoll(line, &end, 10);
+
+		if (errno != 0)
+			err(1, "line %d: illegal time offset", lineno);
+
+		if (*end != ' ')
+			errx(1, "line %d: invalid time offset", lineno);
+
+		if (sched > tsh_cap) {
+			nbeyond++;
+			continue;
+		}
+
 		if ((op = malloc(sizeof (tsh_op_t))) == NULL)
 			err(1, "could not allocate new operation");
 
 		bzero(op, sizeof (tsh_op_t));
+		op->tsho_sched = sched;
 
 		if (strstr(line, TSH_TOK_READ) != NULL) {
 			op->tsho_read = B_TRUE;
@@ -154,23 +387,15 @@ read_log(void)
 			    "determine I/O type", lineno);
 		}
 
-		/*
-		 * Now pull the time offset -- this should be the first
-		 * field.
-		 */
-		errno = 0;
-
-		op->tsho_sched = strtoll(line, &end, 10);
-
-		if (errno != 0)
-			err(1, "line %d: illegal time offset", lineno);
-
-		if (*end != ' ')
-			errx(1, "line %d: invalid time offset", lineno);
-
 		op->tsho_offset =
 		    read_field(lineno, line, TSH_TOK_BLKNO) * DEV_BSIZE;
 		op->tsho_size = read_field(lineno, line, TSH_TOK_SIZE);
+		op->tsho_stream = -1;
+
+		if (strstr(line, TSH_TOK_STREAM) != NULL) {
+			op->tsho_stream =
+			    read_field(lineno, line, TSH_TOK_STREAM);
+		}
 
 		if (op->tsho_offset + op->tsho_size > tsh_size) {
 			if (tsh_clamp) {
@@ -188,25 +413,98 @@ read_log(void)
 			}
 		}
 
-		if (op->tsho_read)
-			nreads++;
+		if (!op->tsho_read && tsh_wsplit != 0 &&
+		    op->tsho_size > tsh_wsplit)
+			tsh_nsplit++;
 
-		nops++;
+		/*
+		 * A write larger than the split size (if any) is replaced by
+		 * writes of that size, all scheduled at its time.  The parts
+		 * are meant to run concurrently, so only the first stays in
+		 * the write's stream:  the rest are in no stream, leaving them
+		 * free to overlap it and the ops that follow it in the stream.
+		 */
+		for (; op != NULL; op = chunk) {
+			chunk = NULL;
+
+			if (!op->tsho_read && tsh_wsplit != 0 &&
+			    op->tsho_size > tsh_wsplit) {
+				if ((chunk = malloc(sizeof (tsh_op_t))) == NULL)
+					err(1, "could not allocate new "
+					    "operation");
+
+				*chunk = *op;
+				chunk->tsho_offset += tsh_wsplit;
+				chunk->tsho_size -= tsh_wsplit;
+				chunk->tsho_chunk = B_TRUE;
+				chunk->tsho_stream = -1;
+				op->tsho_size = tsh_wsplit;
+			}
+
+			if (op->tsho_read)
+				nreads++;
+
+			nops++;
+			tsh_nbytes += op->tsho_size;
+
+			if (tsh_first == NULL) {
+				tsh_first = op;
+			} else {
+				tsh_last->tsho_next = op;
+			}
 
-		if (tsh_first == NULL) {
-			tsh_first = op;
+			tsh_last = op;
+		}
+
+		/*
+		 * An op is late by how far it is scheduled before the latest
+		 * op that preceded it in the trace.
+		 */
+		if (tsh_last->tsho_sched < maxsched) {
+			nlate++;
+			late += maxsched - tsh_last->tsho_sched;
+			maxlate = MAX(maxlate, maxsched - tsh_last->tsho_sched);
 		} else {
-			tsh_last->tsho_next = op;
+			maxsched = tsh_last->tsho_sched;
 		}
+	}
 
-		tsh_last = op;
+	tsh_nops = nops;
 
-		if (op->tsho_sched > tsh_cap)
-			break;
+	if (nlate != 0)
+		read_reorder(nops);
+
+	/*
+	 * Ops in the same stream are performed in order (of their scheduled
+	 * time), each starting only once its predecessor has completed.
+	 */
+	for (op = tsh_first; op != NULL; op = op->tsho_next) {
+		if (op->tsho_stream != -1)
+			read_stream(op);
 	}
 
 	printf("%s: %d operations (%d reads, %d writes)\n", "toshreplay",
 	    nops, nreads, nops - nreads);
+
+	if (nlate != 0) {
+		printf("%s: %d operations out of order (late by %.1f us on "
+		    "average, %.1f us at most); sorted\n", "toshreplay", nlate,
+		    (double)late / nlate / 1000, (double)maxlate / 1000);
+	}
+
+	if (nbeyond != 0) {
+		printf("%s: %d operations scheduled after %.0fs not replayed\n",
+		    "toshreplay", nbeyond, (double)tsh_cap / NANOSEC);
+	}
+
+	if (tsh_nsplit != 0) {
+		printf("%s: %d writes split into writes of %lld bytes\n",
+		    "toshreplay", tsh_nsplit, tsh_wsplit);
+	}
+
+	if (tsh_nstreams != 0) {
+		printf("%s: %d streams\n", "toshreplay", tsh_nstreams);
+	}
 }
 
 void
@@ -215,189 +513,1151 @@ tsh_read(off_t offset, off_t bufsize)
 	char *buf = alloca(bufsize);
 	int nread;
 
-	nread = pread(tsh_fd, buf, bufsize, offset);
+	nread = tsh_io_read(tsh_fd, buf, bufsize, offset);
 
 	if (nread < 0) {
-		warn("pread lba 0x%x", offset);
+		warn("read lba 0x%lx", offset);
 	} else if (nread != bufsize) {
-		warnx("pread lba 0x%x reported %d bytes\n", offset);
+		warnx("read lba 0x%lx reported %d bytes\n", offset, nread);
 	}
 }
 
 void
 tsh_write(off_t offset, off_t bufsize)
 {
-	ssize_t nwritten = pwrite(tsh_fd, tsh_buffer, bufsize, offset);
+	ssize_t nwritten = tsh_io_write(tsh_fd, tsh_buffer, bufsize, offset);
 
 	if (nwritten < 0) {
-		warn("pwrite lba 0x%x", offset);
+		warn("write lba 0x%lx", offset);
 	} else if (nwritten != bufsize) {
-		warnx("pwrite lba 0x%x reported %d bytes\n", offset);
+		warnx("write lba 0x%lx reported %ld bytes\n", offset,
+		    nwritten);
 	}
 }
 
-void
-tsh_worker(tsh_worker_t *me)
+/*
+ * Perform an op, which we enter and leave with tsh_worker_lock held.
+ */
+static void
+tsh_worker_op(tsh_worker_t *me, tsh_op_t *op)
 {
+	op->tsho_outr = tsh_readers;
+	op->tsho_outw = tsh_writers;
+
+	/*
+	 * We have something to do!
+	 */
+	if (op->tsho_read) {
+		tsh_readers++;
+	} else {
+		tsh_writers++;
+	}
+
+	op->tsho_start = tsh_gethrtime();
+
+	if (tsh_firststart == NULL) {
+		tsh_firststart = op;
+	} else {
+		tsh_laststart->tsho_nextstart = op;
+	}
+
+	tsh_laststart = op;
+
+	pthread_mutex_unlock(&tsh_worker_lock);
+	op->tsho_worker = me->tshw_index;
+
+	if (op->tsho_read) {
+		tsh_read(op->tsho_offset, op->tsho_size);
+	} else {
+		tsh_write(op->tsho_offset, op->tsho_size);
+	}
+
 	pthread_mutex_lock(&tsh_worker_lock);
 
-	for (;;) {
-		tsh_op_t *op;
+	op->tsho_done = tsh_gethrtime();
+	op->tsho_doner = tsh_readers;
+	op->tsho_donew = tsh_writers;
 
-		me->tshw_op = NULL;
-		me->tshw_next = tsh_workers;
-		tsh_workers = me;
+	if (tsh_firstdone == NULL) {
+		tsh_firstdone = op;
+	} else {
+		tsh_lastdone->tsho_nextdone = op;
+	}
 
-		pthread_cond_wait(&me->tshw_cv, &tsh_worker_lock);
+	tsh_lastdone = op;
 
-		op = me->tshw_op;
+	if (op->tsho_read) {
+		tsh_readers--;
+	} else {
+		tsh_writers--;
 
-		op->tsho_outr = tsh_readers;
-		op->tsho_outw = tsh_writers;
+		if (tsh_policy)
+			tsh_admitw--;
+	}
 
-		/*
-		 * We have something to do!
-		 */
-		if (op->tsho_read) {
-			tsh_readers++;
-		} else {
-			tsh_writers++;
-		}
+	if (++tsh_ndone == tsh_nops)
+		pthread_cond_signal(&tsh_main_cv);
+}
 
-		op->tsho_start = gethrtime();
+/*
+ * Take the next op from the host queue that our admission policies admit, if
+ * any.  With reads first, held reads are admitted ahead of held writes;
+ * otherwise, ops are admitted in the order submitted, and a held write that
+ * the write cap doesn't admit holds up everything behind it.  Called with
+ * tsh_worker_lock held.
+ */
+static tsh_op_t *
+tsh_admit_next(void)
+{
+	tsh_op_t *op;
+	boolean_t wok = tsh_heldw != NULL &&
+	    (tsh_wcap == 0 || tsh_admitw < tsh_wcap);
+
+	if (tsh_rfirst) {
+		op = tsh_heldr != NULL ? tsh_heldr : wok ? tsh_heldw : NULL;
+	} else if (tsh_heldr != NULL && (tsh_heldw == NULL ||
+	    tsh_heldr->tsho_heldseq < tsh_heldw->tsho_heldseq)) {
+		op = tsh_heldr;
+	} else {
+		op = wok ? tsh_heldw : NULL;
+	}
 
-		if (tsh_firststart == NULL) {
-			tsh_firststart = op;
-		} else {
-			tsh_laststart->tsho_nextstart = op;
-		}
+	if (op == NULL)
+		return (NULL);
 
-		tsh_laststart = op;
+	if (op->tsho_read) {
+		if ((tsh_heldr = op->tsho_nextheld) == NULL)
+			tsh_heldrlast = NULL;
+	} else {
+		if ((tsh_heldw = op->tsho_nextheld) == NULL)
+			tsh_heldwlast = NULL;
 
-		pthread_mutex_unlock(&tsh_worker_lock);
-		op->tsho_worker = me->tshw_id;
+		tsh_admitw++;
+	}
 
-		if (op->tsho_read) {
-			tsh_read(op->tsho_offset, op->tsho_size);
-		} else {
-			tsh_write(op->tsho_offset, op->tsho_size);
-		}
+	op->tsho_nextheld = NULL;
+	op->tsho_admit = tsh_gethrtime();
 
-		pthread_mutex_lock(&tsh_worker_lock);
+	if (op->tsho_heldby != -1)
+		tsh_hist_add(&tsh_held[op->tsho_heldby],
+		    op->tsho_admit - op->tsho_held);
 
-		op->tsho_done = gethrtime();
-		op->tsho_doner = tsh_readers;
-		op->tsho_donew = tsh_writers;
+	return (op);
+}
 
-		if (tsh_firstdone == NULL) {
-			tsh_firstdone = op;
-		} else {
-			tsh_lastdone->tsho_nextdone = op;
-		}
+/*
+ * Determine why an op that couldn't be admitted as it was submitted is being
+ * held.  A held op that is behind another in the order of admission is held
+ * for the same reason as that op.
+ */
+static int
+tsh_hold_reason(tsh_op_t *op)
+{
+	tsh_op_t *head;
+
+	if (op->tsho_chunk)
+		return (TSH_HELD_WSPLIT);
+
+	if (!op->tsho_read && tsh_wcap != 0 && tsh_admitw >= tsh_wcap)
+		return (TSH_HELD_WCAP);
+
+	if (tsh_rfirst) {
+		return (!op->tsho_read && tsh_heldr != NULL ?
+		    TSH_HELD_RFIRST : TSH_HELD_WORKER);
+	}
+
+	head = tsh_heldw == NULL || (tsh_heldr != NULL &&
+	    tsh_heldr->tsho_heldseq < tsh_heldw->tsho_heldseq) ?
+	    tsh_heldr : tsh_heldw;
+
+	return (head != op ? head->tsho_heldby : TSH_HELD_WORKER);
+}
+
+/*
+ * Submit an op (if any) for admission, and hand whatever ops our admission
+ * policies now admit to our idle workers.  If take is set, the caller is a
+ * worker, and the first op admitted is returned for it to perform itself.
+ * Called with tsh_worker_lock held.
+ */
+static tsh_op_t *
+tsh_admit(tsh_op_t *op, boolean_t take)
+{
+	tsh_op_t *next, *mine = NULL;
+	tsh_worker_t *worker;
 
-		tsh_lastdone = op;
+	if (op != NULL) {
+		op->tsho_held = tsh_gethrtime();
+		op->tsho_heldby = -1;
+		op->tsho_heldseq = tsh_heldseq++;
 
 		if (op->tsho_read) {
-			tsh_readers--;
+			if (tsh_heldr == NULL) {
+				tsh_heldr = op;
+			} else {
+				tsh_heldrlast->tsho_nextheld = op;
+			}
+
+			tsh_heldrlast = op;
 		} else {
-			tsh_writers--;
+			if (tsh_heldw == NULL) {
+				tsh_heldw = op;
+			} else {
+				tsh_heldwlast->tsho_nextheld = op;
+			}
+
+			tsh_heldwlast = op;
 		}
 	}
+
+	if (take)
+		mine = tsh_admit_next();
+
+	/*
+	 * Unlike tsh_handoff(), we signal our workers with the lock held:
+	 * we may have several to signal, and they can't take the lock from us
+	 * until we're done.
+	 */
+	while (tsh_workers != NULL && (next = tsh_admit_next()) != NULL) {
+		worker = tsh_workers;
+		tsh_workers = worker->tshw_next;
+		worker->tshw_op = next;
+		pthread_cond_signal(&worker->tshw_cv);
+	}
+
+	if (op != NULL && op->tsho_admit == 0)
+		op->tsho_heldby = tsh_hold_reason(op);
+
+	return (mine);
 }
 
-void
-tsh_dispatcher()
+void *
+tsh_worker(void *arg)
 {
-	tsh_op_t *op = tsh_first;
-	tsh_worker_t *worker;
-	tsh_start = gethrtime();
+	tsh_worker_t *me = arg;
 
-	while (op != NULL) {
-		hrtime_t sched = op->tsho_sched + tsh_start;
+	tsh_sched_enter(TSH_ROLE_WORKERS);
+	tsh_perf_thread_init(me->tshw_perf);
 
-		while (gethrtime() < sched)
-			continue;
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	if (++tsh_nready == tsh_nworkers)
+		pthread_cond_signal(&tsh_main_cv);
+
+	for (;;) {
+		tsh_op_t *op, *next;
+
+		me->tshw_op = NULL;
+		me->tshw_next = tsh_workers;
+		tsh_workers = me;
+
+		pthread_cond_wait(&me->tshw_cv, &tsh_worker_lock);
 
-		pthread_mutex_lock(&tsh_worker_lock);
+		op = me->tshw_op;
 
 		/*
-		 * We have an operation to dispatch -- take our next available
-		 * thread.
+		 * A calibration op measures only the handoff to us; it
+		 * performs no I/O and isn't part of the replay.
 		 */
-		if ((worker = tsh_workers) == NULL) {
-			errx(1, "ran out of workers at time offset %ld\n",
-			    op->tsho_sched);
+		if (op->tsho_calib) {
+			op->tsho_start = tsh_gethrtime();
+			op->tsho_worker = me->tshw_index;
+			tsh_ncalib++;
+			pthread_cond_signal(&tsh_main_cv);
+			continue;
 		}
 
-		worker->tshw_op = op;
-		tsh_workers = worker->tshw_next;
-
 		/*
-		 * We drop the lock before signalling the worker to assure
-		 * that it will get the lock and therefore not induce
-		 * unnecessary scheduling delay.
+		 * Once we complete an op, we go on to perform the next op in
+		 * its stream if the dispatcher has parked it waiting for us.
+		 * Under admission policies, that op must instead be admitted
+		 * like any other, and we go on to perform whichever op is
+		 * admitted next.
 		 */
-		pthread_mutex_unlock(&tsh_worker_lock);
-		pthread_cond_signal(&worker->tshw_cv);
+		while (op != NULL) {
+			tsh_worker_op(me, op);
 
-		op = op->tsho_next;
+			if ((next = op->tsho_streamnext) == NULL ||
+			    !next->tsho_parked) {
+				next = NULL;
+			} else {
+				next->tsho_parked = B_FALSE;
+			}
+
+			op = tsh_policy ? tsh_admit(next, B_TRUE) : next;
+		}
 	}
+
+	return (NULL);
 }
 
-void
-tsh_dump()
+/*
+ * Hand an operation to our next available worker, returning B_FALSE if there
+ * isn't one.  If the previous op in the operation's stream hasn't completed,
+ * the operation is instead parked, to be performed by the worker performing
+ * that op once it completes.
+ */
+static boolean_t
+tsh_handoff(tsh_op_t *op)
 {
-	tsh_op_t *issued, *done, *op;
+	tsh_worker_t *worker;
+
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	if (op->tsho_streamprev != NULL &&
+	    op->tsho_streamprev->tsho_done == 0) {
+		op->tsho_parked = B_TRUE;
+		tsh_nparked++;
+		pthread_mutex_unlock(&tsh_worker_lock);
+		return (B_TRUE);
+	}
 
 	/*
-	 * We have two lists, both are tautologically sorted.  Print them
-	 * out in an absolute order.
+	 * Under admission policies, an op that can't be admitted (or for
+	 * which there's no worker) is held on the host queue.
 	 */
-	issued = tsh_firststart;
-	done = tsh_firstdone;
-
-	while (done != NULL) {
-		if (issued != NULL && issued->tsho_start <= done->tsho_done) {
-			op = issued;
+	if (tsh_policy && !op->tsho_calib) {
+		(void) tsh_admit(op, B_FALSE);
+		pthread_mutex_unlock(&tsh_worker_lock);
+		return (B_TRUE);
+	}
 
-			printf("%lld -> type=%c blkno=%ld "
-			    "size=%ld outr=%d outw=%d schedlat=%lld\n",
-			    op->tsho_start - tsh_start,
-			    op->tsho_read ? 'R' : 'W',
-			    op->tsho_offset / DEV_BSIZE,
-			    op->tsho_size, op->tsho_outr, op->tsho_outw,
-			    op->tsho_start - tsh_start - op->tsho_sched);
+	if ((worker = tsh_workers) == NULL) {
+		pthread_mutex_unlock(&tsh_worker_lock);
+		return (B_FALSE);
+	}
 
-			issued = issued->tsho_nextstart;
-		} else {
-			op = done;
+	worker->tshw_op = op;
+	tsh_workers = worker->tshw_next;
 
-			printf("%lld <- type=%c blkno=%ld "
-			    "size=%ld outr=%d outw=%d latency=%lld worker=%d\n",
-			    op->tsho_done - tsh_start,
-			    op->tsho_read ? 'R' : 'W',
-			    op->tsho_offset / DEV_BSIZE,
-			    op->tsho_size, op->tsho_doner, op->tsho_donew,
-			    op->tsho_done - op->tsho_start, op->tsho_worker);
+	/*
+	 * We drop the lock before signalling the worker to assure that it
+	 * will get the lock and therefore not induce unnecessary scheduling
+	 * delay.
+	 */
+	pthread_mutex_unlock(&tsh_worker_lock);
+	pthread_cond_signal(&worker->tshw_cv);
 
-			done = done->tsho_nextdone;
-		}
-	}
+	return (B_TRUE);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * The time (relative to the start of the replay) at which an op is to start:
+ * its scheduled time, offset by the replay's base and sped up by tsh_speed.
+ */
+static hrtime_t
+tsh_sched_at(const tsh_op_t *op)
 {
-	struct stat st;
-	char *file;
-	int c, i;
+	if (tsh_speed == 1)
+		return (op->tsho_sched - tsh_base);
+
+	return ((hrtime_t)((op->tsho_sched - tsh_base) / tsh_speed));
+}
+
+/*
+ * Replay the operations from first up to (but not including) last, with
+ * their schedule offset by base, and wait for them to complete.
+ */
+void
+tsh_dispatcher(tsh_op_t *first, tsh_op_t *last, hrtime_t base)
+{
+	tsh_op_t *op;
+	int i;
+
+	tsh_ndone = 0;
+	tsh_nops = 0;
+	tsh_nbytes = 0;
+
+	for (i = 0; i < TSH_HELD_NREASONS; i++)
+		tsh_hist_init(&tsh_held[i]);
+
+	for (op = first; op != last; op = op->tsho_next) {
+		tsh_nops++;
+		tsh_nbytes += op->tsho_size;
+	}
+
+	op = first;
+	tsh_base = base;
+	tsh_start = tsh_gethrtime();
+
+	while (op != last) {
+		hrtime_t sched = tsh_sched_at(op) + tsh_start;
+
+		while (tsh_gethrtime() < sched)
+			continue;
+
+		/*
+		 * We have an operation to dispatch -- take our next available
+		 * thread.
+		 */
+		if (!tsh_handoff(op)) {
+			if (!tsh_search) {
+				errx(1, "ran out of workers at time offset "
+				    "%lld\n", op->tsho_sched);
+			}
+
+			/*
+			 * When searching for the largest speedup, running out
+			 * of workers just makes the op late.
+			 */
+			while (!tsh_handoff(op))
+				continue;
+		}
+
+		op = op->tsho_next;
+	}
+
+	/*
+	 * Wait for the last operations to complete before we report on them.
+	 */
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	while (tsh_ndone < tsh_nops)
+		pthread_cond_wait(&tsh_main_cv, &tsh_worker_lock);
+
+	tsh_end = tsh_gethrtime();
+	pthread_mutex_unlock(&tsh_worker_lock);
+}
+
+/*
+ * Forget that the operations from first up to (but not including) last were
+ * ever replayed, so that they may be replayed again.
+ */
+static void
+tsh_forget(tsh_op_t *first, tsh_op_t *last)
+{
+	tsh_op_t *op;
+
+	for (op = first; op != last; op = op->tsho_next) {
+		op->tsho_start = op->tsho_done = 0;
+		op->tsho_parked = B_FALSE;
+		op->tsho_held = op->tsho_admit = 0;
+		op->tsho_nextstart = op->tsho_nextdone = NULL;
+	}
+
+	tsh_firststart = tsh_laststart = NULL;
+	tsh_firstdone = tsh_lastdone = NULL;
+	tsh_nparked = 0;
+}
+
+/*
+ * Parse the warm-up specification:  a duration or a number of operations from
+ * the start of the trace, optionally followed by the number of times that it
+ * should be repeated.
+ */
+static void
+tsh_warmup_parse(char *arg)
+{
+	char *opt, *end;
+	size_t len;
+
+	if ((opt = strchr(arg, ',')) != NULL)
+		*opt++ = '\0';
+
+	len = strlen(arg);
+
+	if (len > 3 && strcmp(&arg[len - 3], "ops") == 0) {
+		tsh_warmupops = strtol(arg, &end, 10);
+
+		if (end != &arg[len - 3] || tsh_warmupops <= 0)
+			errx(1, "invalid number of warm-up operations");
+	} else if ((tsh_warmup = tsh_clock_parse(arg)) <= 0) {
+		errx(1, "invalid warm-up duration \"%s\"", arg);
+	}
+
+	if (opt == NULL)
+		return;
+
+	if (strncmp(opt, "repeat=", 7) != 0)
+		errx(1, "invalid warm-up option \"%s\"", opt);
+
+	tsh_warmuprepeat = strtol(&opt[7], &end, 10);
+
+	if (*end != '\0' || tsh_warmuprepeat <= 0)
+		errx(1, "invalid number of warm-up repetitions");
+}
+
+/*
+ * Replay the warm-up portion of the trace, returning the first operation of
+ * the portion that remains to be measured (and its schedule offset).  By
+ * default, the warm-up is replayed once and the measured replay picks up
+ * where it ended; if the warm-up is to be repeated, it is replayed that many
+ * times, and the entire trace is then replayed.
+ */
+static tsh_op_t *
+tsh_warmup_replay(hrtime_t *basep)
+{
+	tsh_op_t *op = tsh_first, *end;
+	hrtime_t elapsed = 0;
+	int i, n = 0;
+
+	*basep = 0;
+
+	if (tsh_warmup == -1 && tsh_warmupops == -1)
+		return (tsh_first);
+
+	while (op != NULL && (tsh_warmupops != -1 ? n < tsh_warmupops :
+	    op->tsho_sched < tsh_warmup)) {
+		op = op->tsho_next;
+		n++;
+	}
+
+	if ((end = op) == NULL && tsh_warmuprepeat == 0)
+		errx(1, "warm-up covers the entire trace");
+
+	for (i = 0; i < MAX(tsh_warmuprepeat, 1); i++) {
+		if (i != 0)
+			tsh_forget(tsh_first, end);
+
+		tsh_dispatcher(tsh_first, end, 0);
+		elapsed += tsh_end - tsh_start;
+	}
+
+	/*
+	 * If the measured replay picks up where the warm-up ended, the ops
+	 * that we warmed up with must still appear complete to any later ops
+	 * in their streams; we forget only that they were started.
+	 */
+	tsh_forget(tsh_first, tsh_warmuprepeat != 0 ? end : tsh_first);
+
+	printf("%s: warm-up: %d operations, replayed %d time%s in %.1f ms "
+	    "(not measured)\n", "toshreplay", n, i, i == 1 ? "" : "s",
+	    (double)elapsed / (NANOSEC / MILLISEC));
+
+	if (tsh_warmuprepeat != 0)
+		return (tsh_first);
+
+	*basep = tsh_warmup != -1 ? tsh_warmup : end->tsho_sched;
+
+	return (end);
+}
+
+/*
+ * Parse the thresholds of the search for the largest speedup:  the p99
+ * latency (as a multiple of that in real time) and the p99 schedule lag at
+ * which a replay is degraded, the largest speedup to try, and the portion of
+ * the trace to replay.
+ */
+static void
+tsh_search_parse(char *arg)
+{
+	char *opt, *val, *end;
+
+	for (opt = arg; opt != NULL; opt = end) {
+		if ((end = strchr(opt, ',')) != NULL)
+			*end++ = '\0';
+
+		if ((val = strchr(opt, '=')) == NULL)
+			errx(1, "invalid search option \"%s\"", opt);
+
+		*val++ = '\0';
+
+		if (strcmp(opt, "p99") == 0) {
+			if ((tsh_search_p99 = strtod(val, &val)) <= 1 ||
+			    *val != '\0')
+				errx(1, "invalid p99 latency multiple");
+		} else if (strcmp(opt, "lag") == 0) {
+			if ((tsh_search_lag = tsh_clock_parse(val)) <= 0)
+				errx(1, "invalid schedule lag \"%s\"", val);
+		} else if (strcmp(opt, "max") == 0) {
+			if ((tsh_search_max = strtod(val, &val)) <= 1 ||
+			    *val != '\0')
+				errx(1, "invalid maximum speedup");
+		} else if (strcmp(opt, "window") == 0) {
+			if ((tsh_search_window = tsh_clock_parse(val)) <= 0)
+				errx(1, "invalid search window \"%s\"", val);
+		} else {
+			errx(1, "invalid search option \"%s\"", opt);
+		}
+	}
+
+	tsh_search = B_TRUE;
+}
+
+/*
+ * Replay the operations from first up to (but not including) last at the
+ * given speedup, returning the p99 latency and schedule lag.
+ */
+static void
+tsh_search_step(tsh_op_t *first, tsh_op_t *last, hrtime_t base, double speed,
+    hrtime_t *latp, hrtime_t *lagp)
+{
+	static tsh_hist_t lat, lag;
+	tsh_op_t *op;
+
+	tsh_forget(first, last);
+	tsh_speed = speed;
+	tsh_dispatcher(first, last, base);
+
+	tsh_hist_init(&lat);
+	tsh_hist_init(&lag);
+
+	for (op = tsh_firststart; op != NULL; op = op->tsho_nextstart) {
+		tsh_hist_add(&lat, op->tsho_done - op->tsho_start);
+		tsh_hist_add(&lag,
+		    MAX(op->tsho_start - tsh_start - tsh_sched_at(op), 0));
+	}
+
+	*latp = tsh_hist_pct(&lat, 0.99);
+	*lagp = tsh_hist_pct(&lag, 0.99);
+}
+
+/*
+ * Replay at the given speedup, reporting whether the replay was degraded
+ * relative to the real-time replay (with the given p99 latency).
+ */
+static boolean_t
+tsh_search_ok(tsh_op_t *first, tsh_op_t *last, hrtime_t base, double speed,
+    hrtime_t base99)
+{
+	hrtime_t lat, lag;
+	boolean_t ok;
+
+	tsh_search_step(first, last, base, speed, &lat, &lag);
+	ok = lat <= tsh_search_p99 * base99 && lag <= tsh_search_lag;
+
+	printf("%s: speedup %.2fx: p99 latency %.1f us (%.2fx real time), "
+	    "p99 schedlat %.1f us%s\n", "toshreplay", speed,
+	    (double)lat / 1000, (double)lat / MAX(base99, 1),
+	    (double)lag / 1000, ok ? "" : "; degraded");
+
+	return (ok);
+}
+
+/*
+ * Search for the largest speedup at which the trace (or its leading window)
+ * can be replayed without degrading it:  we replay in real time to establish
+ * the baseline tail latency, and then at doubling speedups until the replay
+ * degrades, and finally bisect (geometrically) between the fastest replay
+ * that didn't degrade and the slowest that did.
+ */
+static void
+tsh_search_run(tsh_op_t *first, hrtime_t base)
+{
+	tsh_op_t *last = first;
+	hrtime_t base99, lag;
+	double lo = 1, hi = -1, speed;
+	int n = 0;
+
+	while (last != NULL && (tsh_search_window == -1 ||
+	    last->tsho_sched - base < tsh_search_window)) {
+		last = last->tsho_next;
+		n++;
+	}
+
+	printf("%s: searching for the largest speedup of %d operations "
+	    "(p99 latency within %gx, p99 schedlat within %.1f us)\n",
+	    "toshreplay", n, tsh_search_p99, (double)tsh_search_lag / 1000);
+
+	tsh_search_step(first, last, base, 1, &base99, &lag);
+
+	printf("%s: speedup 1.00x: p99 latency %.1f us, p99 schedlat %.1f us"
+	    "\n", "toshreplay", (double)base99 / 1000, (double)lag / 1000);
+
+	if (lag > tsh_search_lag) {
+		printf("%s: can't replay in real time without exceeding the "
+		    "schedule lag threshold\n", "toshreplay");
+		return;
+	}
+
+	while (hi == -1 && lo < tsh_search_max) {
+		speed = MIN(lo * 2, tsh_search_max);
+
+		if (tsh_search_ok(first, last, base, speed, base99)) {
+			lo = speed;
+		} else {
+			hi = speed;
+		}
+	}
+
+	if (hi == -1) {
+		printf("%s: maximum sustainable speedup: at least %.2fx\n",
+		    "toshreplay", lo);
+		return;
+	}
+
+	while (hi / lo > TSH_SEARCH_PRECISION) {
+		speed = sqrt(lo * hi);
+
+		if (tsh_search_ok(first, last, base, speed, base99)) {
+			lo = speed;
+		} else {
+			hi = speed;
+		}
+	}
+
+	printf("%s: maximum sustainable speedup: %.2fx (degraded at %.2fx)\n",
+	    "toshreplay", lo, hi);
+}
+
+/*
+ * Parse a size in bytes, with an optional (binary) suffix.
+ */
+static off_t
+tsh_parse_size(const char *str)
+{
+	const char *units = "kmgt";
+	const char *unit;
+	char *end;
+	off_t val;
+
+	val = strtoll(str, &end, 10);
+
+	if (end == str || val <= 0)
+		return (-1);
+
+	if (*end == '\0')
+		return (val);
+
+	if (end[1] != '\0' || (unit = strchr(units, *end | 0x20)) == NULL)
+		return (-1);
+
+	return (val << (10 * (unit - units + 1)));
+}
+
+/*
+ * Parse a comma-separated list of admission policies, each of which may take
+ * a value.
+ */
+static void
+tsh_policy_parse(char *arg)
+{
+	char *opt, *val, *end;
+	tsh_policy_t *pl;
+	int i;
+
+	for (opt = arg; opt != NULL; opt = end) {
+		if ((end = strchr(opt, ',')) != NULL)
+			*end++ = '\0';
+
+		if ((val = strchr(opt, '=')) != NULL)
+			*val++ = '\0';
+
+		for (i = TSH_HELD_WORKER + 1; i < TSH_HELD_NREASONS; i++) {
+			if (strcmp(opt, tsh_policies[i].tshpl_name) == 0)
+				break;
+		}
+
+		if (i == TSH_HELD_NREASONS)
+			errx(1, "unknown admission policy \"%s\"", opt);
+
+		pl = &tsh_policies[i];
+
+		if (pl->tshpl_arg == TSH_POLICY_FLAG) {
+			if (val != NULL)
+				errx(1, "policy \"%s\" takes no value", opt);
+
+			pl->tshpl_val = 1;
+			continue;
+		}
+
+		if (val == NULL)
+			errx(1, "policy \"%s\" requires a value", opt);
+
+		if (pl->tshpl_arg == TSH_POLICY_SIZE) {
+			pl->tshpl_val = tsh_parse_size(val);
+
+			if (pl->tshpl_val % DEV_BSIZE != 0)
+				pl->tshpl_val = -1;
+		} else {
+			pl->tshpl_val = strtoll(val, &val, 10);
+
+			if (*val != '\0')
+				pl->tshpl_val = -1;
+		}
+
+		if (pl->tshpl_val <= 0)
+			errx(1, "invalid value for policy \"%s\"", opt);
+	}
+
+	tsh_policy = B_TRUE;
+}
+
+/*
+ * Report the host queueing added by each of our admission policies (and by
+ * the want of an idle worker), which is included in the schedule lag of each
+ * operation but not in its latency.
+ */
+static void
+tsh_policy_report(void)
+{
+	const tsh_hist_t *hist;
+	char buf[128] = "";
+	size_t len = 0;
+	int i;
+
+	if (!tsh_policy)
+		return;
+
+	for (i = TSH_HELD_WORKER + 1; i < TSH_HELD_NREASONS; i++) {
+		const tsh_policy_t *pl = &tsh_policies[i];
+
+		if (pl->tshpl_val == 0)
+			continue;
+
+		if (pl->tshpl_arg == TSH_POLICY_FLAG) {
+			len += snprintf(&buf[len], sizeof (buf) - len, " %s",
+			    pl->tshpl_name);
+		} else {
+			len += snprintf(&buf[len], sizeof (buf) - len,
+			    " %s=%lld", pl->tshpl_name, pl->tshpl_val);
+		}
+	}
+
+	printf("%s: admission:%s\n", "toshreplay", buf);
+
+	for (i = 0; i < TSH_HELD_NREASONS; i++) {
+		hist = &tsh_held[i];
+
+		if (hist->tshh_count == 0)
+			continue;
+
+		printf("%s: held %s: %llu ops (%.1f%%), host queueing "
+		    "mean %.1f us, p99 %.1f us, max %.1f us\n", "toshreplay",
+		    tsh_policies[i].tshpl_desc,
+		    (unsigned long long)hist->tshh_count,
+		    100.0 * hist->tshh_count / MAX(tsh_nops, 1),
+		    tsh_hist_mean(hist) / 1000,
+		    (double)tsh_hist_pct(hist, 0.99) / 1000,
+		    (double)hist->tshh_max / 1000);
+	}
+}
+
+static int
+tsh_hrcmp(const void *l, const void *r)
+{
+	hrtime_t lv = *(const hrtime_t *)l, rv = *(const hrtime_t *)r;
+
+	return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+/*
+ * Wait for the given number of calibration ops to have completed.
+ */
+static void
+tsh_calib_wait(int n)
+{
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	while (tsh_ncalib < n)
+		pthread_cond_wait(&tsh_main_cv, &tsh_worker_lock);
+
+	pthread_mutex_unlock(&tsh_worker_lock);
+}
+
+/*
+ * Measure what this host can do before we replay on it:  how precisely we
+ * can wait for a deadline, how long it takes a worker to pick up an op that
+ * we hand it, and how quickly we can hand off ops back to back.  Must be
+ * called from the dispatcher once the workers are ready.
+ */
+static void
+tsh_calibrate(tsh_calib_t *calib)
+{
+	hrtime_t lat[MAX(TSH_CALIB_NJITTER, TSH_CALIB_NHANDOFF)];
+	double rates[TSH_CALIB_NROUNDS];
+	hrtime_t deadline, start;
+	tsh_op_t *ops;
+	int i, b, n = 0;
+	int nsustain = MAX(TSH_CALIB_NSUSTAIN,
+	    TSH_CALIB_PERWORKER * tsh_nworkers);
+
+	/*
+	 * Timer jitter is how far past each deadline we get to run.
+	 */
+	for (i = 0; i < TSH_CALIB_NJITTER; i++) {
+		deadline = tsh_gethrtime() + TSH_CALIB_JITTERGAP;
+
+		while ((start = tsh_gethrtime()) < deadline)
+			continue;
+
+		lat[i] = start - deadline;
+	}
+
+	qsort(lat, TSH_CALIB_NJITTER, sizeof (hrtime_t), tsh_hrcmp);
+	calib->tshcl_jitter = lat[TSH_CALIB_NJITTER * 99 / 100];
+
+	if ((ops = calloc(MAX(TSH_CALIB_NHANDOFF, nsustain),
+	    sizeof (tsh_op_t))) == NULL)
+		err(1, "couldn't allocate calibration ops");
+
+	/*
+	 * Handoff latency is measured one op at a time, with all workers
+	 * idle.
+	 */
+	for (i = 0; i < TSH_CALIB_NHANDOFF; i++) {
+		ops[i].tsho_calib = B_TRUE;
+		ops[i].tsho_sched = tsh_gethrtime();
+
+		if (!tsh_handoff(&ops[i]))
+			errx(1, "no workers available for calibration");
+
+		tsh_calib_wait(++n);
+		lat[i] = ops[i].tsho_start - ops[i].tsho_sched;
+	}
+
+	qsort(lat, TSH_CALIB_NHANDOFF, sizeof (hrtime_t), tsh_hrcmp);
+	calib->tshcl_handoff = lat[TSH_CALIB_NHANDOFF / 2];
+	calib->tshcl_handoff99 = lat[TSH_CALIB_NHANDOFF * 99 / 100];
+
+	/*
+	 * The dispatch rate is the rate that we can sustain:  we hand off
+	 * ops back to back, many times more than there are workers, so that
+	 * each worker must come back for more (and we must wait for one when
+	 * none is idle).  We take the median of several such rounds.
+	 */
+	for (b = 0; b < TSH_CALIB_NROUNDS; b++) {
+		bzero(ops, nsustain * sizeof (tsh_op_t));
+		start = tsh_gethrtime();
+
+		for (i = 0; i < nsustain; i++) {
+			ops[i].tsho_calib = B_TRUE;
+
+			while (!tsh_handoff(&ops[i]))
+				continue;
+		}
+
+		tsh_calib_wait(n += nsustain);
+		rates[b] = (double)nsustain * NANOSEC /
+		    MAX(tsh_gethrtime() - start, 1);
+	}
+
+	for (b = 1; b < TSH_CALIB_NROUNDS; b++) {
+		double r = rates[b];
+
+		for (i = b; i > 0 && rates[i - 1] > r; i--)
+			rates[i] = rates[i - 1];
+
+		rates[i] = r;
+	}
+
+	calib->tshcl_rate = rates[TSH_CALIB_NROUNDS / 2];
+	free(ops);
+}
+
+/*
+ * Compare what the host can do with what the trace demands:  its peak rate
+ * (over any window of TSH_CALIB_WINDOW), its smallest gap between operations
+ * and its largest burst of simultaneous operations.  Refuses to replay a
+ * trace that the host can't keep up with (unless forced), and warns when
+ * operations will be late.  Under admission policies a burst larger than the
+ * pool is held on the host queue, and when searching for the maximum speedup
+ * running short of workers (or of dispatch rate) just makes ops late; both
+ * are reported rather than refused.
+ */
+static void
+tsh_calib_check(const tsh_calib_t *calib)
+{
+	tsh_op_t *op, *tail = tsh_first;
+	hrtime_t gap, mingap = -1;
+	int inwin = 0, peak = 0, burst = 0, maxburst = 0;
+	double rate;
+	boolean_t bad = B_FALSE;
+
+	for (op = tsh_first; op != NULL; op = op->tsho_next) {
+		inwin++;
+
+		while (tail->tsho_sched + TSH_CALIB_WINDOW <= op->tsho_sched) {
+			tail = tail->tsho_next;
+			inwin--;
+		}
+
+		peak = MAX(peak, inwin);
+
+		if (op->tsho_next == NULL)
+			continue;
+
+		gap = op->tsho_next->tsho_sched - op->tsho_sched;
+
+		if (gap > 0 && (mingap == -1 || gap < mingap))
+			mingap = gap;
+
+		/*
+		 * The next op in a burst needs a worker of its own unless it
+		 * will be parked behind its predecessor in the same stream.
+		 */
+		if (gap > 0) {
+			burst = 0;
+		} else if (op->tsho_next->tsho_streamprev == NULL ||
+		    op->tsho_next->tsho_streamprev->tsho_sched <
+		    op->tsho_sched) {
+			burst++;
+		}
+
+		maxburst = MAX(maxburst, burst + 1);
+	}
+
+	rate = (double)peak * NANOSEC / TSH_CALIB_WINDOW;
+
+	printf("%s: host: dispatch %.0f ops/s, handoff %.1f us "
+	    "(p99 %.1f us), timer jitter p99 %.1f us\n", "toshreplay",
+	    calib->tshcl_rate, (double)calib->tshcl_handoff / 1000,
+	    (double)calib->tshcl_handoff99 / 1000,
+	    (double)calib->tshcl_jitter / 1000);
+	printf("%s: trace: peak %.0f ops/s, minimum gap %.1f us, "
+	    "largest burst %d ops\n", "toshreplay", rate,
+	    mingap == -1 ? 0.0 : (double)mingap / 1000, maxburst);
+
+	if (tsh_search) {
+		printf("%s: host dispatch limits the speedup to %.3gx\n",
+		    "toshreplay", calib->tshcl_rate / MAX(rate, 1));
+	} else if (rate > calib->tshcl_rate) {
+		warnx("host can dispatch only %.0f ops/s, but trace peaks at "
+		    "%.0f ops/s", calib->tshcl_rate, rate);
+		bad = B_TRUE;
+	}
+
+	if (maxburst > tsh_nworkers) {
+		warnx("trace has a burst of %d simultaneous ops, but there "
+		    "are only %d workers%s", maxburst, tsh_nworkers,
+		    tsh_policy ? "; the rest will be held on the host queue" :
+		    tsh_search ? "; the rest will start late" : "");
+		bad = bad || !(tsh_policy || tsh_search);
+	}
+
+	if (bad && !tsh_force)
+		errx(1, "host can't replay this trace faithfully "
+		    "(-f to force)");
+
+	if (mingap != -1 && calib->tshcl_handoff > mingap) {
+		warnx("handoff latency (%.1f us) exceeds the trace's minimum "
+		    "gap (%.1f us); closely spaced ops will start late",
+		    (double)calib->tshcl_handoff / 1000, (double)mingap / 1000);
+	}
+
+	if (mingap != -1 && calib->tshcl_jitter > mingap) {
+		warnx("timer jitter (%.1f us) exceeds the trace's minimum "
+		    "gap (%.1f us); ops may start up to %.1f us late",
+		    (double)calib->tshcl_jitter / 1000, (double)mingap / 1000,
+		    (double)calib->tshcl_jitter / 1000);
+	}
+}
+
+/*
+ * Under admission policies, a started op also carries the time that it spent
+ * on the host queue and why (if it was held).
+ */
+static void
+tsh_dump_admit(tsh_op_t *op)
+{
+	if (!tsh_policy)
+		return;
+
+	printf(" hostq=%lld", op->tsho_admit - op->tsho_held);
+
+	if (op->tsho_heldby != -1)
+		printf(" held=%s", tsh_policies[op->tsho_heldby].tshpl_name);
+}
+
+static void
+tsh_dump_stream(tsh_op_t *op)
+{
+	if (op->tsho_stream != -1)
+		printf(" stream=%lld", op->tsho_stream);
+
+	printf("\n");
+}
+
+void
+tsh_dump()
+{
+	tsh_op_t *issued, *done, *op;
+
+	/*
+	 * We have two lists, both are tautologically sorted.  Print them
+	 * out in an absolute order.
+	 */
+	issued = tsh_firststart;
+	done = tsh_firstdone;
+
+	while (done != NULL) {
+		if (issued != NULL && issued->tsho_start <= done->tsho_done) {
+			op = issued;
+
+			printf("%lld -> type=%c blkno=%ld "
+			    "size=%ld outr=%d outw=%d schedlat=%lld",
+			    op->tsho_start - tsh_start,
+			    op->tsho_read ? 'R' : 'W',
+			    op->tsho_offset / DEV_BSIZE,
+			    op->tsho_size, op->tsho_outr, op->tsho_outw,
+			    op->tsho_start - tsh_start - tsh_sched_at(op));
+
+			issued = issued->tsho_nextstart;
+			tsh_dump_admit(op);
+			tsh_dump_stream(op);
+		} else {
+			op = done;
+
+			printf("%lld <- type=%c blkno=%ld "
+			    "size=%ld outr=%d outw=%d latency=%lld worker=%d",
+			    op->tsho_done - tsh_start,
+			    op->tsho_read ? 'R' : 'W',
+			    op->tsho_offset / DEV_BSIZE,
+			    op->tsho_size, op->tsho_doner, op->tsho_donew,
+			    op->tsho_done - op->tsho_start, op->tsho_worker);
+
+			done = done->tsho_nextdone;
+			tsh_dump_stream(op);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stat st;
+	char *file;
+	int c, i;
+	tsh_cost_t before[2], after[2], cost;
+	tsh_calib_t calib;
+	pthread_attr_t attr;
+	tsh_clock_test_t clock;
+	char *clocksrc = NULL;
+	tsh_op_t *first;
+	hrtime_t base;
+
+	while ((c = getopt(argc, argv, "a:hcfk:Lm:p:PRS:t:w:")) != -1) {
+		switch (c) {
+		case 'a':
+			tsh_sched_affinity(optarg, (1 << TSH_ROLE_DISPATCHER) |
+			    (1 << TSH_ROLE_WORKERS));
+			break;
 
-	while ((c = getopt(argc, argv, "hct:")) != -1) {
-		switch (c) {
 		case 'c':
 			tsh_clamp = B_TRUE;
 			break;
 
+		case 'f':
+			tsh_force = B_TRUE;
+			break;
+
+		case 'k':
+			clocksrc = optarg;
+			break;
+
+		case 'L':
+			tsh_sched_mlock = B_TRUE;
+			break;
+
+		case 'm':
+			tsh_io_parse(optarg);
+			break;
+
+		case 'p':
+			tsh_policy_parse(optarg);
+			break;
+
+		case 'P':
+			tsh_perf_enabled = B_TRUE;
+			break;
+
+		case 'R':
+			tsh_sched_rt = B_TRUE;
+			break;
+
+		case 'S':
+			tsh_search_parse(optarg);
+			break;
+
 		case 't': {
 			char *end;
 
@@ -408,6 +1668,10 @@ main(int argc, char *argv[])
 			break;
 		}
 
+		case 'w':
+			tsh_warmup_parse(optarg);
+			break;
+
 		default:
 			usage();
 		}
@@ -416,6 +1680,17 @@ main(int argc, char *argv[])
 	if (argc == optind)
 		usage();
 
+	tsh_clock_init(clocksrc);
+	tsh_clock_selftest(&clock);
+
+	printf("%s: clock: %s, %.1f ns/call, resolution %lld ns\n",
+	    "toshreplay", clock.tsht_name, clock.tsht_callns, clock.tsht_res);
+
+	if (clock.tsht_backwards != 0) {
+		warnx("clock went backwards %llu times during self-test",
+		    (unsigned long long)clock.tsht_backwards);
+	}
+
 	if ((tsh_buffer = malloc(tsh_bufsz)) == NULL)
 		err(1, "couldn't allocate write buffer");
 
@@ -427,15 +1702,52 @@ main(int argc, char *argv[])
 	if (fstat(tsh_fd, &st) != 0)
 		err(1, "fstat(%d) (\"%s\"):", tsh_fd, file);
 
+	/*
+	 * A mapping of a device goes through the page cache whatever kind of
+	 * device it is, and raw devices generally can't be mapped, so mmap mode
+	 * wants the block device instead.  Its size isn't in st_size.
+	 */
+	tsh_size = st.st_size;
+
 	if (S_ISREG(st.st_mode)) {
 		warnx("replaying I/O on a regular file");
+	} else if (S_ISBLK(st.st_mode) && tsh_io_mode == TSH_IO_MMAP) {
+		if ((tsh_size = lseek(tsh_fd, 0, SEEK_END)) < 0)
+			err(1, "couldn't size \"%s\"", file);
 	} else if (S_ISBLK(st.st_mode)) {
 		errx(1, "refusing to operate on (buffered) block device\n");
 	} else if (!S_ISCHR(st.st_mode)) {
 		errx(1, "unsupported file type");
+	} else if (tsh_io_mode == TSH_IO_MMAP) {
+		errx(1, "can't map a raw device; use its block device");
 	}
 
-	tsh_size = st.st_size;
+	if (tsh_io_mode == TSH_IO_MMAP) {
+		char iobuf[64];
+
+		if (tsh_sched_mlock)
+			errx(1, "can't lock memory when performing I/O "
+			    "with mmap");
+
+		tsh_io_init(tsh_fd, tsh_size);
+		tsh_io_describe(iobuf, sizeof (iobuf));
+		printf("%s: io: %s\n", "toshreplay", iobuf);
+	}
+
+	/*
+	 * The dispatcher's counters are in the first slot, followed by one
+	 * slot for each worker.
+	 */
+	if ((tsh_perf = calloc(tsh_nworkers + 1, sizeof (tsh_perf_t))) == NULL)
+		err(1, "couldn't allocate counters");
+
+	tsh_perf_thread_init(&tsh_perf[0]);
+	tsh_sched_init(file, tsh_fd);
+
+	if (pthread_attr_init(&attr) != 0)
+		err(1, "pthread_attr_init");
+
+	tsh_sched_stack(&attr, tsh_bufsz);
 
 	/*
 	 * Create our workers before we read the replay log to give them
@@ -448,9 +1760,11 @@ main(int argc, char *argv[])
 			err(1, "couldn't allocate worker");
 
 		pthread_cond_init(&worker->tshw_cv, NULL);
+		worker->tshw_perf = &tsh_perf[i + 1];
+		worker->tshw_index = i;
 
-		if (pthread_create(&worker->tshw_id, NULL,
-		    (void *(*)(void *))tsh_worker, worker) != 0) {
+		if (pthread_create(&worker->tshw_id, &attr,
+		    tsh_worker, worker) != 0) {
 			err(1, "couldn't create worker");
 		}
 	}
@@ -458,7 +1772,57 @@ main(int argc, char *argv[])
 	tsh_log = stdin;
 	read_log();
 
-	tsh_dispatcher();
+	tsh_sched_enter(TSH_ROLE_DISPATCHER);
+
+	pthread_mutex_lock(&tsh_worker_lock);
+
+	while (tsh_nready < tsh_nworkers)
+		pthread_cond_wait(&tsh_main_cv, &tsh_worker_lock);
+
+	pthread_mutex_unlock(&tsh_worker_lock);
+
+	tsh_calibrate(&calib);
+	tsh_calib_check(&calib);
+
+	first = tsh_warmup_replay(&base);
+
+	if (tsh_search) {
+		tsh_search_run(first, base);
+		tsh_sched_report(stdout, "toshreplay");
+		return (0);
+	}
+
+	/*
+	 * The first slot of our snapshots is the dispatcher alone.
+	 */
+	tsh_cost_snap(&before[0], tsh_perf, 1);
+	tsh_cost_snap(&before[1], tsh_perf, tsh_nworkers + 1);
+	tsh_dispatcher(first, NULL, base);
+	tsh_cost_snap(&after[0], tsh_perf, 1);
+	tsh_cost_snap(&after[1], tsh_perf, tsh_nworkers + 1);
+
+	if (tsh_nparked != 0) {
+		printf("%s: %d operations waited on their stream\n",
+		    "toshreplay", tsh_nparked);
+	}
+
+	tsh_policy_report();
 	tsh_dump();
+
+	if (tsh_perf_enabled) {
+		tsh_cost_diff(&cost, &after[1], &before[1]);
+		tsh_cost_report(stdout, "toshreplay", &cost,
+		    tsh_nops, tsh_nbytes, tsh_end - tsh_start);
+
+		tsh_cost_diff(&cost, &after[0], &before[0]);
+
+		if (cost.tshc_ctrvalid[TSH_PERF_CYCLES] && tsh_nops != 0) {
+			printf("%s: dispatcher: %.0f cycles/op\n", "toshreplay",
+			    (double)cost.tshc_ctr[TSH_PERF_CYCLES] / tsh_nops);
+		}
+	}
+
+	tsh_sched_report(stdout, "toshreplay");
+
 	return (0);
 }
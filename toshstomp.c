@@ -5,26 +5,98 @@
 #include <err.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <alloca.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "tsh_clock.h"
+#include "tsh_hist.h"
+#include "tsh_io.h"
+#include "tsh_perf.h"
+#include "tsh_rand.h"
+#include "tsh_sched.h"
 
 #define	TSH_NWRITERS	10
 #define	TSH_NREADERS	10
 #define	TSH_BUFSHIFT    13	/* default buffer size of 8192 bytes */
 #define	TSH_BUFMASK	(tsh_bufsz - 1)
+#define	TSH_BURST_NAP	(100 * (NANOSEC / MILLISEC))	/* longest wait */
+#define	TSH_CTL_MAXTHREADS	128	/* readers or writers with -c */
+#define	TSH_CTL_MAXBUFSZ	(1 << 20)	/* largest I/O with -c */
+#define	TSH_CTL_LINE_MAX	256	/* longest control command */
+#define	TSH_CTL_NAP_MIN	(10 * (NANOSEC / MILLISEC)) /* accept() backoff */
+#define	TSH_CTL_NAP_MAX	NANOSEC			/* ... up to this */
+#define	TSH_RAMP_MAXTHREADS	64	/* default most threads in a ramp */
+
+typedef enum tsh_outfmt {
+	TSH_OUT_TEXT,		/* human-readable columns */
+	TSH_OUT_JSON,		/* one JSON object per line */
+	TSH_OUT_CSV		/* comma-separated values */
+} tsh_outfmt_t;
+
+typedef struct tsh_stats {
+	uint64_t	tshs_nreads;		/* reads completed */
+	hrtime_t	tshs_time_reading;	/* time spent reading */
+	uint64_t	tshs_nwrites;		/* writes completed */
+	hrtime_t	tshs_time_writing;	/* time spent writing */
+	uint64_t	tshs_nbytes;		/* bytes read or written */
+} tsh_stats_t;
+
+typedef struct tsh_burst_win {
+	uint64_t	tshbw_nreads;		/* reads started in window */
+	hrtime_t	tshbw_time_reading;	/* time spent reading */
+	hrtime_t	tshbw_maxlat;		/* longest read */
+} tsh_burst_win_t;
+
+typedef struct tsh_ramp_step {
+	unsigned int	tshrs_nthreads;		/* threads running */
+	double		tshrs_rate;		/* operations per second */
+	hrtime_t	tshrs_p50;		/* median latency */
+	hrtime_t	tshrs_p99;		/* p99 latency */
+	hrtime_t	tshrs_p999;		/* p99.9 latency */
+} tsh_ramp_step_t;
 
 /* reporting interval */
 static unsigned int tsh_report_msec = 1000;
+/* how long to run, or 0 to run until interrupted */
+static hrtime_t tsh_duration;
+/* set when our threads should stop */
+static volatile boolean_t tsh_stop;
+/* format of our reports */
+static tsh_outfmt_t tsh_outfmt = TSH_OUT_TEXT;
+/* where informational messages go (kept off stdout for machine formats) */
+static FILE *tsh_info;
+/* emitting report column headers rather than values */
+static boolean_t tsh_out_header;
+/* number of fields emitted so far in the current report line */
+static int tsh_out_nfields;
 
 /* buffer of data that we will write out */
 static char *tsh_buffer;
-/* size of buffer */
+/* size of buffer (and of each I/O) */
 off_t tsh_bufsz = (1 << TSH_BUFSHIFT);
+/* largest that tsh_bufsz may become */
+static off_t tsh_bufmax;
 /* identifiers for the threads we create */
 static pthread_t *tsh_threads;
+/* counters for each of the threads we create */
+static tsh_perf_t *tsh_perf;
+/* barrier at which our threads wait until all are ready */
+static pthread_barrier_t tsh_ready;
 /* file descriptor for the disk or file that we're operating on */
 static int tsh_fd;
 /* size of the disk or file that we're working on */
@@ -37,18 +109,131 @@ static off_t tsh_write_lba_current;
 static unsigned int tsh_write_lba_wraparounds;
 /* lock that protects tsh_write_lba_current */
 static pthread_mutex_t tsh_write_lba_lock = PTHREAD_MUTEX_INITIALIZER;
+/* readers and writers running, of the tsh_nreaders and tsh_nwriters created */
+static unsigned int tsh_nreaders_active;
+static unsigned int tsh_nwriters_active;
+static unsigned int tsh_nreaders;
+static unsigned int tsh_nwriters;
+/* target reads and writes per second, or 0 for as many as possible */
+static unsigned int tsh_read_rate;
+static unsigned int tsh_write_rate;
+/* earliest time at which the next read or write may start, if paced */
+static hrtime_t tsh_read_next;
+static hrtime_t tsh_write_next;
+/* path of our control socket, if any */
+static char *tsh_ctl_path;
+/* listening control socket */
+static int tsh_ctl_fd = -1;
+/* start of the run, for offsets of control changes */
+static hrtime_t tsh_ctl_start;
+/* lock and condition variable on which idle threads wait to be needed */
+static pthread_mutex_t tsh_ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tsh_ctl_cv = PTHREAD_COND_INITIALIZER;
+/*
+ * Ramps.  When a ramp step is set, the number of readers (or writers) is
+ * increased by tsh_ramp_by at each step, up to tsh_ramp_max; the latency of
+ * each of their operations is counted in the histogram for the current step.
+ */
+/* time between steps, or 0 not to ramp */
+static hrtime_t tsh_ramp_every;
+/* ramping readers (rather than writers) */
+static boolean_t tsh_ramp_reads;
+/* threads added at each step, and most threads */
+static unsigned int tsh_ramp_by = 1;
+static unsigned int tsh_ramp_max = TSH_RAMP_MAXTHREADS;
+/* latency in the current step (and in the last, as it is reported) */
+static tsh_hist_t tsh_ramp_hist[2];
+static int tsh_ramp_cur;
+/* recorders in the middle of adding to each histogram */
+static unsigned int tsh_ramp_inflight[2];
+/* results of each step */
+static tsh_ramp_step_t *tsh_ramp_steps;
+static int tsh_ramp_nsteps;
+static int tsh_ramp_maxsteps;
+/* seed for read LBAs, or 0 to choose them unpredictably */
+static uint64_t tsh_seed;
+/* each reader's generator state, when seeded */
+static __thread uint64_t tsh_rand_state;
+
+/*
+ * Transaction group bursts.  When a burst period is set, writers write in
+ * bursts of tsh_burst_size bytes at the start of each period rather than
+ * continuously, and read latency is accumulated in windows of time relative
+ * to the start of each burst.  The state of the current burst is protected
+ * by tsh_burst_lock.
+ */
+/* period between bursts, or 0 to write continuously */
+static hrtime_t tsh_burst_period;
+/* bytes written in each burst */
+static off_t tsh_burst_size = 1LL << 30;
+/* writers (and so writes outstanding) during a burst */
+static unsigned int tsh_burst_qd = 32;
+/* width of each window of read latency */
+static hrtime_t tsh_burst_window = 100 * (NANOSEC / MILLISEC);
+/* lock that protects the state of the current burst */
+static pthread_mutex_t tsh_burst_lock = PTHREAD_MUTEX_INITIALIZER;
+/* start of the current burst, and of the next */
+static hrtime_t tsh_burst_start;
+static hrtime_t tsh_burst_next;
+/* writes of the current burst yet to be issued, and outstanding */
+static uint64_t tsh_burst_left;
+static uint64_t tsh_burst_out;
+/* set when the current burst has run into the next period */
+static boolean_t tsh_burst_overran;
+/* bursts started, completed (within their period) and overrun */
+static uint64_t tsh_burst_n;
+static uint64_t tsh_burst_ndone;
+static uint64_t tsh_burst_noverran;
+/* total and longest time taken by completed bursts */
+static hrtime_t tsh_burst_time;
+static hrtime_t tsh_burst_maxtime;
+/* read latency by window since the start of a burst */
+static tsh_burst_win_t *tsh_burst_wins;
+static int tsh_burst_nwins;
 
+/*
+ * Statistics since the last report.  These are updated by every I/O thread,
+ * so are only manipulated atomically.
+ */
 /* total number of reads completed */
-static int tsh_nreads;
+static uint64_t tsh_nreads;
 /* time spent reading */
 static hrtime_t tsh_time_reading;
 /* total number of writes completed */
-static int tsh_nwrites;
+static uint64_t tsh_nwrites;
 /* time spent writing */
 static hrtime_t tsh_time_writing;
+/* bytes read or written, since the size of each may change */
+static uint64_t tsh_nbytes;
 
 static void usage(void);
 static void init_buffer(char *, size_t);
+static void stats_take(tsh_stats_t *);
+static void stats_read(hrtime_t, off_t);
+static void stats_write(hrtime_t, off_t);
+static off_t tsh_read_lba(off_t);
+static off_t tsh_write_lba_next(off_t);
+static void tsh_park(unsigned int, unsigned int *);
+static void tsh_pace(unsigned int *, hrtime_t *);
+static off_t tsh_parse_size(const char *);
+static void tsh_ramp_parse(char *);
+static void tsh_ramp_rec(hrtime_t);
+static void *tsh_ramp_thread(void *);
+static void tsh_ramp_report(void);
+static void tsh_ctl_init(void);
+static void tsh_ctl_threads(unsigned int *, unsigned int);
+static void *tsh_ctl_thread(void *);
+static void tsh_burst_parse(char *);
+static boolean_t tsh_burst_claim(void);
+static void tsh_burst_write_done(hrtime_t);
+static void tsh_burst_read_done(hrtime_t, hrtime_t);
+static void tsh_burst_report(void);
+static void report_row(const char *, hrtime_t, hrtime_t, tsh_stats_t *,
+    tsh_cost_t *);
+static void report_settings(void);
+static void report_change(const char *);
+static void report_header(void);
+static void report_cost(tsh_cost_t *, uint64_t, uint64_t);
 static void *tsh_thread_writer(void *);
 static void *tsh_thread_reader(void *);
 
@@ -60,14 +245,31 @@ main(int argc, char *argv[])
 	int error;
 	unsigned int nwriters = TSH_NWRITERS;
 	unsigned int nreaders = TSH_NREADERS;
-	char timebuf[25];
 	char *file;
 	int c;
+	tsh_cost_t firstsnap, lastsnap, snap, cost;
+	tsh_stats_t stats, total;
+	tsh_clock_test_t clock;
+	char *clocksrc = NULL;
+	char iobuf[64];
+	boolean_t wflag = B_FALSE;
+	hrtime_t start, last, next, deadline, now;
+	struct timespec ts;
+	sigset_t sigs;
+	pthread_attr_t attr;
+	pthread_t ctl, ramp;
+
+	tsh_info = stdout;
 
-	while ((c = getopt(argc, argv, "b:r:w:")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:c:d:g:k:Lm:o:p:Pr:s:w:")) != -1) {
 		char *end;
 
 		switch (c) {
+		case 'a':
+			tsh_sched_affinity(optarg, (1 << TSH_ROLE_WORKERS) |
+			    (1 << TSH_ROLE_REPORTER));
+			break;
+
 		case 'b': {
 			int bufshift = strtoul(optarg, &end, 10);
 
@@ -78,6 +280,55 @@ main(int argc, char *argv[])
 			break;
 		}
 
+		case 'c':
+			tsh_ctl_path = optarg;
+			break;
+
+		case 'd':
+			if ((tsh_duration = tsh_clock_parse(optarg)) <= 0)
+				errx(1, "invalid duration");
+
+			break;
+
+		case 'g':
+			tsh_burst_parse(optarg);
+			break;
+
+		case 'k':
+			clocksrc = optarg;
+			break;
+
+		case 'L':
+			tsh_sched_mlock = B_TRUE;
+			break;
+
+		case 'm':
+			tsh_io_parse(optarg);
+			break;
+
+		case 'o':
+			if (strcmp(optarg, "text") == 0) {
+				tsh_outfmt = TSH_OUT_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				tsh_outfmt = TSH_OUT_JSON;
+			} else if (strcmp(optarg, "csv") == 0) {
+				tsh_outfmt = TSH_OUT_CSV;
+			} else {
+				errx(1, "invalid output format");
+			}
+
+			tsh_info = (tsh_outfmt == TSH_OUT_TEXT) ?
+			    stdout : stderr;
+			break;
+
+		case 'p':
+			tsh_ramp_parse(optarg);
+			break;
+
+		case 'P':
+			tsh_perf_enabled = B_TRUE;
+			break;
+
 		case 'r':
 			nreaders = strtoul(optarg, &end, 10);
 
@@ -86,12 +337,21 @@ main(int argc, char *argv[])
 
 			break;
 
+		case 's':
+			tsh_seed = strtoull(optarg, &end, 0);
+
+			if (*end != '\0' || tsh_seed == 0)
+				errx(1, "invalid seed");
+
+			break;
+
 		case 'w':
 			nwriters = strtoul(optarg, &end, 10);
 
 			if (*end != '\0')
 				errx(1, "invalid number of writers");
 
+			wflag = B_TRUE;
 			break;
 
 		default:
@@ -103,10 +363,23 @@ main(int argc, char *argv[])
 		usage();
 	}
 
-	if ((tsh_buffer = malloc(tsh_bufsz)) == NULL)
+	if (tsh_burst_period != 0 && wflag)
+		errx(1, "-w can't be used with -g (qd= sets the writers)");
+
+	tsh_clock_init(clocksrc);
+	tsh_clock_selftest(&clock);
+
+	/*
+	 * With a control socket, the size of each I/O may grow, so our
+	 * buffers are allocated for the largest that it may become.
+	 */
+	tsh_bufmax = tsh_ctl_path != NULL ?
+	    MAX(tsh_bufsz, TSH_CTL_MAXBUFSZ) : tsh_bufsz;
+
+	if ((tsh_buffer = malloc(tsh_bufmax)) == NULL)
 		err(1, "couldn't allocate write buffer");
 
-	init_buffer(tsh_buffer, tsh_bufsz);
+	init_buffer(tsh_buffer, tsh_bufmax);
 	tsh_fd = open(file = argv[optind], O_RDWR);
 	if (tsh_fd < 0) {
 		err(1, "open \"%s\"", file);
@@ -116,15 +389,25 @@ main(int argc, char *argv[])
 		err(1, "fstat(%d) (\"%s\"):", tsh_fd, file);
 	}
 
+	/*
+	 * A mapping of a device goes through the page cache whatever kind of
+	 * device it is, and raw devices generally can't be mapped, so mmap mode
+	 * wants the block device instead.  Its size isn't in st_size.
+	 */
+	tsh_size = st.st_size;
+
 	if (S_ISREG(st.st_mode)) {
 		warnx("operating on a regular file");
+	} else if (S_ISBLK(st.st_mode) && tsh_io_mode == TSH_IO_MMAP) {
+		if ((tsh_size = lseek(tsh_fd, 0, SEEK_END)) < 0)
+			err(1, "couldn't size \"%s\"", file);
 	} else if (S_ISBLK(st.st_mode)) {
 		errx(1, "refusing to operate on (buffered) block device\n");
 	} else if (!S_ISCHR(st.st_mode)) {
 		errx(1, "unsupported file type");
+	} else if (tsh_io_mode == TSH_IO_MMAP) {
+		errx(1, "can't map a raw device; use its block device");
 	}
-
-	tsh_size = st.st_size;
 	tsh_write_lba_init = (tsh_size / 2) & (~TSH_BUFMASK);
 	tsh_write_lba_current = tsh_write_lba_init;
 
@@ -132,20 +415,137 @@ main(int argc, char *argv[])
 		errx(1, "file is too small");
 	}
 
+	if (tsh_io_mode == TSH_IO_MMAP && tsh_sched_mlock)
+		errx(1, "can't lock memory when performing I/O with mmap");
+
+	tsh_io_init(tsh_fd, tsh_size);
+	tsh_io_describe(iobuf, sizeof (iobuf));
+
+	/*
+	 * In burst mode, there is a writer for each write that a burst keeps
+	 * outstanding.
+	 */
+	if (tsh_burst_period != 0) {
+		nwriters = tsh_burst_qd;
+		tsh_burst_nwins = (tsh_burst_period + tsh_burst_window - 1) /
+		    tsh_burst_window;
+
+		if ((tsh_burst_wins = calloc(tsh_burst_nwins,
+		    sizeof (tsh_burst_win_t))) == NULL)
+			err(1, "couldn't allocate burst windows");
+	}
+
+	tsh_nreaders_active = nreaders;
+	tsh_nwriters_active = nwriters;
+
+	/*
+	 * A ramp creates all the threads it will need up front, with those
+	 * beyond the number running waiting until they are needed.  This is
+	 * sized before any control socket adds threads of its own below.
+	 */
+	if (tsh_ramp_every != 0) {
+		unsigned int *n = tsh_ramp_reads ? &nreaders : &nwriters;
+
+		if (*n > tsh_ramp_max)
+			errx(1, "ramp starts with more than %u threads",
+			    tsh_ramp_max);
+
+		tsh_ramp_maxsteps = (tsh_ramp_max - *n) / tsh_ramp_by + 2;
+
+		if ((tsh_ramp_steps = calloc(tsh_ramp_maxsteps,
+		    sizeof (tsh_ramp_step_t))) == NULL)
+			err(1, "couldn't allocate ramp steps");
+
+		*n = MAX(*n, tsh_ramp_max);
+		tsh_hist_init(&tsh_ramp_hist[0]);
+		tsh_hist_init(&tsh_ramp_hist[1]);
+	}
+
+	/*
+	 * Likewise, with a control socket, we create as many readers and
+	 * writers as may be asked for.
+	 */
+	if (tsh_ctl_path != NULL) {
+		nreaders = MAX(nreaders, TSH_CTL_MAXTHREADS);
+		nwriters = MAX(nwriters, TSH_CTL_MAXTHREADS);
+	}
+
+	tsh_nreaders = nreaders;
+	tsh_nwriters = nwriters;
+
 	tsh_threads = malloc((nwriters + nreaders) * sizeof (pthread_t));
 
 	if (tsh_threads == NULL)
 		err(1, "couldn't allocate thread buffer");
 
-	(void) printf("file: %s\n", file);
-	(void) printf("size: 0x%lx\n", tsh_size);
-	(void) printf("buffer size: %ld\n", tsh_bufsz);
-	(void) printf("writers: %d\n", nwriters);
-	(void) printf("readers: %d\n", nreaders);
-	(void) printf("using initial write LBA: 0x%lx\n", tsh_write_lba_init);
+	tsh_perf = calloc(nwriters + nreaders, sizeof (tsh_perf_t));
+
+	if (tsh_perf == NULL)
+		err(1, "couldn't allocate counters");
+
+	if (pthread_barrier_init(&tsh_ready, NULL,
+	    nwriters + nreaders + 1) != 0)
+		err(1, "pthread_barrier_init");
+
+	tsh_sched_init(file, tsh_fd);
+
+	if (pthread_attr_init(&attr) != 0)
+		err(1, "pthread_attr_init");
+
+	tsh_sched_stack(&attr, tsh_bufmax);
+
+	if (tsh_ctl_path != NULL)
+		tsh_ctl_init();
+
+	(void) fprintf(tsh_info, "file: %s\n", file);
+	(void) fprintf(tsh_info, "size: 0x%lx\n", tsh_size);
+	(void) fprintf(tsh_info, "buffer size: %ld\n", tsh_bufsz);
+	(void) fprintf(tsh_info, "writers: %d\n", tsh_nwriters_active);
+	(void) fprintf(tsh_info, "readers: %d\n", tsh_nreaders_active);
+	(void) fprintf(tsh_info, "io: %s\n", iobuf);
+
+	if (tsh_burst_period != 0) {
+		(void) fprintf(tsh_info, "bursts: %lld bytes every %.3fs at "
+		    "QD %u\n", (long long)tsh_burst_size,
+		    (double)tsh_burst_period / NANOSEC, tsh_burst_qd);
+	}
+
+	if (tsh_ctl_path != NULL) {
+		(void) fprintf(tsh_info, "control: %s (up to %u readers and "
+		    "%u writers)\n", tsh_ctl_path, nreaders, nwriters);
+	}
+
+	if (tsh_ramp_every != 0) {
+		(void) fprintf(tsh_info, "ramp: %u %s every %.3fs, up to %u\n",
+		    tsh_ramp_by, tsh_ramp_reads ? "readers" : "writers",
+		    (double)tsh_ramp_every / NANOSEC, tsh_ramp_max);
+	}
+
+	(void) fprintf(tsh_info, "using initial write LBA: 0x%lx\n",
+	    tsh_write_lba_init);
+	(void) fprintf(tsh_info, "clock: %s, %.1f ns/call, "
+	    "resolution %lld ns\n", clock.tsht_name, clock.tsht_callns,
+	    clock.tsht_res);
+
+	if (clock.tsht_backwards != 0) {
+		warnx("clock went backwards %llu times during self-test",
+		    (unsigned long long)clock.tsht_backwards);
+	}
+
+	/*
+	 * We block the signals that stop us before creating any threads, so
+	 * that they are only ever consumed by our sigtimedwait() below.
+	 */
+	(void) sigemptyset(&sigs);
+	(void) sigaddset(&sigs, SIGINT);
+	(void) sigaddset(&sigs, SIGTERM);
+	(void) sigaddset(&sigs, SIGHUP);
+
+	if ((error = pthread_sigmask(SIG_BLOCK, &sigs, NULL)) != 0)
+		errx(1, "pthread_sigmask: %s", strerror(error));
 
 	for (i = 0; i < nwriters; i++) {
-		error = pthread_create(&tsh_threads[i], NULL,
+		error = pthread_create(&tsh_threads[i], &attr,
 		    tsh_thread_writer, (void *)(uintptr_t)i);
 		if (error != 0) {
 			err(1, "pthread_create");
@@ -153,48 +553,130 @@ main(int argc, char *argv[])
 	}
 
 	for (i = 0; i < nreaders; i++) {
-		error = pthread_create(&tsh_threads[i + nwriters], NULL,
-		    tsh_thread_reader, (void *)(uintptr_t)i);
+		error = pthread_create(&tsh_threads[i + nwriters], &attr,
+		    tsh_thread_reader, (void *)(uintptr_t)(i + nwriters));
 		if (error != 0) {
 			err(1, "pthread_create");
 		}
 	}
 
-	(void) printf("%20s %7s %7s %7s %7s %14s %2s\n", "TIME",
-	    "NREADS", "RDLATus", "NWRITE", "WRLATus", "WRLBA", "WR");
+	/*
+	 * Our threads inherit our binding, so we only bind ourselves once
+	 * they've been created.
+	 */
+	tsh_sched_enter(TSH_ROLE_REPORTER);
+
+	(void) pthread_barrier_wait(&tsh_ready);
+	tsh_cost_snap(&firstsnap, tsh_perf, nwriters + nreaders);
+	lastsnap = firstsnap;
+	bzero(&total, sizeof (total));
+
+	report_header();
+
+	start = last = next = tsh_ctl_start = tsh_gethrtime();
+
+	/*
+	 * The control thread is created only now, so that any change that it
+	 * makes is reported after the header.
+	 */
+	if (tsh_ctl_path != NULL) {
+		if ((error = pthread_create(&ctl, &attr, tsh_ctl_thread,
+		    NULL)) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+
+	if (tsh_ramp_every != 0) {
+		if ((error = pthread_create(&ramp, &attr, tsh_ramp_thread,
+		    NULL)) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
 
 	for (;;) {
-		time_t now;
-		struct tm nowtm;
+		next += (hrtime_t)__atomic_load_n(&tsh_report_msec,
+		    __ATOMIC_RELAXED) * (NANOSEC / MILLISEC);
+		deadline = next;
+
+		if (tsh_duration != 0 && start + tsh_duration < deadline)
+			deadline = start + tsh_duration;
 
-		(void) usleep(tsh_report_msec * 1000);
-		/* XXX check buffer overflow conditions */
-		(void) time(&now);
-		(void) gmtime_r(&now, &nowtm);
-		(void) strftime(timebuf, sizeof (timebuf), "%FT%TZ", &nowtm);
+		while ((now = tsh_gethrtime()) < deadline) {
+			ts.tv_sec = (deadline - now) / NANOSEC;
+			ts.tv_nsec = (deadline - now) % NANOSEC;
 
-		(void) printf("%20s %7d %7ld %7d %7ld 0x%012lx %2d\n", timebuf,
-		    tsh_nreads, tsh_nreads ? (unsigned long)
-		    (tsh_time_reading / tsh_nreads / 1000) : 0,
-		    tsh_nwrites, tsh_nwrites ? (unsigned long)
-		    (tsh_time_writing / tsh_nwrites / 1000) : 0,
-		    tsh_write_lba_current, tsh_write_lba_wraparounds);
+			if (sigtimedwait(&sigs, NULL, &ts) != -1) {
+				tsh_stop = B_TRUE;
+				break;
+			}
 
-		tsh_nreads = 0;
-		tsh_nwrites = 0;
-		tsh_time_writing = 0;
-		tsh_time_reading = 0;
+			if (errno != EAGAIN && errno != EINTR)
+				err(1, "sigtimedwait");
+		}
+
+		/*
+		 * The last interval is reported once our threads have stopped.
+		 */
+		if (tsh_stop || deadline == start + tsh_duration)
+			break;
+
+		stats_take(&stats);
+		tsh_cost_snap(&snap, tsh_perf, nwriters + nreaders);
+		tsh_cost_diff(&cost, &snap, &lastsnap);
+		report_row("interval", now - start, now - last, &stats, &cost);
+
+		total.tshs_nreads += stats.tshs_nreads;
+		total.tshs_time_reading += stats.tshs_time_reading;
+		total.tshs_nwrites += stats.tshs_nwrites;
+		total.tshs_time_writing += stats.tshs_time_writing;
+		total.tshs_nbytes += stats.tshs_nbytes;
+		lastsnap = snap;
+		last = now;
 	}
 
 	/*
-	 * Note: nothing currently causes these threads to terminate, or for us
-	 * to get here.
+	 * Tell our threads to stop, and wait for their last operations to
+	 * complete before reporting on the final (possibly partial) interval
+	 * and on the run as a whole.
 	 */
-	for (i = 0; i < TSH_NWRITERS + TSH_NREADERS; i++) {
-		/* XXX VERIFY return value */
-		(void) pthread_join(tsh_threads[i], NULL);
+	tsh_stop = B_TRUE;
+
+	(void) pthread_mutex_lock(&tsh_ctl_lock);
+	(void) pthread_cond_broadcast(&tsh_ctl_cv);
+	(void) pthread_mutex_unlock(&tsh_ctl_lock);
+
+	for (i = 0; i < nwriters + nreaders; i++) {
+		if ((error = pthread_join(tsh_threads[i], NULL)) != 0)
+			errx(1, "pthread_join: %s", strerror(error));
+	}
+
+	now = tsh_gethrtime();
+	stats_take(&stats);
+	tsh_cost_snap(&snap, tsh_perf, nwriters + nreaders);
+	tsh_cost_diff(&cost, &snap, &lastsnap);
+	report_row("interval", now - start, now - last, &stats, &cost);
+
+	total.tshs_nreads += stats.tshs_nreads;
+	total.tshs_time_reading += stats.tshs_time_reading;
+	total.tshs_nwrites += stats.tshs_nwrites;
+	total.tshs_time_writing += stats.tshs_time_writing;
+	total.tshs_nbytes += stats.tshs_nbytes;
+
+	tsh_cost_diff(&cost, &snap, &firstsnap);
+	report_row("summary", now - start, now - start, &total, &cost);
+	tsh_sched_report(tsh_info, "toshstomp");
+
+	if (tsh_burst_period != 0)
+		tsh_burst_report();
+
+	if (tsh_ramp_every != 0) {
+		if ((error = pthread_join(ramp, NULL)) != 0)
+			errx(1, "pthread_join: %s", strerror(error));
+
+		tsh_ramp_report();
 	}
 
+	if (tsh_ctl_path != NULL)
+		(void) unlink(tsh_ctl_path);
+
 	return (0);
 }
 
@@ -202,10 +684,311 @@ static void
 usage(void)
 {
 	(void) fprintf(stderr, "usage: toshstomp [-r #readers] "
-	    "[-w #writers] [-b bufshift] DEVICE_OR_FILE\n");
+	    "[-w #writers] [-b bufshift] [-d duration]\n"
+	    "    [-a role=cpus] [-k mono|tsc] [-m syscall|mmap[,msync=N]]\n"
+	    "    [-g period=time,size=bytes,qd=N,window=time] [-c socket]\n"
+	    "    [-p readers|writers[,every=time][,by=N][,max=N]]\n"
+	    "    [-o text|json|csv] [-s seed] [-LP] DEVICE_OR_FILE\n");
 	exit(2);
 }
 
+/*
+ * Collect (and reset) the statistics accumulated since the last report.
+ */
+static void
+stats_take(tsh_stats_t *stats)
+{
+	stats->tshs_nreads = __atomic_exchange_n(&tsh_nreads, 0,
+	    __ATOMIC_RELAXED);
+	stats->tshs_time_reading = __atomic_exchange_n(&tsh_time_reading, 0,
+	    __ATOMIC_RELAXED);
+	stats->tshs_nwrites = __atomic_exchange_n(&tsh_nwrites, 0,
+	    __ATOMIC_RELAXED);
+	stats->tshs_time_writing = __atomic_exchange_n(&tsh_time_writing, 0,
+	    __ATOMIC_RELAXED);
+	stats->tshs_nbytes = __atomic_exchange_n(&tsh_nbytes, 0,
+	    __ATOMIC_RELAXED);
+}
+
+/*
+ * Account for a completed read or write of the given latency and size.
+ */
+static void
+stats_read(hrtime_t latency, off_t bufsz)
+{
+	__atomic_add_fetch(&tsh_time_reading, latency, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tsh_nreads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tsh_nbytes, bufsz, __ATOMIC_RELAXED);
+}
+
+static void
+stats_write(hrtime_t latency, off_t bufsz)
+{
+	__atomic_add_fetch(&tsh_time_writing, latency, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tsh_nwrites, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tsh_nbytes, bufsz, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reports are emitted a field at a time, so that the same code can print
+ * either the column headers or a line of values in any of our formats.  Each
+ * field has a label for text output (or NULL if it isn't shown there), a key
+ * for JSON and CSV output, and a width for text output.  A NULL value means
+ * that the value isn't available.
+ */
+static void
+out_begin(void)
+{
+	tsh_out_nfields = 0;
+
+	if (tsh_outfmt == TSH_OUT_JSON && !tsh_out_header)
+		(void) printf("{");
+}
+
+static void
+out_end(void)
+{
+	if (tsh_outfmt == TSH_OUT_JSON) {
+		if (tsh_out_header)
+			return;
+
+		(void) printf("}");
+	}
+
+	(void) printf("\n");
+	(void) fflush(stdout);
+}
+
+static void
+out_emit(const char *label, const char *key, int width, boolean_t quote,
+    const char *val)
+{
+	if (tsh_outfmt == TSH_OUT_TEXT && label == NULL)
+		return;
+
+	if (tsh_outfmt == TSH_OUT_JSON && tsh_out_header)
+		return;
+
+	if (tsh_out_nfields++ != 0)
+		(void) printf(tsh_outfmt == TSH_OUT_TEXT ? " " : ",");
+
+	switch (tsh_outfmt) {
+	case TSH_OUT_TEXT:
+		(void) printf("%*s", width, tsh_out_header ? label :
+		    val != NULL ? val : "-");
+		break;
+
+	case TSH_OUT_JSON:
+		if (val == NULL) {
+			(void) printf("\"%s\":null", key);
+		} else {
+			(void) printf(quote ? "\"%s\":\"%s\"" : "\"%s\":%s",
+			    key, val);
+		}
+		break;
+
+	case TSH_OUT_CSV:
+		(void) printf("%s", tsh_out_header ? key :
+		    val != NULL ? val : "");
+		break;
+	}
+}
+
+static void
+out_str(const char *label, const char *key, int width, const char *val)
+{
+	out_emit(label, key, width, B_TRUE, val);
+}
+
+static void
+out_num(const char *label, const char *key, int width, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+
+	if (fmt == NULL) {
+		out_emit(label, key, width, B_FALSE, NULL);
+		return;
+	}
+
+	va_start(ap, fmt);
+	(void) vsnprintf(buf, sizeof (buf), fmt, ap);
+	va_end(ap);
+
+	out_emit(label, key, width, B_FALSE, buf);
+}
+
+static void
+report_header(void)
+{
+	tsh_stats_t stats;
+	tsh_cost_t cost;
+
+	bzero(&stats, sizeof (stats));
+	bzero(&cost, sizeof (cost));
+
+	tsh_out_header = B_TRUE;
+	report_row("", 0, 0, &stats, &cost);
+	tsh_out_header = B_FALSE;
+}
+
+/*
+ * Report on an interval (or the whole run) of the given length, ending at the
+ * given offset from the start of the run.
+ */
+static void
+report_row(const char *type, hrtime_t offset, hrtime_t elapsed,
+    tsh_stats_t *stats, tsh_cost_t *cost)
+{
+	char timebuf[25];
+	time_t now;
+	struct tm nowtm;
+
+	(void) time(&now);
+	(void) gmtime_r(&now, &nowtm);
+	(void) strftime(timebuf, sizeof (timebuf), "%FT%TZ", &nowtm);
+
+	if (tsh_outfmt == TSH_OUT_TEXT && strcmp(type, "summary") == 0)
+		(void) strcpy(timebuf, "total");
+
+	flockfile(stdout);
+	out_begin();
+	out_str(NULL, "type", 0, type);
+	out_str("TIME", "time", 20, timebuf);
+	out_num(NULL, "offset", 0, "%.3f", (double)offset / NANOSEC);
+	out_num(NULL, "elapsed", 0, "%.3f", (double)elapsed / NANOSEC);
+	out_num("NREADS", "nreads", 7, "%llu",
+	    (unsigned long long)stats->tshs_nreads);
+	out_num("RDLATus", "rdlat_us", 7, "%llu", stats->tshs_nreads ?
+	    (unsigned long long)(stats->tshs_time_reading /
+	    stats->tshs_nreads / 1000) : 0);
+	out_num("NWRITE", "nwrites", 7, "%llu",
+	    (unsigned long long)stats->tshs_nwrites);
+	out_num("WRLATus", "wrlat_us", 7, "%llu", stats->tshs_nwrites ?
+	    (unsigned long long)(stats->tshs_time_writing /
+	    stats->tshs_nwrites / 1000) : 0);
+	out_num("WRLBA", "wrlba", 14, tsh_outfmt == TSH_OUT_TEXT ?
+	    "0x%012lx" : "%ld", tsh_write_lba_current);
+	out_num("WR", "wraps", 2, "%u", tsh_write_lba_wraparounds);
+
+	if (tsh_perf_enabled)
+		report_cost(cost, stats->tshs_nreads + stats->tshs_nwrites,
+		    stats->tshs_nbytes);
+
+	if (tsh_ctl_path != NULL) {
+		report_settings();
+		out_str(NULL, "change", 0, NULL);
+	}
+
+	out_end();
+	funlockfile(stdout);
+}
+
+/*
+ * The keys of the columns emitted by report_cost(), which a control row
+ * leaves empty.
+ */
+static const char *tsh_report_cost[] = {
+	"cpu_us_per_op", "cpu_s_per_gb", "kcycles_per_op", "ipc", "csw",
+	"migrations"
+};
+
+#define	TSH_REPORT_NCOST \
+	(sizeof (tsh_report_cost) / sizeof (tsh_report_cost[0]))
+
+/*
+ * Emit the settings that may be changed through the control socket.
+ */
+static void
+report_settings(void)
+{
+	out_num(NULL, "readers", 0, "%u", tsh_nreaders_active);
+	out_num(NULL, "writers", 0, "%u", tsh_nwriters_active);
+	out_num(NULL, "readrate", 0, "%u", tsh_read_rate);
+	out_num(NULL, "writerate", 0, "%u", tsh_write_rate);
+	out_num(NULL, "iosize", 0, "%ld", tsh_bufsz);
+	out_num(NULL, "interval_ms", 0, "%u", tsh_report_msec);
+}
+
+/*
+ * Record a change made through the control socket.  In text, this is a line
+ * of its own; otherwise, it's a "control" row with the settings that result
+ * and a description of the change, but without statistics.
+ */
+static void
+report_change(const char *change)
+{
+	hrtime_t offset = tsh_gethrtime() - tsh_ctl_start;
+	char timebuf[25];
+	time_t now;
+	struct tm nowtm;
+	size_t i;
+
+	(void) time(&now);
+	(void) gmtime_r(&now, &nowtm);
+	(void) strftime(timebuf, sizeof (timebuf), "%FT%TZ", &nowtm);
+
+	flockfile(stdout);
+
+	if (tsh_outfmt == TSH_OUT_TEXT) {
+		(void) printf("%20s control: %s\n", timebuf, change);
+		(void) fflush(stdout);
+		funlockfile(stdout);
+		return;
+	}
+
+	out_begin();
+	out_str(NULL, "type", 0, "control");
+	out_str(NULL, "time", 0, timebuf);
+	out_num(NULL, "offset", 0, "%.3f", (double)offset / NANOSEC);
+	out_num(NULL, "elapsed", 0, NULL);
+	out_num(NULL, "nreads", 0, NULL);
+	out_num(NULL, "rdlat_us", 0, NULL);
+	out_num(NULL, "nwrites", 0, NULL);
+	out_num(NULL, "wrlat_us", 0, NULL);
+	out_num(NULL, "wrlba", 0, NULL);
+	out_num(NULL, "wraps", 0, NULL);
+
+	for (i = 0; tsh_perf_enabled && i < TSH_REPORT_NCOST; i++)
+		out_num(NULL, tsh_report_cost[i], 0, NULL);
+
+	report_settings();
+	out_str(NULL, "change", 0, change);
+	out_end();
+	funlockfile(stdout);
+}
+
+/*
+ * Emit the CPU cost of nops operations moving nbytes.  Process-wide figures
+ * are always available; counters may not be.
+ */
+static void
+report_cost(tsh_cost_t *cost, uint64_t nops, uint64_t nbytes)
+{
+	hrtime_t cpu = cost->tshc_user + cost->tshc_sys;
+	uint64_t *ctr = cost->tshc_ctr;
+	boolean_t *valid = cost->tshc_ctrvalid;
+	double gb = (double)nbytes / (1ULL << 30);
+
+	out_num("CPUus", "cpu_us_per_op", 6, "%.1f",
+	    nops ? (double)cpu / nops / 1000 : 0.0);
+	out_num("s/GB", "cpu_s_per_gb", 6, "%.2f",
+	    gb > 0 ? (double)cpu / NANOSEC / gb : 0.0);
+	out_num("KCYC", "kcycles_per_op", 6,
+	    valid[TSH_PERF_CYCLES] ? "%.1f" : NULL,
+	    nops ? (double)ctr[TSH_PERF_CYCLES] / nops / 1000 : 0.0);
+	out_num("IPC", "ipc", 4,
+	    valid[TSH_PERF_CYCLES] && valid[TSH_PERF_INSTRS] ? "%.2f" : NULL,
+	    ctr[TSH_PERF_CYCLES] ?
+	    (double)ctr[TSH_PERF_INSTRS] / ctr[TSH_PERF_CYCLES] : 0.0);
+	out_num("CSW", "csw", 6, "%llu", valid[TSH_PERF_CSW] ?
+	    (unsigned long long)ctr[TSH_PERF_CSW] :
+	    (unsigned long long)(cost->tshc_vcsw + cost->tshc_ivcsw));
+	out_num("MIGR", "migrations", 5,
+	    valid[TSH_PERF_MIGRATIONS] ? "%llu" : NULL,
+	    (unsigned long long)ctr[TSH_PERF_MIGRATIONS]);
+}
+
 static void
 init_buffer(char *buf, size_t bufsz)
 {
@@ -221,61 +1004,859 @@ init_buffer(char *buf, size_t bufsz)
 	}
 }
 
+/*
+ * Readers read from buffer-aligned LBAs all over the file or device.  When
+ * seeded, each reader draws the same sequence of LBAs on every run.
+ */
+static off_t
+tsh_read_lba(off_t bufsz)
+{
+	if (tsh_seed != 0) {
+		return (bufsz * (off_t)tsh_rand_uniform(&tsh_rand_state,
+		    tsh_size / bufsz));
+	}
+
+	return (bufsz * ((off_t)arc4random_uniform(tsh_size / bufsz)));
+}
+
+/*
+ * Writers write to sequential LBAs, wrapping around to the initial LBA when
+ * they reach the end of the file or device.
+ */
+static off_t
+tsh_write_lba_next(off_t bufsz)
+{
+	off_t write_lba;
+
+	/*
+	 * Using a lock here is cheesy, but expedient.
+	 */
+	(void) pthread_mutex_lock(&tsh_write_lba_lock);
+	write_lba = tsh_write_lba_current;
+	tsh_write_lba_current += bufsz;
+	if (tsh_write_lba_current + bufsz >= tsh_size) {
+		tsh_write_lba_current = tsh_write_lba_init;
+		tsh_write_lba_wraparounds++;
+	}
+	(void) pthread_mutex_unlock(&tsh_write_lba_lock);
+
+	return (write_lba);
+}
+
 static void *
-tsh_thread_reader(void *whicharg __attribute__((__unused__)))
+tsh_thread_reader(void *whicharg)
 {
-	char *buf = alloca(tsh_bufsz);
-	off_t read_lba;
+	char *buf = alloca(tsh_bufmax);
+	unsigned int which = (uintptr_t)whicharg - tsh_nwriters;
+	off_t read_lba, bufsz;
 	int nread;
-	hrtime_t start;
+	hrtime_t start, latency;
 
-	for (;;) {
-		read_lba = tsh_bufsz *
-		    ((off_t)arc4random_uniform(tsh_size / tsh_bufsz));
-		start = gethrtime();
-		nread = pread(tsh_fd, buf, tsh_bufsz, read_lba);
+	tsh_sched_enter(TSH_ROLE_WORKERS);
+	tsh_perf_thread_init(&tsh_perf[(uintptr_t)whicharg]);
+	tsh_rand_state = tsh_seed * ((uintptr_t)whicharg + 1);
+	(void) pthread_barrier_wait(&tsh_ready);
+
+	while (!tsh_stop) {
+		tsh_park(which, &tsh_nreaders_active);
+		tsh_pace(&tsh_read_rate, &tsh_read_next);
+
+		if (tsh_stop)
+			break;
+
+		bufsz = __atomic_load_n(&tsh_bufsz, __ATOMIC_RELAXED);
+		read_lba = tsh_read_lba(bufsz);
+		start = tsh_gethrtime();
+		nread = tsh_io_read(tsh_fd, buf, bufsz, read_lba);
 		if (nread < 0) {
-			warn("pread lba 0x%x", read_lba);
-		} else if (nread != tsh_bufsz) {
-			warnx("pread lba 0x%x reported %d bytes\n", read_lba);
+			warn("read lba 0x%lx", read_lba);
+		} else if (nread != bufsz) {
+			warnx("read lba 0x%lx reported %d bytes\n", read_lba,
+			    nread);
 		}
-		tsh_time_reading += gethrtime() - start;
-		tsh_nreads++;
+		stats_read(latency = tsh_gethrtime() - start, bufsz);
+
+		if (tsh_ramp_every != 0 && tsh_ramp_reads)
+			tsh_ramp_rec(latency);
+
+		if (tsh_burst_period != 0)
+			tsh_burst_read_done(start, latency);
 	}
 
+	tsh_sched_exit();
 	return (NULL);
 }
 
 static void *
-tsh_thread_writer(void *whicharg __attribute__((__unused__)))
+tsh_thread_writer(void *whicharg)
 {
-	off_t write_lba;
+	unsigned int which = (uintptr_t)whicharg;
+	off_t write_lba, bufsz;
 	int nwritten;
-	hrtime_t start;
+	hrtime_t start, done;
 
-	for (;;) {
-		/*
-		 * Using a lock here is cheesy, but expedient.
-		 */
-		(void) pthread_mutex_lock(&tsh_write_lba_lock);
-		write_lba = tsh_write_lba_current;
-		tsh_write_lba_current += tsh_bufsz;
-		if (tsh_write_lba_current + tsh_bufsz >= tsh_size) {
-			tsh_write_lba_current = tsh_write_lba_init;
-			tsh_write_lba_wraparounds++;
-		}
-		(void) pthread_mutex_unlock(&tsh_write_lba_lock);
+	tsh_sched_enter(TSH_ROLE_WORKERS);
+	tsh_perf_thread_init(&tsh_perf[(uintptr_t)whicharg]);
+	(void) pthread_barrier_wait(&tsh_ready);
 
-		start = gethrtime();
-		nwritten = pwrite(tsh_fd, tsh_buffer, tsh_bufsz, write_lba);
+	while (!tsh_stop) {
+		tsh_park(which, &tsh_nwriters_active);
+
+		if (tsh_burst_period != 0 && !tsh_burst_claim())
+			break;
+
+		tsh_pace(&tsh_write_rate, &tsh_write_next);
+
+		if (tsh_stop)
+			break;
+
+		bufsz = __atomic_load_n(&tsh_bufsz, __ATOMIC_RELAXED);
+		write_lba = tsh_write_lba_next(bufsz);
+		start = tsh_gethrtime();
+		nwritten = tsh_io_write(tsh_fd, tsh_buffer, bufsz,
+		    write_lba);
 		if (nwritten < 0) {
-			warn("pwrite lba 0x%x", write_lba);
-		} else if (nwritten != tsh_bufsz) {
-			warnx("pwrite lba 0x%x reported %d bytes\n", write_lba);
+			warn("write lba 0x%lx", write_lba);
+		} else if (nwritten != bufsz) {
+			warnx("write lba 0x%lx reported %d bytes\n", write_lba,
+			    nwritten);
+		}
+		stats_write((done = tsh_gethrtime()) - start, bufsz);
+
+		if (tsh_ramp_every != 0 && !tsh_ramp_reads)
+			tsh_ramp_rec(done - start);
+
+		if (tsh_burst_period != 0)
+			tsh_burst_write_done(done);
+	}
+
+	tsh_sched_exit();
+	return (NULL);
+}
+
+/*
+ * Parse a size in bytes, with an optional (binary) suffix.
+ */
+static off_t
+tsh_parse_size(const char *str)
+{
+	const char *units = "kmgt";
+	const char *unit;
+	char *end;
+	off_t val;
+
+	val = strtoll(str, &end, 10);
+
+	if (end == str || val <= 0)
+		return (-1);
+
+	if (*end == '\0')
+		return (val);
+
+	if (end[1] != '\0' || (unit = strchr(units, *end | 0x20)) == NULL)
+		return (-1);
+
+	return (val << (10 * (unit - units + 1)));
+}
+
+/*
+ * Parse the specification of transaction group bursts:  a comma-separated
+ * list of the period between bursts, the size of each burst, the number of
+ * writes outstanding during a burst and the width of the windows in which
+ * read latency is reported.
+ */
+static void
+tsh_burst_parse(char *arg)
+{
+	char *opt, *val, *end;
+
+	tsh_burst_period = 5 * NANOSEC;
+
+	for (opt = strtok(arg, ","); opt != NULL; opt = strtok(NULL, ",")) {
+		if ((val = strchr(opt, '=')) == NULL)
+			errx(1, "invalid burst option \"%s\"", opt);
+
+		*val++ = '\0';
+
+		if (strcmp(opt, "period") == 0) {
+			if ((tsh_burst_period = tsh_clock_parse(val)) <= 0)
+				errx(1, "invalid burst period \"%s\"", val);
+		} else if (strcmp(opt, "size") == 0) {
+			if ((tsh_burst_size = tsh_parse_size(val)) <= 0)
+				errx(1, "invalid burst size \"%s\"", val);
+		} else if (strcmp(opt, "qd") == 0) {
+			tsh_burst_qd = strtoul(val, &end, 10);
+
+			if (*end != '\0' || tsh_burst_qd == 0)
+				errx(1, "invalid burst queue depth");
+		} else if (strcmp(opt, "window") == 0) {
+			if ((tsh_burst_window = tsh_clock_parse(val)) <= 0)
+				errx(1, "invalid burst window \"%s\"", val);
+		} else {
+			errx(1, "invalid burst option \"%s\"", opt);
+		}
+	}
+}
+
+/*
+ * Claim a write from the current burst, waiting for the next burst if the
+ * current one has been entirely issued.  Returns B_FALSE if we're stopping.
+ */
+static boolean_t
+tsh_burst_claim(void)
+{
+	struct timespec ts;
+	hrtime_t now, nap;
+	off_t bufsz;
+
+	(void) pthread_mutex_lock(&tsh_burst_lock);
+
+	while (!tsh_stop) {
+		now = tsh_gethrtime();
+
+		if (now >= tsh_burst_next) {
+			if (tsh_burst_left != 0 || tsh_burst_out != 0) {
+				tsh_burst_overran = B_TRUE;
+				tsh_burst_noverran++;
+			}
+
+			__atomic_store_n(&tsh_burst_start, tsh_burst_next == 0 ?
+			    now : tsh_burst_next, __ATOMIC_RELAXED);
+
+			tsh_burst_next = tsh_burst_start + tsh_burst_period;
+
+			while (tsh_burst_next <= now)
+				tsh_burst_next += tsh_burst_period;
+
+			/*
+			 * The size of each write may have been changed over
+			 * the control socket, so we size each burst anew.
+			 */
+			bufsz = __atomic_load_n(&tsh_bufsz, __ATOMIC_RELAXED);
+			tsh_burst_left += (tsh_burst_size + bufsz - 1) / bufsz;
+			tsh_burst_n++;
+		}
+
+		if (tsh_burst_left != 0) {
+			tsh_burst_left--;
+			tsh_burst_out++;
+			(void) pthread_mutex_unlock(&tsh_burst_lock);
+			return (B_TRUE);
+		}
+
+		nap = MIN(tsh_burst_next - now, TSH_BURST_NAP);
+		ts.tv_sec = nap / NANOSEC;
+		ts.tv_nsec = nap % NANOSEC;
+
+		(void) pthread_mutex_unlock(&tsh_burst_lock);
+		(void) nanosleep(&ts, NULL);
+		(void) pthread_mutex_lock(&tsh_burst_lock);
+	}
+
+	(void) pthread_mutex_unlock(&tsh_burst_lock);
+	return (B_FALSE);
+}
+
+/*
+ * Account for the completion of a burst's write.  A burst that completes
+ * within its period is timed; one that ran into the next period is instead
+ * counted as having overrun.
+ */
+static void
+tsh_burst_write_done(hrtime_t now)
+{
+	hrtime_t elapsed;
+
+	(void) pthread_mutex_lock(&tsh_burst_lock);
+
+	if (--tsh_burst_out == 0 && tsh_burst_left == 0) {
+		if (!tsh_burst_overran) {
+			elapsed = now - tsh_burst_start;
+			tsh_burst_ndone++;
+			tsh_burst_time += elapsed;
+			tsh_burst_maxtime = MAX(tsh_burst_maxtime, elapsed);
+		}
+
+		tsh_burst_overran = B_FALSE;
+	}
+
+	(void) pthread_mutex_unlock(&tsh_burst_lock);
+}
+
+/*
+ * Account for a read started at the given time in the window of time since
+ * the start of the burst.
+ */
+static void
+tsh_burst_read_done(hrtime_t start, hrtime_t latency)
+{
+	hrtime_t bstart = __atomic_load_n(&tsh_burst_start, __ATOMIC_RELAXED);
+	tsh_burst_win_t *win;
+	hrtime_t max;
+	int i;
+
+	if (bstart == 0 || start < bstart)
+		return;
+
+	i = MIN((start - bstart) / tsh_burst_window, tsh_burst_nwins - 1);
+	win = &tsh_burst_wins[i];
+
+	__atomic_add_fetch(&win->tshbw_time_reading, latency, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&win->tshbw_nreads, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&win->tshbw_maxlat, __ATOMIC_RELAXED);
+
+	while (latency > max && !__atomic_compare_exchange_n(&win->tshbw_maxlat,
+	    &max, latency, B_TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/*
+ * Report how long bursts took, and read latency by time since the start of
+ * a burst.
+ */
+static void
+tsh_burst_report(void)
+{
+	tsh_burst_win_t *win;
+	int i;
+
+	(void) fprintf(tsh_info, "bursts: %llu started, %llu completed in "
+	    "%.3fs on average (at most %.3fs), %llu overran their period\n",
+	    (unsigned long long)tsh_burst_n,
+	    (unsigned long long)tsh_burst_ndone, tsh_burst_ndone == 0 ? 0.0 :
+	    (double)tsh_burst_time / tsh_burst_ndone / NANOSEC,
+	    (double)tsh_burst_maxtime / NANOSEC,
+	    (unsigned long long)tsh_burst_noverran);
+
+	(void) fprintf(tsh_info, "%10s %7s %7s %9s\n", "BURSTms", "NREADS",
+	    "RDLATus", "RDMAXus");
+
+	for (i = 0; i < tsh_burst_nwins; i++) {
+		win = &tsh_burst_wins[i];
+
+		(void) fprintf(tsh_info, "%10.0f %7llu %7llu %9llu\n",
+		    (double)i * tsh_burst_window / (NANOSEC / MILLISEC),
+		    (unsigned long long)win->tshbw_nreads,
+		    win->tshbw_nreads == 0 ? 0ULL :
+		    (unsigned long long)(win->tshbw_time_reading /
+		    win->tshbw_nreads / 1000),
+		    (unsigned long long)(win->tshbw_maxlat / 1000));
+	}
+}
+
+/*
+ * Wait while there are fewer readers or writers running than our index
+ * among them.
+ */
+static void
+tsh_park(unsigned int which, unsigned int *active)
+{
+	if (which < __atomic_load_n(active, __ATOMIC_RELAXED))
+		return;
+
+	(void) pthread_mutex_lock(&tsh_ctl_lock);
+
+	while (which >= *active && !tsh_stop)
+		(void) pthread_cond_wait(&tsh_ctl_cv, &tsh_ctl_lock);
+
+	(void) pthread_mutex_unlock(&tsh_ctl_lock);
+}
+
+/*
+ * If a rate has been set, wait until the next operation at that rate may
+ * start.  The schedule doesn't accumulate credit while we're slower than
+ * the rate.  With many threads at a low rate, a slot may be claimed far in
+ * the future, so we wait in naps:  if we're stopping, we return early, and
+ * if the rate has changed (which restarts the schedule), we give up our
+ * slot and claim one at the new rate.
+ */
+static void
+tsh_pace(unsigned int *ratep, hrtime_t *nextp)
+{
+	unsigned int rate;
+	hrtime_t now, next, slot, gap, nap;
+	struct timespec ts;
+
+	while ((rate = __atomic_load_n(ratep, __ATOMIC_RELAXED)) != 0) {
+		gap = NANOSEC / rate;
+		now = tsh_gethrtime();
+		next = __atomic_load_n(nextp, __ATOMIC_RELAXED);
+
+		do {
+			slot = MAX(next, now);
+		} while (!__atomic_compare_exchange_n(nextp, &next,
+		    slot + gap, B_TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		while (now < slot) {
+			nap = MIN(slot - now, TSH_BURST_NAP);
+			ts.tv_sec = nap / NANOSEC;
+			ts.tv_nsec = nap % NANOSEC;
+			(void) nanosleep(&ts, NULL);
+
+			if (tsh_stop ||
+			    __atomic_load_n(ratep, __ATOMIC_RELAXED) != rate)
+				break;
+
+			now = tsh_gethrtime();
+		}
+
+		if (now >= slot || tsh_stop)
+			return;
+	}
+}
+
+static void
+tsh_ctl_init(void)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(tsh_ctl_path) >= sizeof (addr.sun_path))
+		errx(1, "control socket path is too long");
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	(void) strcpy(addr.sun_path, tsh_ctl_path);
+
+	if ((tsh_ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+
+	if (bind(tsh_ctl_fd, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		if (errno == EADDRINUSE) {
+			errx(1, "control socket \"%s\" already exists (remove "
+			    "it if it isn't in use)", tsh_ctl_path);
+		}
+
+		err(1, "bind \"%s\"", tsh_ctl_path);
+	}
+
+	if (listen(tsh_ctl_fd, 1) != 0)
+		err(1, "listen");
+}
+
+/*
+ * Set the number of readers or writers running, waking any that are now
+ * needed.
+ */
+static void
+tsh_ctl_threads(unsigned int *active, unsigned int n)
+{
+	(void) pthread_mutex_lock(&tsh_ctl_lock);
+	__atomic_store_n(active, n, __ATOMIC_RELAXED);
+	(void) pthread_cond_broadcast(&tsh_ctl_cv);
+	(void) pthread_mutex_unlock(&tsh_ctl_lock);
+}
+
+/*
+ * Apply a single control command, leaving a reply (without a newline) in the
+ * given buffer.  The commands are "readers N", "writers N", "readrate N" and
+ * "writerate N" (operations per second, or 0 for as many as possible),
+ * "iosize BYTES", "interval TIME" and "show".
+ */
+static void
+tsh_ctl_apply(char *cmd, char *reply, size_t len)
+{
+	char *name, *val, *end, change[64];
+	unsigned long n = 0;
+	hrtime_t t;
+
+	name = strtok(cmd, " \t");
+	val = strtok(NULL, " \t");
+
+	if (name != NULL && strcmp(name, "show") == 0 && val == NULL) {
+		(void) snprintf(reply, len, "ok readers=%u writers=%u "
+		    "readrate=%u writerate=%u iosize=%ld interval=%ums",
+		    tsh_nreaders_active, tsh_nwriters_active, tsh_read_rate,
+		    tsh_write_rate, tsh_bufsz, tsh_report_msec);
+		return;
+	}
+
+	if (name == NULL || val == NULL || strtok(NULL, " \t") != NULL) {
+		(void) snprintf(reply, len, "error: expected a setting and "
+		    "a value, or \"show\"");
+		return;
+	}
+
+	if (strcmp(name, "iosize") != 0 && strcmp(name, "interval") != 0) {
+		n = strtoul(val, &end, 10);
+
+		if (*end != '\0' || end == val || n > UINT_MAX) {
+			(void) snprintf(reply, len, "error: invalid value "
+			    "\"%s\"", val);
+			return;
+		}
+	}
+
+	if (strcmp(name, "readers") == 0 || strcmp(name, "writers") == 0) {
+		boolean_t r = name[0] == 'r';
+
+		/*
+		 * While a ramp runs, only it changes the threads it ramps.
+		 */
+		if (tsh_ramp_every != 0 && r == tsh_ramp_reads) {
+			(void) snprintf(reply, len, "error: %s are being "
+			    "ramped", name);
+			return;
+		}
+
+		if (n > (r ? tsh_nreaders : tsh_nwriters)) {
+			(void) snprintf(reply, len, "error: at most %u %s",
+			    r ? tsh_nreaders : tsh_nwriters, name);
+			return;
+		}
+
+		(void) snprintf(change, sizeof (change), "%s %u -> %lu", name,
+		    r ? tsh_nreaders_active : tsh_nwriters_active, n);
+		tsh_ctl_threads(r ? &tsh_nreaders_active :
+		    &tsh_nwriters_active, n);
+	} else if (strcmp(name, "readrate") == 0 ||
+	    strcmp(name, "writerate") == 0) {
+		unsigned int *rate = name[0] == 'r' ?
+		    &tsh_read_rate : &tsh_write_rate;
+
+		(void) snprintf(change, sizeof (change), "%s %u -> %lu", name,
+		    *rate, n);
+
+		/*
+		 * The schedule restarts at the new rate; threads waiting for
+		 * slots claimed at the old one will notice and claim anew.
+		 */
+		__atomic_store_n(name[0] == 'r' ? &tsh_read_next :
+		    &tsh_write_next, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(rate, n, __ATOMIC_RELAXED);
+	} else if (strcmp(name, "iosize") == 0) {
+		off_t sz = tsh_parse_size(val);
+
+		if (sz < DEV_BSIZE || (sz & (sz - 1)) != 0 ||
+		    sz > tsh_bufmax || sz > tsh_size / 4) {
+			(void) snprintf(reply, len, "error: I/O size must be a "
+			    "power of two from %d to %ld bytes", DEV_BSIZE,
+			    MIN(tsh_bufmax, tsh_size / 4));
+			return;
+		}
+
+		(void) snprintf(change, sizeof (change), "iosize %ld -> %ld",
+		    tsh_bufsz, sz);
+		__atomic_store_n(&tsh_bufsz, sz, __ATOMIC_RELAXED);
+	} else if (strcmp(name, "interval") == 0) {
+		if ((t = tsh_clock_parse(val)) < NANOSEC / MILLISEC) {
+			(void) snprintf(reply, len, "error: invalid interval "
+			    "\"%s\"", val);
+			return;
+		}
+
+		(void) snprintf(change, sizeof (change), "interval %ums -> "
+		    "%llums", tsh_report_msec,
+		    (unsigned long long)(t / (NANOSEC / MILLISEC)));
+		__atomic_store_n(&tsh_report_msec,
+		    (unsigned int)(t / (NANOSEC / MILLISEC)), __ATOMIC_RELAXED);
+	} else {
+		(void) snprintf(reply, len, "error: unknown setting \"%s\"",
+		    name);
+		return;
+	}
+
+	report_change(change);
+	(void) snprintf(reply, len, "ok %s", change);
+}
+
+/*
+ * Serve connections to our control socket, one at a time, each carrying one
+ * command per line; each command is answered with a line that starts with
+ * either "ok" or "error:".
+ */
+static void *
+tsh_ctl_thread(void *arg __attribute__((__unused__)))
+{
+	char line[TSH_CTL_LINE_MAX], reply[TSH_CTL_LINE_MAX];
+	struct timespec ts;
+	hrtime_t nap = 0;
+	FILE *in, *out;
+	int fd;
+
+	for (;;) {
+		if ((fd = accept(tsh_ctl_fd, NULL, NULL)) < 0) {
+			switch (errno) {
+			case EINTR:
+			case ECONNABORTED:
+			case EPROTO:
+				continue;
+
+			/*
+			 * If we're out of descriptors or memory, we back off
+			 * (warning only once) rather than spin until we aren't.
+			 */
+			case EMFILE:
+			case ENFILE:
+			case ENOBUFS:
+			case ENOMEM:
+				if (nap == 0)
+					warn("accept (backing off)");
+
+				nap = nap == 0 ? TSH_CTL_NAP_MIN :
+				    MIN(nap * 2, TSH_CTL_NAP_MAX);
+				ts.tv_sec = nap / NANOSEC;
+				ts.tv_nsec = nap % NANOSEC;
+				(void) nanosleep(&ts, NULL);
+				continue;
+
+			default:
+				warn("accept; control socket disabled");
+				return (NULL);
+			}
+		}
+
+		nap = 0;
+
+		if ((in = fdopen(fd, "r")) == NULL ||
+		    (out = fdopen(dup(fd), "w")) == NULL) {
+			warn("fdopen");
+
+			if (in != NULL)
+				(void) fclose(in);
+			else
+				(void) close(fd);
+			continue;
+		}
+
+		while (fgets(line, sizeof (line), in) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+
+			if (line[0] == '\0')
+				continue;
+
+			tsh_ctl_apply(line, reply, sizeof (reply));
+			(void) fprintf(out, "%s\n", reply);
+			(void) fflush(out);
+		}
+
+		(void) fclose(in);
+		(void) fclose(out);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Parse the specification of a ramp:  the threads to ramp (readers or
+ * writers), followed by options for the time between steps, the threads to
+ * add at each step and the most threads to ramp to.
+ */
+static void
+tsh_ramp_parse(char *arg)
+{
+	char *opt, *val, *end;
+
+	tsh_ramp_every = 10 * NANOSEC;
+
+	if ((opt = strtok(arg, ",")) == NULL)
+		errx(1, "ramp must specify readers or writers");
+
+	if (strcmp(opt, "readers") == 0) {
+		tsh_ramp_reads = B_TRUE;
+	} else if (strcmp(opt, "writers") != 0) {
+		errx(1, "ramp must specify readers or writers");
+	}
+
+	while ((opt = strtok(NULL, ",")) != NULL) {
+		if ((val = strchr(opt, '=')) == NULL)
+			errx(1, "invalid ramp option \"%s\"", opt);
+
+		*val++ = '\0';
+
+		if (strcmp(opt, "every") == 0) {
+			if ((tsh_ramp_every = tsh_clock_parse(val)) <= 0)
+				errx(1, "invalid ramp step \"%s\"", val);
+		} else if (strcmp(opt, "by") == 0) {
+			tsh_ramp_by = strtoul(val, &end, 10);
+
+			if (*end != '\0' || tsh_ramp_by == 0)
+				errx(1, "invalid ramp increment");
+		} else if (strcmp(opt, "max") == 0) {
+			tsh_ramp_max = strtoul(val, &end, 10);
+
+			if (*end != '\0' || tsh_ramp_max == 0)
+				errx(1, "invalid ramp maximum");
+		} else {
+			errx(1, "invalid ramp option \"%s\"", opt);
 		}
-		tsh_time_writing += gethrtime() - start;
-		tsh_nwrites++;
+	}
+}
+
+/*
+ * Count an operation's latency in the current step.  This is called by
+ * every thread being ramped, so only the buckets are updated (atomically);
+ * the rest of the histogram is filled in from them by tsh_ramp_settle().
+ */
+static void
+tsh_ramp_rec(hrtime_t latency)
+{
+	int cur;
+
+	/*
+	 * We announce ourselves on the current histogram and then check that
+	 * it is still current:  if the ramp thread switched histograms in
+	 * between, it may not have seen us, so we go to the new one instead.
+	 * Once we're announced on a histogram that is still current, the ramp
+	 * thread will wait for us before it reports on it.
+	 */
+	for (;;) {
+		cur = __atomic_load_n(&tsh_ramp_cur, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&tsh_ramp_inflight[cur], 1,
+		    __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&tsh_ramp_cur, __ATOMIC_SEQ_CST) == cur)
+			break;
+
+		__atomic_sub_fetch(&tsh_ramp_inflight[cur], 1,
+		    __ATOMIC_RELEASE);
+	}
+
+	__atomic_add_fetch(&tsh_ramp_hist[cur].tshh_buckets[
+	    tsh_hist_bucket(latency)], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tsh_ramp_inflight[cur], 1, __ATOMIC_RELEASE);
+}
+
+static void
+tsh_ramp_settle(tsh_hist_t *hist)
+{
+	int i;
+
+	for (i = 0; i < TSH_HIST_NBUCKETS; i++) {
+		if (hist->tshh_buckets[i] == 0)
+			continue;
+
+		if (hist->tshh_count == 0)
+			hist->tshh_min = tsh_hist_lo(i);
+
+		hist->tshh_count += hist->tshh_buckets[i];
+		hist->tshh_max = tsh_hist_hi(i);
+	}
+}
+
+/*
+ * Step through the ramp:  at the end of each step, report on it and add
+ * threads.  Once the last step has been reported, we stop the run as if we
+ * had been interrupted.
+ */
+static void *
+tsh_ramp_thread(void *arg __attribute__((__unused__)))
+{
+	unsigned int *active = tsh_ramp_reads ?
+	    &tsh_nreaders_active : &tsh_nwriters_active;
+	hrtime_t start = tsh_gethrtime(), next = start, now, nap;
+	tsh_ramp_step_t *step;
+	tsh_hist_t *hist;
+	struct timespec ts;
+	int cur;
+
+	for (;;) {
+		next += tsh_ramp_every;
+
+		while (!tsh_stop && (now = tsh_gethrtime()) < next) {
+			nap = MIN(next - now, TSH_BURST_NAP);
+			ts.tv_sec = nap / NANOSEC;
+			ts.tv_nsec = nap % NANOSEC;
+			(void) nanosleep(&ts, NULL);
+		}
+
+		if (tsh_stop)
+			break;
+
+		/*
+		 * Switch to the other histogram (which was reset as the last
+		 * step was reported) before reporting on this one, once those
+		 * still adding to it are done.
+		 */
+		cur = tsh_ramp_cur;
+		hist = &tsh_ramp_hist[cur];
+		__atomic_store_n(&tsh_ramp_cur, 1 - cur, __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&tsh_ramp_inflight[cur],
+		    __ATOMIC_ACQUIRE) != 0)
+			(void) sched_yield();
+
+		tsh_ramp_settle(hist);
+
+		/*
+		 * Each step adds threads until the last, so there can't be
+		 * more steps than we allocated.
+		 */
+		if (tsh_ramp_nsteps >= tsh_ramp_maxsteps)
+			errx(1, "ramp ran past its %d steps",
+			    tsh_ramp_maxsteps);
+
+		step = &tsh_ramp_steps[tsh_ramp_nsteps++];
+		step->tshrs_nthreads = *active;
+		step->tshrs_rate = (double)hist->tshh_count * NANOSEC /
+		    tsh_ramp_every;
+		step->tshrs_p50 = tsh_hist_pct(hist, 0.5);
+		step->tshrs_p99 = tsh_hist_pct(hist, 0.99);
+		step->tshrs_p999 = tsh_hist_pct(hist, 0.999);
+		tsh_hist_init(hist);
+
+		(void) fprintf(tsh_info, "ramp: %u %s: %.0f ops/s, p50 %lldus, "
+		    "p99 %lldus, p99.9 %lldus\n", step->tshrs_nthreads,
+		    tsh_ramp_reads ? "readers" : "writers", step->tshrs_rate,
+		    step->tshrs_p50 / 1000, step->tshrs_p99 / 1000,
+		    step->tshrs_p999 / 1000);
+		(void) fflush(tsh_info);
+
+		if (*active >= tsh_ramp_max) {
+			(void) kill(getpid(), SIGTERM);
+			break;
+		}
+
+		tsh_ctl_threads(active, MIN(*active + tsh_ramp_by,
+		    tsh_ramp_max));
 	}
 
 	return (NULL);
 }
+
+/*
+ * Identify the knee of the ramp:  the step beyond which adding threads buys
+ * less throughput than it costs in latency.  This is the step at which the
+ * ratio of throughput to p99 latency (Kleinrock's "power") is greatest:
+ * while throughput scales and latency holds, each step raises it; once
+ * throughput flattens and latency climbs, each step lowers it.  A knee at the
+ * last step means that the ramp never reached one.
+ */
+static void
+tsh_ramp_report(void)
+{
+	tsh_ramp_step_t *step, *last, *knee = NULL;
+	const char *what = tsh_ramp_reads ? "readers" : "writers";
+	double power, best = 0;
+	int i;
+
+	if (tsh_ramp_nsteps < 3) {
+		(void) fprintf(tsh_info, "ramp: too few steps to find a "
+		    "knee\n");
+		return;
+	}
+
+	last = &tsh_ramp_steps[tsh_ramp_nsteps - 1];
+
+	for (i = 0; i < tsh_ramp_nsteps; i++) {
+		step = &tsh_ramp_steps[i];
+		power = step->tshrs_rate / MAX(step->tshrs_p99, 1);
+
+		if (power > best) {
+			best = power;
+			knee = step;
+		}
+	}
+
+	if (knee == NULL || knee == last) {
+		(void) fprintf(tsh_info, "ramp: no knee; throughput scaled "
+		    "with %s to the end of the ramp\n", what);
+		return;
+	}
+
+	(void) fprintf(tsh_info, "ramp: knee at %u %s: %.0f ops/s, p99 %lldus "
+	    "(at %u %s: %.0f ops/s, p99 %lldus)\n", knee->tshrs_nthreads,
+	    what, knee->tshrs_rate, knee->tshrs_p99 / 1000,
+	    last->tshrs_nthreads, what, last->tshrs_rate,
+	    last->tshrs_p99 / 1000);
+}
@@ -0,0 +1,198 @@
+/*
+ * tsh_clock.c: clock source selection, TSC calibration and self-test.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+
+#include "tsh_clock.h"
+
+#define	TSH_CLOCK_CALIBRATE_MSEC	100	/* TSC calibration period */
+#define	TSH_CLOCK_NCALLS		(1 << 20) /* calls to time for cost */
+#define	TSH_CLOCK_NRES			1000	/* samples for resolution */
+
+boolean_t tsh_clock_tsc = B_FALSE;		/* using the TSC */
+uint64_t tsh_clock_tscbase;			/* TSC at calibration */
+hrtime_t tsh_clock_hrbase;			/* time at calibration */
+uint64_t tsh_clock_mult;			/* ns per tick, fixed point */
+
+#ifdef __x86_64__
+static boolean_t
+tsh_clock_tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+	    eax < 0x80000007)
+		return (B_FALSE);
+
+	(void) __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+
+	return ((edx & (1 << 8)) ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Read the TSC and the monotonic clock as close together as we can, taking
+ * the TSC reading from the middle of the pair of clock reads that brackets
+ * it most tightly.
+ */
+static void
+tsh_clock_pair(uint64_t *tscp, hrtime_t *hrp)
+{
+	hrtime_t before, after, best = INT64_MAX;
+	uint64_t tsc;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		before = tsh_clock_mono();
+		tsc = tsh_clock_rdtsc();
+		after = tsh_clock_mono();
+
+		if (after - before < best) {
+			best = after - before;
+			*tscp = tsc;
+			*hrp = before + (after - before) / 2;
+		}
+	}
+}
+
+static void
+tsh_clock_calibrate(void)
+{
+	struct timespec ts;
+	uint64_t tsc0, tsc1;
+	hrtime_t hr0, hr1;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = TSH_CLOCK_CALIBRATE_MSEC * (NANOSEC / MILLISEC);
+
+	tsh_clock_pair(&tsc0, &hr0);
+	(void) nanosleep(&ts, NULL);
+	tsh_clock_pair(&tsc1, &hr1);
+
+	if (tsc1 <= tsc0 || hr1 <= hr0)
+		errx(1, "TSC calibration failed");
+
+	tsh_clock_mult = (uint64_t)(((__uint128_t)(hr1 - hr0) <<
+	    TSH_CLOCK_SHIFT) / (tsc1 - tsc0));
+	tsh_clock_tscbase = tsc1;
+	tsh_clock_hrbase = hr1;
+}
+#endif
+
+/*
+ * Select the clock source by name: "mono" (the default) or "tsc".
+ */
+void
+tsh_clock_init(const char *name)
+{
+	if (name == NULL || strcmp(name, "mono") == 0) {
+		tsh_clock_tsc = B_FALSE;
+		return;
+	}
+
+	if (strcmp(name, "tsc") != 0)
+		errx(1, "unknown clock source \"%s\"", name);
+
+#ifdef __x86_64__
+	if (!tsh_clock_tsc_invariant())
+		errx(1, "TSC is not invariant; cannot use it as a clock");
+
+	tsh_clock_calibrate();
+	tsh_clock_tsc = B_TRUE;
+#else
+	errx(1, "TSC clock source is not supported on this platform");
+#endif
+}
+
+/*
+ * Measure the cost of a call to tsh_gethrtime(), the smallest step we can
+ * observe it take, and whether it ever goes backwards.
+ */
+void
+tsh_clock_selftest(tsh_clock_test_t *test)
+{
+	hrtime_t start, prev, now, delta;
+	int i;
+
+	bzero(test, sizeof (tsh_clock_test_t));
+	test->tsht_name = tsh_clock_tsc ? "tsc" : "mono";
+	test->tsht_res = INT64_MAX;
+
+	start = tsh_clock_mono();
+	prev = tsh_gethrtime();
+
+	for (i = 0; i < TSH_CLOCK_NCALLS; i++) {
+		now = tsh_gethrtime();
+
+		if (now < prev)
+			test->tsht_backwards++;
+
+		prev = now;
+	}
+
+	test->tsht_callns = (double)(tsh_clock_mono() - start) /
+	    TSH_CLOCK_NCALLS;
+
+	for (i = 0; i < TSH_CLOCK_NRES; i++) {
+		prev = tsh_gethrtime();
+
+		while ((now = tsh_gethrtime()) == prev)
+			continue;
+
+		if ((delta = now - prev) > 0 && delta < test->tsht_res)
+			test->tsht_res = delta;
+	}
+
+#ifdef __x86_64__
+	if (tsh_clock_tsc) {
+		test->tsht_mhz = (double)((uint64_t)1 << TSH_CLOCK_SHIFT) *
+		    1000 / tsh_clock_mult;
+	}
+#endif
+}
+
+/*
+ * Parse a duration such as "90", "1.5s", "250ms" or "2h" into nanoseconds.
+ * A number without units is taken to be seconds.  Returns -1 if the duration
+ * is invalid.
+ */
+hrtime_t
+tsh_clock_parse(const char *str)
+{
+	static const struct {
+		const char	*unit;
+		double		mult;
+	} units[] = {
+		{ "", NANOSEC },
+		{ "ns", 1 },
+		{ "us", NANOSEC / MICROSEC },
+		{ "ms", NANOSEC / MILLISEC },
+		{ "s", NANOSEC },
+		{ "m", 60.0 * NANOSEC },
+		{ "h", 3600.0 * NANOSEC },
+		{ NULL, 0 }
+	};
+	char *end;
+	double val;
+	int i;
+
+	val = strtod(str, &end);
+
+	if (end == str || val < 0)
+		return (-1);
+
+	for (i = 0; units[i].unit != NULL; i++) {
+		if (strcmp(end, units[i].unit) == 0)
+			return ((hrtime_t)(val * units[i].mult));
+	}
+
+	return (-1);
+}
@@ -0,0 +1,74 @@
+/*
+ * tsh_clock.h: low-overhead timestamps for the tools' hot paths.
+ *
+ * tsh_gethrtime() returns nanoseconds from an arbitrary origin, like
+ * gethrtime(3C).  By default it is gethrtime() on illumos and the vDSO's
+ * CLOCK_MONOTONIC elsewhere; where the processor has an invariant TSC, the
+ * TSC can be used instead, scaled by a factor calibrated at startup.
+ */
+
+#ifndef _TSH_CLOCK_H
+#define	_TSH_CLOCK_H
+
+#include <time.h>
+
+#include "tsh_compat.h"
+
+typedef struct tsh_clock_test {
+	const char	*tsht_name;		/* clock source */
+	double		tsht_callns;		/* cost per call, in ns */
+	hrtime_t	tsht_res;		/* observed resolution, in ns */
+	uint64_t	tsht_backwards;		/* times clock went backwards */
+	double		tsht_mhz;		/* TSC frequency, if any */
+} tsh_clock_test_t;
+
+extern boolean_t tsh_clock_tsc;
+extern uint64_t tsh_clock_tscbase;
+extern hrtime_t tsh_clock_hrbase;
+extern uint64_t tsh_clock_mult;
+
+#define	TSH_CLOCK_SHIFT		32	/* fixed point shift of TSC scale */
+
+extern void tsh_clock_init(const char *);
+extern void tsh_clock_selftest(tsh_clock_test_t *);
+extern hrtime_t tsh_clock_parse(const char *);
+
+static inline hrtime_t
+tsh_clock_mono(void)
+{
+#ifdef __sun
+	return (gethrtime());
+#else
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((hrtime_t)ts.tv_sec * NANOSEC + ts.tv_nsec);
+#endif
+}
+
+#ifdef __x86_64__
+static inline uint64_t
+tsh_clock_rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return (((uint64_t)hi << 32) | lo);
+}
+#endif
+
+static inline hrtime_t
+tsh_gethrtime(void)
+{
+#ifdef __x86_64__
+	if (tsh_clock_tsc) {
+		uint64_t delta = tsh_clock_rdtsc() - tsh_clock_tscbase;
+
+		return (tsh_clock_hrbase + (hrtime_t)(((__uint128_t)delta *
+		    tsh_clock_mult) >> TSH_CLOCK_SHIFT));
+	}
+#endif
+	return (tsh_clock_mono());
+}
+
+#endif /* _TSH_CLOCK_H */
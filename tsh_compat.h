@@ -0,0 +1,23 @@
+/*
+ * tsh_compat.h: definitions that the tools take for granted on illumos, for
+ * the benefit of other platforms.
+ */
+
+#ifndef _TSH_COMPAT_H
+#define	_TSH_COMPAT_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef __sun
+typedef enum { B_FALSE = 0, B_TRUE = 1 } boolean_t;
+typedef long long hrtime_t;
+
+#define	NANOSEC		1000000000LL
+#define	MICROSEC	1000000LL
+#define	MILLISEC	1000LL
+#endif
+
+#endif /* _TSH_COMPAT_H */
@@ -0,0 +1,150 @@
+/*
+ * tsh_hist.c: log-linear histograms of nanosecond values.
+ */
+
+#include <strings.h>
+
+#include "tsh_hist.h"
+
+#define	TSH_HIST_HALF	(TSH_HIST_SUB / 2)
+
+void
+tsh_hist_init(tsh_hist_t *hist)
+{
+	bzero(hist, sizeof (tsh_hist_t));
+	hist->tshh_min = UINT64_MAX;
+}
+
+/*
+ * Return the bucket that counts the given value.
+ */
+int
+tsh_hist_bucket(uint64_t val)
+{
+	int shift;
+
+	if (val < TSH_HIST_SUB)
+		return ((int)val);
+
+	shift = 64 - __builtin_clzll(val) - TSH_HIST_SUBBITS;
+
+	return (shift * TSH_HIST_HALF + (int)(val >> shift));
+}
+
+/*
+ * Return the smallest value counted by the given bucket.
+ */
+uint64_t
+tsh_hist_lo(int bucket)
+{
+	int shift;
+
+	if (bucket < TSH_HIST_SUB)
+		return ((uint64_t)bucket);
+
+	shift = bucket / TSH_HIST_HALF - 1;
+
+	return ((uint64_t)(bucket - shift * TSH_HIST_HALF) << shift);
+}
+
+/*
+ * Return the largest value counted by the given bucket.
+ */
+uint64_t
+tsh_hist_hi(int bucket)
+{
+	if (bucket + 1 >= TSH_HIST_NBUCKETS)
+		return (UINT64_MAX);
+
+	return (tsh_hist_lo(bucket + 1) - 1);
+}
+
+uint64_t
+tsh_hist_mid(int bucket)
+{
+	uint64_t lo = tsh_hist_lo(bucket);
+
+	return (lo + (tsh_hist_hi(bucket) - lo) / 2);
+}
+
+void
+tsh_hist_addn(tsh_hist_t *hist, uint64_t val, uint64_t n)
+{
+	hist->tshh_buckets[tsh_hist_bucket(val)] += n;
+	hist->tshh_count += n;
+	hist->tshh_sum += (double)val * n;
+
+	if (val < hist->tshh_min)
+		hist->tshh_min = val;
+
+	if (val > hist->tshh_max)
+		hist->tshh_max = val;
+}
+
+void
+tsh_hist_merge(tsh_hist_t *dst, const tsh_hist_t *src)
+{
+	int i;
+
+	if (src->tshh_count == 0)
+		return;
+
+	for (i = 0; i < TSH_HIST_NBUCKETS; i++)
+		dst->tshh_buckets[i] += src->tshh_buckets[i];
+
+	dst->tshh_count += src->tshh_count;
+	dst->tshh_sum += src->tshh_sum;
+
+	if (src->tshh_min < dst->tshh_min)
+		dst->tshh_min = src->tshh_min;
+
+	if (src->tshh_max > dst->tshh_max)
+		dst->tshh_max = src->tshh_max;
+}
+
+/*
+ * Return the value at the given quantile (0 to 1), as the largest value
+ * counted by the bucket in which it falls (but never more than the largest
+ * value seen).  Returns 0 for an empty histogram.
+ */
+uint64_t
+tsh_hist_pct(const tsh_hist_t *hist, double q)
+{
+	uint64_t rank, seen = 0, val;
+	int i;
+
+	if (hist->tshh_count == 0)
+		return (0);
+
+	if (q <= 0)
+		return (hist->tshh_min);
+
+	rank = (uint64_t)(q * hist->tshh_count);
+
+	if (rank < q * hist->tshh_count)
+		rank++;
+
+	if (rank > hist->tshh_count)
+		rank = hist->tshh_count;
+
+	for (i = 0; i < TSH_HIST_NBUCKETS; i++) {
+		if ((seen += hist->tshh_buckets[i]) >= rank)
+			break;
+	}
+
+	val = tsh_hist_hi(i);
+
+	if (val > hist->tshh_max)
+		val = hist->tshh_max;
+
+	if (val < hist->tshh_min)
+		val = hist->tshh_min;
+
+	return (val);
+}
+
+double
+tsh_hist_mean(const tsh_hist_t *hist)
+{
+	return (hist->tshh_count ? hist->tshh_sum / hist->tshh_count : 0.0);
+}
@@ -0,0 +1,45 @@
+/*
+ * tsh_hist.h: log-linear histograms of nanosecond values.
+ *
+ * Values below 2^TSH_HIST_SUBBITS are counted exactly; above that, each power
+ * of two is divided into 2^(TSH_HIST_SUBBITS - 1) buckets, bounding the
+ * relative error of any reported value to 2^-(TSH_HIST_SUBBITS - 1).  A
+ * histogram has a fixed size regardless of the number of values counted,
+ * and histograms can be merged by adding their buckets.
+ */
+
+#ifndef _TSH_HIST_H
+#define	_TSH_HIST_H
+
+#include "tsh_compat.h"
+
+#define	TSH_HIST_SUBBITS	7
+#define	TSH_HIST_SUB		(1 << TSH_HIST_SUBBITS)
+#define	TSH_HIST_NBUCKETS	((64 - TSH_HIST_SUBBITS + 2) * TSH_HIST_SUB / 2)
+
+typedef struct tsh_hist {
+	uint64_t	tshh_count;			/* values counted */
+	uint64_t	tshh_min;			/* smallest value */
+	uint64_t	tshh_max;			/* largest value */
+	double		tshh_sum;			/* sum of values */
+	uint64_t	tshh_buckets[TSH_HIST_NBUCKETS];
+} tsh_hist_t;
+
+extern void tsh_hist_init(tsh_hist_t *);
+extern void tsh_hist_addn(tsh_hist_t *, uint64_t, uint64_t);
+extern void tsh_hist_merge(tsh_hist_t *, const tsh_hist_t *);
+extern uint64_t tsh_hist_pct(const tsh_hist_t *, double);
+extern double tsh_hist_mean(const tsh_hist_t *);
+
+extern int tsh_hist_bucket(uint64_t);
+extern uint64_t tsh_hist_lo(int);
+extern uint64_t tsh_hist_hi(int);
+extern uint64_t tsh_hist_mid(int);
+
+static inline void
+tsh_hist_add(tsh_hist_t *hist, uint64_t val)
+{
+	tsh_hist_addn(hist, val, 1);
+}
+
+#endif /* _TSH_HIST_H */
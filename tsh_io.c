@@ -0,0 +1,132 @@
+/*
+ * tsh_io.c: the tools' I/O backends.
+ *
+ * In mmap mode, the whole file or device is mapped shared at startup.  A read
+ * copies from the mapping, faulting in its pages; a write copies into it,
+ * dirtying them.  Without msync, writes reach the device only when the system
+ * writes back dirty pages, so every Nth write (as given by "msync=N") also
+ * synchronously flushes the whole mapping, and so everything dirtied since
+ * the last flush, and its latency includes that flush.  (msync only visits
+ * the pages that are dirty, so this costs no more than tracking the ranges
+ * ourselves would.)
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tsh_io.h"
+
+tsh_io_mode_t tsh_io_mode = TSH_IO_SYSCALL;
+
+static char *tsh_io_map;		/* mapping of file or device */
+static off_t tsh_io_size;		/* size of mapping */
+static uint64_t tsh_io_msync;		/* msync every this many writes */
+static uint64_t tsh_io_nwrites;		/* writes so far */
+
+/*
+ * Parse a backend:  "syscall", "mmap" or "mmap,msync=N".
+ */
+void
+tsh_io_parse(const char *arg)
+{
+	const char *opt;
+	char *end;
+
+	if (strcmp(arg, "syscall") == 0) {
+		tsh_io_mode = TSH_IO_SYSCALL;
+		return;
+	}
+
+	if (strncmp(arg, "mmap", 4) != 0 || (arg[4] != '\0' && arg[4] != ','))
+		errx(1, "invalid I/O mode \"%s\"", arg);
+
+	tsh_io_mode = TSH_IO_MMAP;
+
+	if (arg[4] == '\0')
+		return;
+
+	opt = &arg[5];
+
+	if (strncmp(opt, "msync=", 6) != 0)
+		errx(1, "invalid mmap option \"%s\"", opt);
+
+	tsh_io_msync = strtoull(&opt[6], &end, 10);
+
+	if (*end != '\0' || end == &opt[6])
+		errx(1, "invalid msync cadence \"%s\"", &opt[6]);
+}
+
+void
+tsh_io_init(int fd, off_t size)
+{
+	if (tsh_io_mode != TSH_IO_MMAP)
+		return;
+
+	tsh_io_size = size;
+
+	if ((tsh_io_map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(1, "couldn't map %ld bytes", (long)size);
+}
+
+void
+tsh_io_describe(char *buf, size_t len)
+{
+	if (tsh_io_mode == TSH_IO_SYSCALL) {
+		(void) snprintf(buf, len, "pread/pwrite");
+	} else if (tsh_io_msync == 0) {
+		(void) snprintf(buf, len, "mmap, no msync");
+	} else {
+		(void) snprintf(buf, len, "mmap, msync every %llu writes",
+		    (unsigned long long)tsh_io_msync);
+	}
+}
+
+ssize_t
+tsh_io_read(int fd, void *buf, size_t len, off_t offset)
+{
+	if (tsh_io_mode == TSH_IO_SYSCALL)
+		return (pread(fd, buf, len, offset));
+
+	if (offset < 0 || offset + (off_t)len > tsh_io_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	(void) memcpy(buf, tsh_io_map + offset, len);
+
+	return (len);
+}
+
+ssize_t
+tsh_io_write(int fd, const void *buf, size_t len, off_t offset)
+{
+	uint64_t n;
+
+	if (tsh_io_mode == TSH_IO_SYSCALL)
+		return (pwrite(fd, buf, len, offset));
+
+	if (offset < 0 || offset + (off_t)len > tsh_io_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	(void) memcpy(tsh_io_map + offset, buf, len);
+
+	if (tsh_io_msync == 0)
+		return (len);
+
+	n = __atomic_add_fetch(&tsh_io_nwrites, 1, __ATOMIC_RELAXED);
+
+	if (n % tsh_io_msync != 0)
+		return (len);
+
+	if (msync(tsh_io_map, tsh_io_size, MS_SYNC) != 0)
+		return (-1);
+
+	return (len);
+}
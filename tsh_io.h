@@ -0,0 +1,26 @@
+/*
+ * tsh_io.h: how the tools perform I/O:  either with pread(2) and pwrite(2),
+ * or through a shared mapping of the file or device, in which reads and
+ * writes are page touches and copies (and the writes are made durable with
+ * msync(3C) at a configurable cadence).
+ */
+
+#ifndef _TSH_IO_H
+#define	_TSH_IO_H
+
+#include "tsh_compat.h"
+
+typedef enum tsh_io_mode {
+	TSH_IO_SYSCALL = 0,		/* pread(2) and pwrite(2) */
+	TSH_IO_MMAP			/* loads and stores to a mapping */
+} tsh_io_mode_t;
+
+extern tsh_io_mode_t tsh_io_mode;
+
+extern void tsh_io_parse(const char *);
+extern void tsh_io_init(int, off_t);
+extern void tsh_io_describe(char *, size_t);
+extern ssize_t tsh_io_read(int, void *, size_t, off_t);
+extern ssize_t tsh_io_write(int, const void *, size_t, off_t);
+
+#endif /* _TSH_IO_H */
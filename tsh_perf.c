@@ -0,0 +1,268 @@
+/*
+ * tsh_perf.c: per-thread hardware counters and CPU usage accounting.
+ *
+ * Counters come from perf_event_open(2) where it exists; elsewhere (or when
+ * the kernel refuses us) only getrusage(3C) totals are reported.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "tsh_perf.h"
+
+boolean_t tsh_perf_enabled = B_FALSE;
+
+static pthread_mutex_t tsh_perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static boolean_t tsh_perf_warned = B_FALSE;
+
+static const char *tsh_perf_names[TSH_PERF_NCTRS] = {
+	"cycles", "instructions", "context-switches", "cpu-migrations"
+};
+
+static void
+tsh_perf_warn(const char *what, int error)
+{
+	(void) pthread_mutex_lock(&tsh_perf_lock);
+
+	if (!tsh_perf_warned) {
+		warnx("counter \"%s\" unavailable: %s", what,
+		    strerror(error));
+		tsh_perf_warned = B_TRUE;
+	}
+
+	(void) pthread_mutex_unlock(&tsh_perf_lock);
+}
+
+/*
+ * Open a single counter for the calling thread, returning its fd or -1 if it
+ * isn't available.
+ */
+int
+tsh_perf_open(tsh_perf_ctr_t which)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	int fd;
+
+	bzero(&attr, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.exclude_hv = 1;
+
+	switch (which) {
+	case TSH_PERF_CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case TSH_PERF_INSTRS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case TSH_PERF_CSW:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+		break;
+	case TSH_PERF_MIGRATIONS:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CPU_MIGRATIONS;
+		break;
+	default:
+		return (-1);
+	}
+
+	/*
+	 * We would like to include the kernel's share of each I/O, but an
+	 * unprivileged process may only count user mode; fall back to that.
+	 */
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+	if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	if (fd < 0)
+		tsh_perf_warn(tsh_perf_names[which], errno);
+
+	return (fd);
+#else
+	tsh_perf_warn(tsh_perf_names[which], ENOTSUP);
+	return (-1);
+#endif
+}
+
+/*
+ * Open counters for the calling thread.  Must be called by the thread to be
+ * measured; does nothing (beyond marking the counters invalid) unless
+ * counters have been enabled.
+ */
+void
+tsh_perf_thread_init(tsh_perf_t *perf)
+{
+	int i;
+
+	bzero(perf, sizeof (tsh_perf_t));
+
+	for (i = 0; i < TSH_PERF_NCTRS; i++) {
+		perf->tshp_fd[i] = -1;
+
+		if (tsh_perf_enabled)
+			perf->tshp_fd[i] = tsh_perf_open(i);
+	}
+}
+
+void
+tsh_perf_read(tsh_perf_t *perf)
+{
+	uint64_t val;
+	int i;
+
+	for (i = 0; i < TSH_PERF_NCTRS; i++) {
+		if (perf->tshp_fd[i] == -1)
+			continue;
+
+		if (read(perf->tshp_fd[i], &val, sizeof (val)) == sizeof (val))
+			perf->tshp_val[i] = val;
+	}
+}
+
+void
+tsh_perf_fini(tsh_perf_t *perf)
+{
+	int i;
+
+	for (i = 0; i < TSH_PERF_NCTRS; i++) {
+		if (perf->tshp_fd[i] != -1)
+			(void) close(perf->tshp_fd[i]);
+
+		perf->tshp_fd[i] = -1;
+	}
+}
+
+static hrtime_t
+tsh_tv2hr(struct timeval *tv)
+{
+	return ((hrtime_t)tv->tv_sec * NANOSEC + (hrtime_t)tv->tv_usec * 1000);
+}
+
+/*
+ * Take a snapshot of process CPU usage, and of the counters of the given
+ * threads.
+ */
+void
+tsh_cost_snap(tsh_cost_t *cost, tsh_perf_t *perf, int nperf)
+{
+	struct rusage ru;
+	int i, c;
+
+	bzero(cost, sizeof (tsh_cost_t));
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		err(1, "getrusage");
+
+	cost->tshc_user = tsh_tv2hr(&ru.ru_utime);
+	cost->tshc_sys = tsh_tv2hr(&ru.ru_stime);
+	cost->tshc_vcsw = ru.ru_nvcsw;
+	cost->tshc_ivcsw = ru.ru_nivcsw;
+
+	for (i = 0; i < nperf; i++) {
+		tsh_perf_read(&perf[i]);
+
+		for (c = 0; c < TSH_PERF_NCTRS; c++) {
+			if (perf[i].tshp_fd[c] == -1)
+				continue;
+
+			cost->tshc_ctr[c] += perf[i].tshp_val[c];
+			cost->tshc_ctrvalid[c] = B_TRUE;
+		}
+	}
+}
+
+void
+tsh_cost_diff(tsh_cost_t *delta, const tsh_cost_t *now,
+    const tsh_cost_t *then)
+{
+	int c;
+
+	delta->tshc_user = now->tshc_user - then->tshc_user;
+	delta->tshc_sys = now->tshc_sys - then->tshc_sys;
+	delta->tshc_vcsw = now->tshc_vcsw - then->tshc_vcsw;
+	delta->tshc_ivcsw = now->tshc_ivcsw - then->tshc_ivcsw;
+
+	for (c = 0; c < TSH_PERF_NCTRS; c++) {
+		delta->tshc_ctr[c] = now->tshc_ctr[c] - then->tshc_ctr[c];
+		delta->tshc_ctrvalid[c] =
+		    now->tshc_ctrvalid[c] && then->tshc_ctrvalid[c];
+	}
+}
+
+/*
+ * Print a summary of the CPU cost of nops operations totalling nbytes bytes
+ * over elapsed nanoseconds, each line prefixed with "who: ".
+ */
+void
+tsh_cost_report(FILE *out, const char *who, const tsh_cost_t *cost,
+    uint64_t nops, uint64_t nbytes, hrtime_t elapsed)
+{
+	hrtime_t cpu = cost->tshc_user + cost->tshc_sys;
+	const uint64_t *ctr = cost->tshc_ctr;
+	const boolean_t *valid = cost->tshc_ctrvalid;
+
+	(void) fprintf(out, "%s: cpu: user %.3fs sys %.3fs "
+	    "(%.1f%% of one CPU over %.3fs)\n", who,
+	    (double)cost->tshc_user / NANOSEC,
+	    (double)cost->tshc_sys / NANOSEC,
+	    elapsed ? 100.0 * cpu / elapsed : 0.0,
+	    (double)elapsed / NANOSEC);
+
+	(void) fprintf(out, "%s: cpu per op: %.2fus; per GB: %.3fs\n", who,
+	    nops ? (double)cpu / nops / 1000 : 0.0,
+	    nbytes ? (double)cpu / NANOSEC / ((double)nbytes / (1ULL << 30)) :
+	    0.0);
+
+	(void) fprintf(out, "%s: context switches: %ld voluntary, "
+	    "%ld involuntary\n", who, cost->tshc_vcsw, cost->tshc_ivcsw);
+
+	if (!valid[TSH_PERF_CYCLES] && !valid[TSH_PERF_INSTRS] &&
+	    !valid[TSH_PERF_CSW] && !valid[TSH_PERF_MIGRATIONS])
+		return;
+
+	(void) fprintf(out, "%s: counters:", who);
+
+	if (valid[TSH_PERF_CYCLES]) {
+		(void) fprintf(out, " %.0f cycles/op",
+		    nops ? (double)ctr[TSH_PERF_CYCLES] / nops : 0.0);
+	}
+
+	if (valid[TSH_PERF_INSTRS]) {
+		(void) fprintf(out, " %.0f instructions/op",
+		    nops ? (double)ctr[TSH_PERF_INSTRS] / nops : 0.0);
+	}
+
+	if (valid[TSH_PERF_CYCLES] && valid[TSH_PERF_INSTRS]) {
+		(void) fprintf(out, " %.2f IPC", ctr[TSH_PERF_CYCLES] ?
+		    (double)ctr[TSH_PERF_INSTRS] / ctr[TSH_PERF_CYCLES] : 0.0);
+	}
+
+	if (valid[TSH_PERF_CSW]) {
+		(void) fprintf(out, " %llu switches",
+		    (unsigned long long)ctr[TSH_PERF_CSW]);
+	}
+
+	if (valid[TSH_PERF_MIGRATIONS]) {
+		(void) fprintf(out, " %llu migrations",
+		    (unsigned long long)ctr[TSH_PERF_MIGRATIONS]);
+	}
+
+	(void) fprintf(out, "\n");
+}
@@ -0,0 +1,54 @@
+/*
+ * tsh_perf.h: per-thread hardware counters and CPU usage accounting, used to
+ * report how much CPU the tools themselves spend per I/O.
+ */
+
+#ifndef _TSH_PERF_H
+#define	_TSH_PERF_H
+
+#include "tsh_compat.h"
+
+typedef enum tsh_perf_ctr {
+	TSH_PERF_CYCLES = 0,		/* CPU cycles */
+	TSH_PERF_INSTRS,		/* instructions retired */
+	TSH_PERF_CSW,			/* context switches */
+	TSH_PERF_MIGRATIONS,		/* CPU migrations */
+	TSH_PERF_NCTRS
+} tsh_perf_ctr_t;
+
+/*
+ * Counters for a single thread.  Each is opened by the thread that it
+ * measures, but may be read from any thread.
+ */
+typedef struct tsh_perf {
+	int		tshp_fd[TSH_PERF_NCTRS];	/* counter fd, or -1 */
+	uint64_t	tshp_val[TSH_PERF_NCTRS];	/* last value read */
+} tsh_perf_t;
+
+/*
+ * A snapshot of CPU cost: process-wide resource usage plus counters summed
+ * over some set of threads.
+ */
+typedef struct tsh_cost {
+	hrtime_t	tshc_user;			/* user CPU time */
+	hrtime_t	tshc_sys;			/* system CPU time */
+	long		tshc_vcsw;			/* voluntary switches */
+	long		tshc_ivcsw;			/* involuntary switches */
+	uint64_t	tshc_ctr[TSH_PERF_NCTRS];	/* summed counters */
+	boolean_t	tshc_ctrvalid[TSH_PERF_NCTRS];	/* counter available */
+} tsh_cost_t;
+
+extern boolean_t tsh_perf_enabled;
+
+extern int tsh_perf_open(tsh_perf_ctr_t);
+extern void tsh_perf_thread_init(tsh_perf_t *);
+extern void tsh_perf_read(tsh_perf_t *);
+extern void tsh_perf_fini(tsh_perf_t *);
+
+extern void tsh_cost_snap(tsh_cost_t *, tsh_perf_t *, int);
+extern void tsh_cost_diff(tsh_cost_t *, const tsh_cost_t *,
+    const tsh_cost_t *);
+extern void tsh_cost_report(FILE *, const char *, const tsh_cost_t *,
+    uint64_t, uint64_t, hrtime_t);
+
+#endif /* _TSH_PERF_H */
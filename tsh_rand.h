@@ -0,0 +1,31 @@
+/*
+ * tsh_rand.h: a small, fast, seedable pseudo-random number generator
+ * (splitmix64), for when results must be reproducible from run to run.
+ */
+
+#ifndef _TSH_RAND_H
+#define	_TSH_RAND_H
+
+#include "tsh_compat.h"
+
+static inline uint64_t
+tsh_rand(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Return a value uniformly distributed in [0, n).
+ */
+static inline uint64_t
+tsh_rand_uniform(uint64_t *state, uint64_t n)
+{
+	return ((uint64_t)(((__uint128_t)tsh_rand(state) * n) >> 64));
+}
+
+#endif /* _TSH_RAND_H */
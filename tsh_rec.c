@@ -0,0 +1,97 @@
+/*
+ * tsh_rec.c: parsing of toshreplay's per-operation records.
+ *
+ * A record is a time, a direction ("->" for a start, "<-" for a completion)
+ * and a series of key=value fields.  Fields that we don't know about are
+ * ignored, so that records may grow new fields without breaking consumers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "tsh_rec.h"
+
+/*
+ * Parse a line of toshreplay output.  Returns 0 and fills in the record if
+ * the line is an operation record, and -1 if it isn't.
+ */
+int
+tsh_rec_parse(const char *line, tsh_rec_t *rec)
+{
+	const char *s, *key, *val;
+	char *end;
+	long long num;
+	size_t klen;
+	boolean_t typed = B_FALSE;
+
+	bzero(rec, sizeof (tsh_rec_t));
+
+	rec->tshr_time = strtoll(line, &end, 10);
+
+	if (end == line || *end != ' ')
+		return (-1);
+
+	s = end + 1;
+
+	if (s[0] == '-' && s[1] == '>') {
+		rec->tshr_done = B_FALSE;
+	} else if (s[0] == '<' && s[1] == '-') {
+		rec->tshr_done = B_TRUE;
+	} else {
+		return (-1);
+	}
+
+	for (s += 2; *s != '\0' && *s != '\n'; s++) {
+		if (*s == ' ')
+			continue;
+
+		key = s;
+
+		while (*s != '=' && *s != ' ' && *s != '\0' && *s != '\n')
+			s++;
+
+		if (*s != '=') {
+			s--;
+			continue;
+		}
+
+		klen = s - key;
+		val = ++s;
+
+		if (klen == 4 && strncmp(key, "type", 4) == 0) {
+			rec->tshr_read = (*val == 'R');
+			typed = B_TRUE;
+
+			while (*s != ' ' && *s != '\0' && *s != '\n')
+				s++;
+
+			s--;
+			continue;
+		}
+
+		num = strtoll(val, &end, 10);
+		s = end - 1;
+
+		if (end == val)
+			continue;
+
+		if (klen == 5 && strncmp(key, "blkno", 5) == 0) {
+			rec->tshr_blkno = num;
+		} else if (klen == 4 && strncmp(key, "size", 4) == 0) {
+			rec->tshr_size = num;
+		} else if (klen == 4 && strncmp(key, "outr", 4) == 0) {
+			rec->tshr_outr = (int)num;
+		} else if (klen == 4 && strncmp(key, "outw", 4) == 0) {
+			rec->tshr_outw = (int)num;
+		} else if (klen == 7 && strncmp(key, "latency", 7) == 0) {
+			rec->tshr_latency = num;
+		} else if (klen == 8 && strncmp(key, "schedlat", 8) == 0) {
+			rec->tshr_schedlat = num;
+		} else if (klen == 6 && strncmp(key, "worker", 6) == 0) {
+			rec->tshr_worker = (int)num;
+		}
+	}
+
+	return (typed ? 0 : -1);
+}
@@ -0,0 +1,26 @@
+/*
+ * tsh_rec.h: parsing of the records that toshreplay emits for each operation
+ * as it starts ("->") and completes ("<-").
+ */
+
+#ifndef _TSH_REC_H
+#define	_TSH_REC_H
+
+#include "tsh_compat.h"
+
+typedef struct tsh_rec {
+	hrtime_t	tshr_time;		/* time of event */
+	boolean_t	tshr_done;		/* completion, not start */
+	boolean_t	tshr_read;		/* boolean: is read */
+	off_t		tshr_blkno;		/* block number of op */
+	off_t		tshr_size;		/* size of op */
+	int		tshr_outr;		/* outstanding reads */
+	int		tshr_outw;		/* outstanding writes */
+	hrtime_t	tshr_latency;		/* latency (completions) */
+	hrtime_t	tshr_schedlat;		/* schedule lag (starts) */
+	int		tshr_worker;		/* worker (completions) */
+} tsh_rec_t;
+
+extern int tsh_rec_parse(const char *, tsh_rec_t *);
+
+#endif /* _TSH_REC_H */
@@ -0,0 +1,632 @@
+/*
+ * tsh_sched.c: CPU binding, real-time scheduling and memory locking for the
+ * tools' threads, and accounting of the scheduling disruption they suffer.
+ *
+ * On Linux, each role may be bound to an arbitrary set of CPUs.  Elsewhere,
+ * each thread is bound to a single CPU, with the threads of a role assigned
+ * round-robin to the CPUs of its set.
+ */
+
+#ifdef __linux__
+#define	_GNU_SOURCE
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#else
+#include <procfs.h>
+#include <sys/lwp.h>
+#include <sys/processor.h>
+#include <sys/procset.h>
+#endif
+
+#include "tsh_perf.h"
+#include "tsh_sched.h"
+
+#define	TSH_STACK_SLOP	(256 * 1024)	/* stack beyond threads' buffers */
+
+typedef struct tsh_sched_thread {
+	tsh_role_t	tsht_role;		/* role of thread */
+	int		tsht_tid;		/* thread's kernel ID */
+	int		tsht_migfd;		/* migration counter, or -1 */
+	long		tsht_ivcsw;		/* involuntary switches at start */
+	boolean_t	tsht_exited;		/* thread has exited */
+	uint64_t	tsht_migr;		/* migrations, once exited */
+	long		tsht_ivcswexit;		/* switches, once exited */
+} tsh_sched_thread_t;
+
+static const char *tsh_role_names[TSH_NROLES] = {
+	"dispatcher", "workers", "reporter"
+};
+
+boolean_t tsh_sched_rt = B_FALSE;		/* dispatcher at SCHED_FIFO */
+boolean_t tsh_sched_mlock = B_FALSE;		/* mlockall() our memory */
+
+static char *tsh_sched_spec[TSH_NROLES];	/* CPUs, as specified */
+static tsh_cpuset_t tsh_sched_cpus[TSH_NROLES];	/* CPUs for each role */
+static boolean_t tsh_sched_bound[TSH_NROLES];	/* role is bound */
+#ifndef __linux__
+static int tsh_sched_next[TSH_NROLES];		/* next CPU (round-robin) */
+#endif
+
+static pthread_mutex_t tsh_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static tsh_sched_thread_t *tsh_sched_threads;	/* registered threads */
+static int tsh_sched_nthreads;			/* number registered */
+static int tsh_sched_maxthreads;		/* number allocated */
+static __thread int tsh_sched_self = -1;	/* our registry slot */
+
+static boolean_t
+tsh_cpuset_isset(const tsh_cpuset_t *set, int cpu)
+{
+	return ((set->tshcs_mask[cpu / 64] & (1ULL << (cpu % 64))) ?
+	    B_TRUE : B_FALSE);
+}
+
+#ifndef __linux__
+static int
+tsh_cpuset_count(const tsh_cpuset_t *set)
+{
+	int cpu, n = 0;
+
+	for (cpu = 0; cpu < TSH_MAXCPUS; cpu++) {
+		if (tsh_cpuset_isset(set, cpu))
+			n++;
+	}
+
+	return (n);
+}
+#endif
+
+/*
+ * Parse a list of CPUs such as "0-3,8,10-11".  Returns -1 if the list is
+ * invalid.
+ */
+int
+tsh_cpuset_parse(const char *str, tsh_cpuset_t *set)
+{
+	const char *s = str;
+	char *end;
+	long lo, hi, cpu;
+
+	bzero(set, sizeof (tsh_cpuset_t));
+
+	for (;;) {
+		lo = hi = strtol(s, &end, 10);
+
+		if (end == s || lo < 0)
+			return (-1);
+
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+
+			if (end == s || hi < lo)
+				return (-1);
+		}
+
+		if (hi >= TSH_MAXCPUS)
+			return (-1);
+
+		for (cpu = lo; cpu <= hi; cpu++)
+			set->tshcs_mask[cpu / 64] |= (1ULL << (cpu % 64));
+
+		if (*end == '\0' || *end == '\n')
+			break;
+
+		if (*end != ',')
+			return (-1);
+
+		s = end + 1;
+	}
+
+	return (0);
+}
+
+/*
+ * Format a set of CPUs in the form accepted by tsh_cpuset_parse().
+ */
+void
+tsh_cpuset_format(const tsh_cpuset_t *set, char *buf, size_t len)
+{
+	size_t off = 0;
+	int cpu, lo;
+
+	buf[0] = '\0';
+
+	for (cpu = 0; cpu < TSH_MAXCPUS && off < len; cpu++) {
+		if (!tsh_cpuset_isset(set, cpu))
+			continue;
+
+		for (lo = cpu; cpu + 1 < TSH_MAXCPUS &&
+		    tsh_cpuset_isset(set, cpu + 1); cpu++)
+			continue;
+
+		off += snprintf(buf + off, len - off, "%s%d", off ? "," : "",
+		    lo);
+
+		if (cpu != lo && off < len)
+			off += snprintf(buf + off, len - off, "-%d", cpu);
+	}
+}
+
+/*
+ * Record the CPUs for one or more roles, given an argument of the form
+ * "role=cpus", where role is one of the roles allowed by the given mask (or
+ * "all"), and cpus is either a list of CPUs or "local", meaning the CPUs
+ * nearest to the device being operated on.
+ */
+void
+tsh_sched_affinity(const char *arg, unsigned int allowed)
+{
+	const char *eq;
+	size_t len;
+	int role;
+	boolean_t found = B_FALSE;
+	tsh_cpuset_t set;
+
+	if ((eq = strchr(arg, '=')) == NULL || eq[1] == '\0')
+		errx(1, "invalid affinity \"%s\" (expected role=cpus)", arg);
+
+	if (strcmp(eq + 1, "local") != 0 && tsh_cpuset_parse(eq + 1, &set) != 0)
+		errx(1, "invalid CPU list \"%s\"", eq + 1);
+
+	len = eq - arg;
+
+	for (role = 0; role < TSH_NROLES; role++) {
+		if (!(allowed & (1 << role)))
+			continue;
+
+		if ((len == strlen("all") && strncmp(arg, "all", len) == 0) ||
+		    (len == strlen(tsh_role_names[role]) &&
+		    strncmp(arg, tsh_role_names[role], len) == 0)) {
+			tsh_sched_spec[role] = (char *)(eq + 1);
+			found = B_TRUE;
+		}
+	}
+
+	if (!found)
+		errx(1, "invalid role in affinity \"%s\"", arg);
+}
+
+boolean_t
+tsh_sched_active(void)
+{
+	int role;
+
+	for (role = 0; role < TSH_NROLES; role++) {
+		if (tsh_sched_spec[role] != NULL)
+			return (B_TRUE);
+	}
+
+	return (tsh_sched_rt || tsh_sched_mlock);
+}
+
+/*
+ * Determine the CPUs local to the device (or the device underlying the file)
+ * open as fd, by way of its NUMA node.  Returns -1 if they can't be
+ * determined.
+ */
+static int
+tsh_sched_local(const char *file, int fd, tsh_cpuset_t *set)
+{
+#ifdef __linux__
+	static const char *paths[] = {
+		"/sys/dev/%s/%u:%u/device/numa_node",
+		"/sys/dev/%s/%u:%u/device/device/numa_node",
+		"/sys/dev/%s/%u:%u/../device/numa_node",
+		"/sys/dev/%s/%u:%u/../device/device/numa_node",
+		NULL
+	};
+	struct stat st;
+	char path[PATH_MAX], buf[4096];
+	const char *kind;
+	unsigned int maj, min;
+	FILE *fp = NULL;
+	int i, node = -1;
+
+	if (fstat(fd, &st) != 0)
+		err(1, "fstat \"%s\"", file);
+
+	if (S_ISCHR(st.st_mode)) {
+		kind = "char";
+		maj = major(st.st_rdev);
+		min = minor(st.st_rdev);
+	} else {
+		kind = "block";
+		maj = major(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+		min = minor(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+	}
+
+	for (i = 0; paths[i] != NULL && fp == NULL; i++) {
+		(void) snprintf(path, sizeof (path), paths[i], kind, maj, min);
+		fp = fopen(path, "r");
+	}
+
+	if (fp == NULL)
+		return (-1);
+
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+
+	(void) fclose(fp);
+
+	if (node < 0)
+		return (-1);
+
+	(void) snprintf(path, sizeof (path),
+	    "/sys/devices/system/node/node%d/cpulist", node);
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+
+	if (fgets(buf, sizeof (buf), fp) == NULL ||
+	    tsh_cpuset_parse(buf, set) != 0) {
+		(void) fclose(fp);
+		return (-1);
+	}
+
+	(void) fclose(fp);
+	return (0);
+#else
+	(void) file;
+	(void) fd;
+	(void) set;
+
+	return (-1);
+#endif
+}
+
+/*
+ * Resolve the CPUs for each role (given the device or file being operated on
+ * and its fd), and lock our memory if so configured.  Must be called before
+ * any thread calls tsh_sched_enter().
+ */
+void
+tsh_sched_init(const char *file, int fd)
+{
+	tsh_cpuset_t local;
+	boolean_t havelocal = B_FALSE, triedlocal = B_FALSE;
+	int role;
+
+	for (role = 0; role < TSH_NROLES; role++) {
+		if (tsh_sched_spec[role] == NULL)
+			continue;
+
+		if (strcmp(tsh_sched_spec[role], "local") != 0) {
+			(void) tsh_cpuset_parse(tsh_sched_spec[role],
+			    &tsh_sched_cpus[role]);
+			tsh_sched_bound[role] = B_TRUE;
+			continue;
+		}
+
+		if (!triedlocal) {
+			havelocal = tsh_sched_local(file, fd, &local) == 0;
+			triedlocal = B_TRUE;
+
+			if (!havelocal) {
+				warnx("couldn't determine CPUs local to "
+				    "\"%s\"; not binding", file);
+			}
+		}
+
+		if (havelocal) {
+			tsh_sched_cpus[role] = local;
+			tsh_sched_bound[role] = B_TRUE;
+		}
+	}
+
+	if (tsh_sched_rt) {
+		tsh_cpuset_t *disp = &tsh_sched_cpus[TSH_ROLE_DISPATCHER];
+		tsh_cpuset_t *work = &tsh_sched_cpus[TSH_ROLE_WORKERS];
+		boolean_t shared = !tsh_sched_bound[TSH_ROLE_DISPATCHER] ||
+		    !tsh_sched_bound[TSH_ROLE_WORKERS];
+		int i;
+
+		for (i = 0; i < TSH_MAXCPUS / 64 && !shared; i++) {
+			if (disp->tshcs_mask[i] & work->tshcs_mask[i])
+				shared = B_TRUE;
+		}
+
+		if (shared) {
+			warnx("SCHED_FIFO dispatcher may share CPUs with "
+			    "workers and starve them; consider binding it to "
+			    "a dedicated CPU");
+		}
+	}
+
+	if (tsh_sched_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		err(1, "mlockall");
+}
+
+/*
+ * Size the stack of a thread that needs the given amount of stack for its
+ * own buffers.  When memory is locked, every byte of every thread's stack is
+ * locked too, so we don't want the (large) default.
+ */
+void
+tsh_sched_stack(pthread_attr_t *attr, size_t need)
+{
+	if (tsh_sched_mlock &&
+	    pthread_attr_setstacksize(attr, need + TSH_STACK_SLOP) != 0)
+		errx(1, "couldn't set stack size");
+}
+
+static int
+tsh_sched_tid(void)
+{
+#ifdef __linux__
+	return ((int)syscall(SYS_gettid));
+#else
+	return ((int)_lwp_self());
+#endif
+}
+
+/*
+ * Return the number of involuntary context switches suffered so far by the
+ * given thread of this process, or -1 if that can't be determined.
+ */
+static long
+tsh_sched_ivcsw(int tid)
+{
+	char path[PATH_MAX];
+	long ivcsw = -1;
+#ifdef __linux__
+	char line[256];
+	FILE *fp;
+
+	(void) snprintf(path, sizeof (path), "/proc/self/task/%d/status", tid);
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (sscanf(line, "nonvoluntary_ctxt_switches: %ld",
+		    &ivcsw) == 1)
+			break;
+	}
+
+	(void) fclose(fp);
+#else
+	prusage_t pru;
+	int fd;
+
+	(void) snprintf(path, sizeof (path), "/proc/self/lwp/%d/lwpusage", tid);
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+
+	if (read(fd, &pru, sizeof (pru)) == sizeof (pru))
+		ivcsw = pru.pr_ictx;
+
+	(void) close(fd);
+#endif
+	return (ivcsw);
+}
+
+static void
+tsh_sched_bind(tsh_role_t role)
+{
+	tsh_cpuset_t *set = &tsh_sched_cpus[role];
+	int cpu, error;
+#ifdef __linux__
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+
+	for (cpu = 0; cpu < TSH_MAXCPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (tsh_cpuset_isset(set, cpu))
+			CPU_SET(cpu, &cpus);
+	}
+
+	error = pthread_setaffinity_np(pthread_self(), sizeof (cpus), &cpus);
+
+	if (error != 0) {
+		errx(1, "couldn't bind %s to CPUs: %s", tsh_role_names[role],
+		    strerror(error));
+	}
+#else
+	int n, nth;
+
+	(void) pthread_mutex_lock(&tsh_sched_lock);
+	nth = tsh_sched_next[role]++ % tsh_cpuset_count(set);
+	(void) pthread_mutex_unlock(&tsh_sched_lock);
+
+	for (cpu = 0, n = 0; cpu < TSH_MAXCPUS; cpu++) {
+		if (tsh_cpuset_isset(set, cpu) && n++ == nth)
+			break;
+	}
+
+	if (processor_bind(P_LWPID, P_MYID, cpu, NULL) != 0) {
+		error = errno;
+		errx(1, "couldn't bind %s to CPU %d: %s", tsh_role_names[role],
+		    cpu, strerror(error));
+	}
+#endif
+}
+
+/*
+ * Called by each thread as it starts, to apply the profile for its role and
+ * register it for reporting.
+ */
+void
+tsh_sched_enter(tsh_role_t role)
+{
+	tsh_sched_thread_t *thr;
+	struct sched_param param;
+	int error;
+
+	if (!tsh_sched_active())
+		return;
+
+	if (tsh_sched_bound[role])
+		tsh_sched_bind(role);
+
+	if (role == TSH_ROLE_DISPATCHER && tsh_sched_rt) {
+		bzero(&param, sizeof (param));
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+
+		if ((error = pthread_setschedparam(pthread_self(),
+		    SCHED_FIFO, &param)) != 0) {
+			errx(1, "couldn't run dispatcher at SCHED_FIFO: %s",
+			    strerror(error));
+		}
+	}
+
+	(void) pthread_mutex_lock(&tsh_sched_lock);
+
+	if (tsh_sched_nthreads == tsh_sched_maxthreads) {
+		tsh_sched_maxthreads = tsh_sched_maxthreads ?
+		    tsh_sched_maxthreads * 2 : 64;
+		tsh_sched_threads = realloc(tsh_sched_threads,
+		    tsh_sched_maxthreads * sizeof (tsh_sched_thread_t));
+
+		if (tsh_sched_threads == NULL)
+			err(1, "couldn't allocate thread registry");
+	}
+
+	tsh_sched_self = tsh_sched_nthreads;
+	thr = &tsh_sched_threads[tsh_sched_nthreads++];
+	bzero(thr, sizeof (tsh_sched_thread_t));
+	thr->tsht_role = role;
+	thr->tsht_tid = tsh_sched_tid();
+	thr->tsht_migfd = tsh_perf_open(TSH_PERF_MIGRATIONS);
+	thr->tsht_ivcsw = tsh_sched_ivcsw(thr->tsht_tid);
+
+	(void) pthread_mutex_unlock(&tsh_sched_lock);
+}
+
+static boolean_t
+tsh_sched_readmigr(tsh_sched_thread_t *thr, uint64_t *migr)
+{
+	return (thr->tsht_migfd != -1 &&
+	    read(thr->tsht_migfd, migr, sizeof (*migr)) == sizeof (*migr));
+}
+
+/*
+ * Called by a registered thread that is about to exit, to record its final
+ * figures while they can still be read.
+ */
+void
+tsh_sched_exit(void)
+{
+	tsh_sched_thread_t *thr;
+
+	if (tsh_sched_self == -1)
+		return;
+
+	(void) pthread_mutex_lock(&tsh_sched_lock);
+	thr = &tsh_sched_threads[tsh_sched_self];
+
+	if (!tsh_sched_readmigr(thr, &thr->tsht_migr) &&
+	    thr->tsht_migfd != -1) {
+		(void) close(thr->tsht_migfd);
+		thr->tsht_migfd = -1;
+	}
+
+	thr->tsht_ivcswexit = tsh_sched_ivcsw(thr->tsht_tid);
+	thr->tsht_exited = B_TRUE;
+	(void) pthread_mutex_unlock(&tsh_sched_lock);
+}
+
+/*
+ * Report, for each role, the CPUs to which it was bound, and the migrations
+ * and involuntary context switches its threads have suffered since they
+ * registered.  Each line is prefixed with "who: ".
+ */
+void
+tsh_sched_report(FILE *out, const char *who)
+{
+	uint64_t migr[TSH_NROLES], val;
+	long ivcsw[TSH_NROLES], now;
+	boolean_t migrvalid[TSH_NROLES], ivcswvalid[TSH_NROLES];
+	int nthreads[TSH_NROLES];
+	char cpus[256];
+	tsh_sched_thread_t *thr;
+	int role, i;
+
+	if (!tsh_sched_active())
+		return;
+
+	bzero(migr, sizeof (migr));
+	bzero(ivcsw, sizeof (ivcsw));
+	bzero(nthreads, sizeof (nthreads));
+
+	for (role = 0; role < TSH_NROLES; role++)
+		migrvalid[role] = ivcswvalid[role] = B_TRUE;
+
+	(void) pthread_mutex_lock(&tsh_sched_lock);
+
+	for (i = 0; i < tsh_sched_nthreads; i++) {
+		thr = &tsh_sched_threads[i];
+		role = thr->tsht_role;
+		nthreads[role]++;
+
+		if (thr->tsht_exited && thr->tsht_migfd != -1) {
+			migr[role] += thr->tsht_migr;
+		} else if (tsh_sched_readmigr(thr, &val)) {
+			migr[role] += val;
+		} else {
+			migrvalid[role] = B_FALSE;
+		}
+
+		now = thr->tsht_exited ? thr->tsht_ivcswexit :
+		    tsh_sched_ivcsw(thr->tsht_tid);
+
+		if (thr->tsht_ivcsw != -1 && now != -1) {
+			ivcsw[role] += now - thr->tsht_ivcsw;
+		} else {
+			ivcswvalid[role] = B_FALSE;
+		}
+	}
+
+	(void) pthread_mutex_unlock(&tsh_sched_lock);
+
+	for (role = 0; role < TSH_NROLES; role++) {
+		if (nthreads[role] == 0)
+			continue;
+
+		if (tsh_sched_bound[role]) {
+			tsh_cpuset_format(&tsh_sched_cpus[role],
+			    cpus, sizeof (cpus));
+		} else {
+			(void) strcpy(cpus, "unbound");
+		}
+
+		(void) fprintf(out, "%s: %s (%d thread%s): cpus %s%s; ", who,
+		    tsh_role_names[role], nthreads[role],
+		    nthreads[role] == 1 ? "" : "s", cpus,
+		    role == TSH_ROLE_DISPATCHER && tsh_sched_rt ?
+		    ", SCHED_FIFO" : "");
+
+		if (migrvalid[role]) {
+			(void) fprintf(out, "%llu migrations, ",
+			    (unsigned long long)migr[role]);
+		} else {
+			(void) fprintf(out, "- migrations, ");
+		}
+
+		if (ivcswvalid[role]) {
+			(void) fprintf(out, "%ld involuntary switches\n",
+			    ivcsw[role]);
+		} else {
+			(void) fprintf(out, "- involuntary switches\n");
+		}
+	}
+
+	if (tsh_sched_mlock)
+		(void) fprintf(out, "%s: memory locked\n", who);
+}
@@ -0,0 +1,43 @@
+/*
+ * tsh_sched.h: a low-jitter execution profile for the tools' threads: binding
+ * each role (dispatcher, workers, reporter) to a set of CPUs, running the
+ * dispatcher in the real-time class, and locking memory.  Threads register
+ * as they start so that the migrations and involuntary context switches they
+ * suffer can be reported at the end of the run.
+ */
+
+#ifndef _TSH_SCHED_H
+#define	_TSH_SCHED_H
+
+#include <pthread.h>
+
+#include "tsh_compat.h"
+
+#define	TSH_MAXCPUS	1024
+
+typedef enum tsh_role {
+	TSH_ROLE_DISPATCHER = 0,	/* toshreplay's dispatcher */
+	TSH_ROLE_WORKERS,		/* threads that perform I/O */
+	TSH_ROLE_REPORTER,		/* toshstomp's reporting thread */
+	TSH_NROLES
+} tsh_role_t;
+
+typedef struct tsh_cpuset {
+	uint64_t	tshcs_mask[TSH_MAXCPUS / 64];	/* one bit per CPU */
+} tsh_cpuset_t;
+
+extern boolean_t tsh_sched_rt;
+extern boolean_t tsh_sched_mlock;
+
+extern boolean_t tsh_sched_active(void);
+extern void tsh_sched_affinity(const char *, unsigned int);
+extern void tsh_sched_init(const char *, int);
+extern void tsh_sched_stack(pthread_attr_t *, size_t);
+extern void tsh_sched_enter(tsh_role_t);
+extern void tsh_sched_exit(void);
+extern void tsh_sched_report(FILE *, const char *);
+
+extern int tsh_cpuset_parse(const char *, tsh_cpuset_t *);
+extern void tsh_cpuset_format(const tsh_cpuset_t *, char *, size_t);
+
+#endif /* _TSH_SCHED_H */